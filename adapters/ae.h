@@ -10,6 +10,7 @@ typedef struct redisAeEvents {
     aeEventLoop *loop;
     int fd;
     int reading, writing;
+    long long timer; /* Id of the time event, or -1 */
 } redisAeEvents;
 
 static void redisAeReadEvent(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -26,6 +27,15 @@ static void redisAeWriteEvent(aeEventLoop *el, int fd, void *privdata, int mask)
     redisAsyncHandleWrite(e->context);
 }
 
+static int redisAeTimeoutEvent(aeEventLoop *el, long long id, void *privdata) {
+    ((void)el); ((void)id);
+
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    e->timer = -1;
+    redisAsyncHandleTimeout(e->context);
+    return AE_NOMORE;
+}
+
 static void redisAeAddRead(void *privdata) {
     redisAeEvents *e = (redisAeEvents*)privdata;
     aeEventLoop *loop = e->loop;
@@ -62,10 +72,28 @@ static void redisAeDelWrite(void *privdata) {
     }
 }
 
+static void redisAeDelTimer(void *privdata) {
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    aeEventLoop *loop = e->loop;
+    if (e->timer != -1) {
+        aeDeleteTimeEvent(loop,e->timer);
+        e->timer = -1;
+    }
+}
+
+static void redisAeAddTimer(void *privdata, struct timeval tv) {
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    aeEventLoop *loop = e->loop;
+    redisAeDelTimer(privdata);
+    e->timer = aeCreateTimeEvent(loop,tv.tv_sec*1000+tv.tv_usec/1000,
+                                 redisAeTimeoutEvent,e,NULL);
+}
+
 static void redisAeCleanup(void *privdata) {
     redisAeEvents *e = (redisAeEvents*)privdata;
     redisAeDelRead(privdata);
     redisAeDelWrite(privdata);
+    redisAeDelTimer(privdata);
     free(e);
 }
 
@@ -83,6 +111,7 @@ static int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
     e->loop = loop;
     e->fd = c->fd;
     e->reading = e->writing = 0;
+    e->timer = -1;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = redisAeAddRead;
@@ -90,6 +119,8 @@ static int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
     ac->ev.addWrite = redisAeAddWrite;
     ac->ev.delWrite = redisAeDelWrite;
     ac->ev.cleanup = redisAeCleanup;
+    ac->ev.addTimer = redisAeAddTimer;
+    ac->ev.delTimer = redisAeDelTimer;
     ac->ev.data = e;
 
     return REDIS_OK;
@@ -11,6 +11,7 @@ typedef struct redisLibevEvents {
     struct ev_loop *loop;
     int reading, writing;
     ev_io rev, wev;
+    ev_timer timer;
 } redisLibevEvents;
 
 static void redisLibevReadEvent(EV_P_ ev_io *watcher, int revents) {
@@ -33,6 +34,16 @@ static void redisLibevWriteEvent(EV_P_ ev_io *watcher, int revents) {
     redisAsyncHandleWrite(e->context);
 }
 
+static void redisLibevTimeoutEvent(EV_P_ ev_timer *watcher, int revents) {
+#if EV_MULTIPLICITY
+    ((void)loop);
+#endif
+    ((void)revents);
+
+    redisLibevEvents *e = (redisLibevEvents*)watcher->data;
+    redisAsyncHandleTimeout(e->context);
+}
+
 static void redisLibevAddRead(void *privdata) {
     redisLibevEvents *e = (redisLibevEvents*)privdata;
     struct ev_loop *loop = e->loop;
@@ -73,10 +84,27 @@ static void redisLibevDelWrite(void *privdata) {
     }
 }
 
+static void redisLibevAddTimer(void *privdata, struct timeval tv) {
+    redisLibevEvents *e = (redisLibevEvents*)privdata;
+    struct ev_loop *loop = e->loop;
+    ((void)loop);
+    ev_timer_stop(EV_A_ &e->timer);
+    ev_timer_set(&e->timer,tv.tv_sec+tv.tv_usec/1000000.0,0.0);
+    ev_timer_start(EV_A_ &e->timer);
+}
+
+static void redisLibevDelTimer(void *privdata) {
+    redisLibevEvents *e = (redisLibevEvents*)privdata;
+    struct ev_loop *loop = e->loop;
+    ((void)loop);
+    ev_timer_stop(EV_A_ &e->timer);
+}
+
 static void redisLibevCleanup(void *privdata) {
     redisLibevEvents *e = (redisLibevEvents*)privdata;
     redisLibevDelRead(privdata);
     redisLibevDelWrite(privdata);
+    redisLibevDelTimer(privdata);
     free(e);
 }
 
@@ -99,6 +127,7 @@ static int redisLibevAttach(EV_P_ redisAsyncContext *ac) {
     e->reading = e->writing = 0;
     e->rev.data = e;
     e->wev.data = e;
+    e->timer.data = e;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = redisLibevAddRead;
@@ -106,11 +135,14 @@ static int redisLibevAttach(EV_P_ redisAsyncContext *ac) {
     ac->ev.addWrite = redisLibevAddWrite;
     ac->ev.delWrite = redisLibevDelWrite;
     ac->ev.cleanup = redisLibevCleanup;
+    ac->ev.addTimer = redisLibevAddTimer;
+    ac->ev.delTimer = redisLibevDelTimer;
     ac->ev.data = e;
 
-    /* Initialize read/write events */
+    /* Initialize read/write and timeout events */
     ev_io_init(&e->rev,redisLibevReadEvent,c->fd,EV_READ);
     ev_io_init(&e->wev,redisLibevWriteEvent,c->fd,EV_WRITE);
+    ev_timer_init(&e->timer,redisLibevTimeoutEvent,0.0,0.0);
     return REDIS_OK;
 }
 
@@ -6,7 +6,7 @@
 
 typedef struct redisLibeventEvents {
     redisAsyncContext *context;
-    struct event rev, wev;
+    struct event rev, wev, tev;
 } redisLibeventEvents;
 
 static void redisLibeventReadEvent(int fd, short event, void *arg) {
@@ -21,6 +21,12 @@ static void redisLibeventWriteEvent(int fd, short event, void *arg) {
     redisAsyncHandleWrite(e->context);
 }
 
+static void redisLibeventTimeoutEvent(int fd, short event, void *arg) {
+    ((void)fd); ((void)event);
+    redisLibeventEvents *e = (redisLibeventEvents*)arg;
+    redisAsyncHandleTimeout(e->context);
+}
+
 static void redisLibeventAddRead(void *privdata) {
     redisLibeventEvents *e = (redisLibeventEvents*)privdata;
     event_add(&e->rev,NULL);
@@ -41,10 +47,21 @@ static void redisLibeventDelWrite(void *privdata) {
     event_del(&e->wev);
 }
 
+static void redisLibeventAddTimer(void *privdata, struct timeval tv) {
+    redisLibeventEvents *e = (redisLibeventEvents*)privdata;
+    evtimer_add(&e->tev,&tv);
+}
+
+static void redisLibeventDelTimer(void *privdata) {
+    redisLibeventEvents *e = (redisLibeventEvents*)privdata;
+    evtimer_del(&e->tev);
+}
+
 static void redisLibeventCleanup(void *privdata) {
     redisLibeventEvents *e = (redisLibeventEvents*)privdata;
     event_del(&e->rev);
     event_del(&e->wev);
+    evtimer_del(&e->tev);
     free(e);
 }
 
@@ -66,13 +83,17 @@ static int redisLibeventAttach(redisAsyncContext *ac, struct event_base *base) {
     ac->ev.addWrite = redisLibeventAddWrite;
     ac->ev.delWrite = redisLibeventDelWrite;
     ac->ev.cleanup = redisLibeventCleanup;
+    ac->ev.addTimer = redisLibeventAddTimer;
+    ac->ev.delTimer = redisLibeventDelTimer;
     ac->ev.data = e;
 
-    /* Initialize and install read/write events */
+    /* Initialize and install read/write and timeout events */
     event_set(&e->rev,c->fd,EV_READ,redisLibeventReadEvent,e);
     event_set(&e->wev,c->fd,EV_WRITE,redisLibeventWriteEvent,e);
+    evtimer_set(&e->tev,redisLibeventTimeoutEvent,e);
     event_base_set(base,&e->rev);
     event_base_set(base,&e->wev);
+    event_base_set(base,&e->tev);
     return REDIS_OK;
 }
 #endif
@@ -8,7 +8,9 @@
 typedef struct redisLibuvEvents {
   redisAsyncContext* context;
   uv_poll_t          handle;
+  uv_timer_t         timer;
   int                events;
+  int                closed;
 } redisLibuvEvents;
 
 
@@ -72,10 +74,40 @@ static void redisLibuvDelWrite(void *privdata) {
 }
 
 
+#if UV_VERSION_MAJOR >= 1
+static void redisLibuvTimeout(uv_timer_t* timer) {
+#else
+static void redisLibuvTimeout(uv_timer_t* timer, int status) {
+  (void)status;
+#endif
+  redisLibuvEvents* p = (redisLibuvEvents*)timer->data;
+
+  redisAsyncHandleTimeout(p->context);
+}
+
+
+static void redisLibuvAddTimer(void *privdata, struct timeval tv) {
+  redisLibuvEvents* p = (redisLibuvEvents*)privdata;
+
+  uv_timer_start(&p->timer, redisLibuvTimeout,
+                 tv.tv_sec*1000 + tv.tv_usec/1000, 0);
+}
+
+
+static void redisLibuvDelTimer(void *privdata) {
+  redisLibuvEvents* p = (redisLibuvEvents*)privdata;
+
+  uv_timer_stop(&p->timer);
+}
+
+
 static void on_close(uv_handle_t* handle) {
   redisLibuvEvents* p = (redisLibuvEvents*)handle->data;
 
-  free(p);
+  /* Free the events once both handles are closed. */
+  if (++p->closed == 2) {
+    free(p);
+  }
 }
 
 
@@ -83,6 +115,7 @@ static void redisLibuvCleanup(void *privdata) {
   redisLibuvEvents* p = (redisLibuvEvents*)privdata;
 
   uv_close((uv_handle_t*)&p->handle, on_close);
+  uv_close((uv_handle_t*)&p->timer, on_close);
 }
 
 
@@ -98,6 +131,8 @@ int redisLibuvAttach(redisAsyncContext* ac, uv_loop_t* loop) {
   ac->ev.addWrite = redisLibuvAddWrite;
   ac->ev.delWrite = redisLibuvDelWrite;
   ac->ev.cleanup  = redisLibuvCleanup;
+  ac->ev.addTimer = redisLibuvAddTimer;
+  ac->ev.delTimer = redisLibuvDelTimer;
 
   redisLibuvEvents* p = malloc(sizeof(*p));
 
@@ -110,9 +145,11 @@ int redisLibuvAttach(redisAsyncContext* ac, uv_loop_t* loop) {
   if (uv_poll_init(loop, &p->handle, c->fd) != 0) {
     return REDIS_ERR;
   }
+  uv_timer_init(loop, &p->timer);
 
   ac->ev.data    = p;
   p->handle.data = p;
+  p->timer.data  = p;
   p->context     = ac;
 
   return REDIS_OK;
@@ -36,10 +36,16 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 #include "async.h"
 #include "net.h"
 #include "dict.c"
-#include "sds.h"
+
+/* Defined in hiredis.c */
+char *__redisLastCommand(redisContext *c, size_t len);
+void __redisDropLastCommand(redisContext *c, size_t len);
+int __redisReaderBuildsReplies(redisReader *r);
 
 #define _EL_ADD_READ(ctx) do { \
         if ((ctx)->ev.addRead) (ctx)->ev.addRead((ctx)->ev.data); \
@@ -56,51 +62,12 @@
 #define _EL_CLEANUP(ctx) do { \
         if ((ctx)->ev.cleanup) (ctx)->ev.cleanup((ctx)->ev.data); \
     } while(0);
-
-/* Forward declaration of function in hiredis.c */
-void __redisAppendCommand(redisContext *c, char *cmd, size_t len);
-
-/* Functions managing dictionary of callbacks for pub/sub. */
-static unsigned int callbackHash(const void *key) {
-    return dictGenHashFunction((const unsigned char *)key,
-                               sdslen((const sds)key));
-}
-
-static void *callbackValDup(void *privdata, const void *src) {
-    ((void) privdata);
-    redisCallback *dup = malloc(sizeof(*dup));
-    memcpy(dup,src,sizeof(*dup));
-    return dup;
-}
-
-static int callbackKeyCompare(void *privdata, const void *key1, const void *key2) {
-    int l1, l2;
-    ((void) privdata);
-
-    l1 = sdslen((const sds)key1);
-    l2 = sdslen((const sds)key2);
-    if (l1 != l2) return 0;
-    return memcmp(key1,key2,l1) == 0;
-}
-
-static void callbackKeyDestructor(void *privdata, void *key) {
-    ((void) privdata);
-    sdsfree((sds)key);
-}
-
-static void callbackValDestructor(void *privdata, void *val) {
-    ((void) privdata);
-    free(val);
-}
-
-static dictType callbackDict = {
-    callbackHash,
-    NULL,
-    callbackValDup,
-    callbackKeyCompare,
-    callbackKeyDestructor,
-    callbackValDestructor
-};
+#define _EL_ADD_TIMER(ctx, tv) do { \
+        if ((ctx)->ev.addTimer) (ctx)->ev.addTimer((ctx)->ev.data,(tv)); \
+    } while(0)
+#define _EL_DEL_TIMER(ctx) do { \
+        if ((ctx)->ev.delTimer) (ctx)->ev.delTimer((ctx)->ev.data); \
+    } while(0)
 
 static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     redisAsyncContext *ac;
@@ -126,16 +93,24 @@ static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     ac->ev.addWrite = NULL;
     ac->ev.delWrite = NULL;
     ac->ev.cleanup = NULL;
+    ac->ev.addTimer = NULL;
+    ac->ev.delTimer = NULL;
 
     ac->onConnect = NULL;
     ac->onDisconnect = NULL;
-
-    ac->replies.head = NULL;
-    ac->replies.tail = NULL;
-    ac->sub.invalid.head = NULL;
-    ac->sub.invalid.tail = NULL;
-    ac->sub.channels = dictCreate(&callbackDict,NULL);
-    ac->sub.patterns = dictCreate(&callbackDict,NULL);
+    ac->push.fn = NULL;
+    ac->push.privdata = NULL;
+    ac->push.timer = NULL;
+    ac->push.timedout = 0;
+
+    memset(&ac->replies,0,sizeof(ac->replies));
+    memset(&ac->sub.invalid,0,sizeof(ac->sub.invalid));
+    memset(&ac->timeout,0,sizeof(ac->timeout));
+    ac->sub.channels = dictCreate(sizeof(redisCallback));
+    ac->sub.patterns = dictCreate(sizeof(redisCallback));
+    ac->sub.lastChannel = NULL;
+    ac->sub.lastPattern = NULL;
+    ac->sub.message = NULL;
     return ac;
 }
 
@@ -199,45 +174,285 @@ int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallba
     return REDIS_ERR;
 }
 
-/* Helper functions to push/shift callbacks */
-static int __redisPushCallback(redisCallbackList *list, redisCallback *source) {
-    redisCallback *cb;
+int redisAsyncSetPushCallback(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata) {
+    ac->push.fn = fn;
+    ac->push.privdata = privdata;
+    return REDIS_OK;
+}
+
+int redisAsyncSetMessageCallback(redisAsyncContext *ac, redisMessageCallbackFn *fn) {
+    ac->sub.message = fn;
+    return REDIS_OK;
+}
 
-    /* Copy callback from stack to heap */
-    cb = malloc(sizeof(*cb));
-    if (cb == NULL)
-        return REDIS_ERR_OOM;
+/* Number of slots a callback queue starts with. */
+#define REDIS_CALLBACK_SLOTS 16
 
-    if (source != NULL) {
-        memcpy(cb,source,sizeof(*cb));
-        cb->next = NULL;
+/* Helper functions to push/shift callbacks */
+static int __redisPushCallback(redisCallbackList *list, redisCallback *source) {
+    redisCallback *slots, *cb;
+    size_t size, first;
+
+    /* Double the ring when it is full, moving the callbacks to the start of
+     * the new one in order. */
+    if (list->count == list->size) {
+        size = list->size ? list->size*2 : REDIS_CALLBACK_SLOTS;
+        slots = malloc(sizeof(*slots)*size);
+        if (slots == NULL)
+            return REDIS_ERR_OOM;
+        first = list->size-list->head;
+        if (list->count > 0) {
+            memcpy(slots,list->slots+list->head,sizeof(*slots)*first);
+            memcpy(slots+first,list->slots,sizeof(*slots)*list->head);
+        }
+        free(list->slots);
+        list->slots = slots;
+        list->size = size;
+        list->head = 0;
     }
 
-    /* Store callback in list */
-    if (list->head == NULL)
-        list->head = cb;
-    if (list->tail != NULL)
-        list->tail->next = cb;
-    list->tail = cb;
+    cb = &list->slots[(list->head+list->count) & (list->size-1)];
+    if (source != NULL)
+        *cb = *source;
+    list->count++;
     return REDIS_OK;
 }
 
 static int __redisShiftCallback(redisCallbackList *list, redisCallback *target) {
-    redisCallback *cb = list->head;
-    if (cb != NULL) {
-        list->head = cb->next;
-        if (cb == list->tail)
-            list->tail = NULL;
-
-        /* Copy callback from heap to stack */
+    if (list->count > 0) {
         if (target != NULL)
-            memcpy(target,cb,sizeof(*cb));
-        free(cb);
+            *target = list->slots[list->head];
+        list->head = (list->head+1) & (list->size-1);
+        list->count--;
+        list->shifted++;
         return REDIS_OK;
     }
     return REDIS_ERR;
 }
 
+/* Timeouts of queued commands are kept in a hierarchical timer wheel with a
+ * resolution of 1ms. Level 0 has a slot for each of the next 64ms, and every
+ * next level has slots that are 64 times as long. The slots of a level are
+ * moved to the lower levels when their time comes. */
+#define REDIS_WHEEL_BITS 6
+#define REDIS_WHEEL_SLOTS (1 << REDIS_WHEEL_BITS)
+#define REDIS_WHEEL_MASK (REDIS_WHEEL_SLOTS-1)
+#define REDIS_WHEEL_LEVELS 4
+
+typedef struct redisTimer {
+    struct redisTimer *next;
+    struct redisTimer **pprev; /* The pointer that points to this timer */
+    long long expires; /* Milliseconds on the monotonic clock */
+    unsigned long long seq; /* Number of the callback in ac->replies */
+} redisTimer;
+
+typedef struct redisTimerWheel {
+    redisTimer *slots[REDIS_WHEEL_LEVELS][REDIS_WHEEL_SLOTS];
+    redisTimer *expired; /* Timers that expired and wait to be handled */
+    redisTimer *free; /* Unused timers */
+    long long now; /* Time the wheel was advanced to */
+    long long wake; /* When the timer of the event library fires, or 0 */
+    size_t count; /* Timers in slots or in the expired list */
+} redisTimerWheel;
+
+static long long __redisMonotonicMs(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000+ts.tv_nsec/1000000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (long long)tv.tv_sec*1000+tv.tv_usec/1000;
+#endif
+}
+
+static void __redisTimerLink(redisTimer **head, redisTimer *t) {
+    t->next = *head;
+    t->pprev = head;
+    if (*head != NULL)
+        (*head)->pprev = &t->next;
+    *head = t;
+}
+
+static void __redisTimerUnlink(redisTimer *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+}
+
+/* Put a timer in the slot that covers its expiry time. Timers that expire
+ * beyond the last level wait in its last slot and are put back later. */
+static void __redisWheelLink(redisTimerWheel *w, redisTimer *t) {
+    long long at = t->expires, delta;
+    int level = 0;
+
+    /* Timers only expire late. The slot of the current time is handled
+     * right after the next level was spread over the lower ones. */
+    if (at < w->now)
+        at = w->now;
+    delta = at-w->now;
+    if (delta >= 1LL << (REDIS_WHEEL_BITS*REDIS_WHEEL_LEVELS)) {
+        at = w->now+(1LL << (REDIS_WHEEL_BITS*REDIS_WHEEL_LEVELS))-1;
+        delta = at-w->now;
+    }
+    while (delta >= 1LL << (REDIS_WHEEL_BITS*(level+1)))
+        level++;
+    __redisTimerLink(&w->slots[level][(at >> (REDIS_WHEEL_BITS*level)) & REDIS_WHEEL_MASK],t);
+}
+
+/* Move the timers that expire until "now" to the expired list. */
+static void __redisWheelAdvance(redisTimerWheel *w, long long now) {
+    redisTimer *t, *list;
+    int level;
+
+    while (w->now < now) {
+        if (w->count == 0) {
+            w->now = now;
+            break;
+        }
+        w->now++;
+
+        /* When the time in a level wraps, the current slot of the next level
+         * is spread over the lower ones. */
+        for (level = REDIS_WHEEL_LEVELS-1; level > 0; level--) {
+            if (w->now & ((1LL << (REDIS_WHEEL_BITS*level))-1))
+                continue;
+            list = w->slots[level][(w->now >> (REDIS_WHEEL_BITS*level)) & REDIS_WHEEL_MASK];
+            w->slots[level][(w->now >> (REDIS_WHEEL_BITS*level)) & REDIS_WHEEL_MASK] = NULL;
+            while ((t = list) != NULL) {
+                list = t->next;
+                __redisWheelLink(w,t);
+            }
+        }
+
+        while ((t = w->slots[0][w->now & REDIS_WHEEL_MASK]) != NULL) {
+            __redisTimerUnlink(t);
+            __redisTimerLink(&w->expired,t);
+        }
+    }
+}
+
+/* Time the wheel has to be advanced to next: when the first timer in level 0
+ * expires, or when the first timers in a higher level are spread over the
+ * lower ones, whichever comes first. */
+static long long __redisWheelNext(redisTimerWheel *w) {
+    long long next = w->now+(1LL << (REDIS_WHEEL_BITS*REDIS_WHEEL_LEVELS));
+    long long at;
+    int level, shift, i;
+
+    if (w->expired != NULL)
+        return w->now;
+    for (level = 0; level < REDIS_WHEEL_LEVELS; level++) {
+        shift = REDIS_WHEEL_BITS*level;
+        for (i = 1; i <= REDIS_WHEEL_SLOTS; i++) {
+            at = ((w->now >> shift)+i) << shift;
+            if (at >= next)
+                break;
+            if (w->slots[level][(at >> shift) & REDIS_WHEEL_MASK] != NULL) {
+                next = at;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+/* Ask the event library to call redisAsyncHandleTimeout before the next
+ * timer expires, when it doesn't do so already. */
+static void __redisScheduleTimeout(redisAsyncContext *ac, long long now) {
+    redisTimerWheel *w = ac->timeout.wheel;
+    long long next;
+    struct timeval tv;
+
+    if (w->count == 0)
+        return;
+    next = __redisWheelNext(w);
+    if (w->wake != 0 && w->wake <= next)
+        return;
+    w->wake = next;
+    next = next > now ? next-now : 0;
+    tv.tv_sec = next/1000;
+    tv.tv_usec = (next%1000)*1000;
+    _EL_ADD_TIMER(ac,tv);
+}
+
+/* Set the timeout of the command that was queued last. */
+static int __redisAddTimeout(redisAsyncContext *ac) {
+    redisCallbackList *list = &ac->replies;
+    redisTimerWheel *w = ac->timeout.wheel;
+    long long now = __redisMonotonicMs();
+    redisTimer *t;
+
+    if (w == NULL) {
+        if ((w = calloc(1,sizeof(*w))) == NULL)
+            return REDIS_ERR;
+        w->now = now;
+        ac->timeout.wheel = w;
+    }
+    if ((t = w->free) != NULL) {
+        w->free = t->next;
+    } else if ((t = malloc(sizeof(*t))) == NULL) {
+        return REDIS_ERR;
+    }
+
+    /* An empty wheel doesn't need to catch up. */
+    if (w->count == 0 && w->expired == NULL)
+        w->now = now;
+    t->expires = now+ac->timeout.ms;
+    t->seq = list->shifted+list->count-1;
+    __redisWheelLink(w,t);
+    w->count++;
+    list->slots[(list->head+list->count-1) & (list->size-1)].timer = t;
+    __redisScheduleTimeout(ac,now);
+    return REDIS_OK;
+}
+
+/* Called with a callback that was shifted for a reply. Its timer is no
+ * longer needed, and when the command timed out, the reply is dropped. */
+static void __redisClearTimeout(redisAsyncContext *ac, redisCallback *cb) {
+    redisTimerWheel *w = ac->timeout.wheel;
+
+    if (cb->timer != NULL) {
+        __redisTimerUnlink(cb->timer);
+        cb->timer->next = w->free;
+        w->free = cb->timer;
+        w->count--;
+        cb->timer = NULL;
+    }
+    if (cb->timedout) {
+        ac->timeout.expired--;
+        cb->fn = NULL;
+    }
+}
+
+static void __redisFreeTimeouts(redisAsyncContext *ac) {
+    redisTimerWheel *w = ac->timeout.wheel;
+    redisTimer *t;
+    int level, slot;
+
+    if (w == NULL)
+        return;
+    for (level = 0; level < REDIS_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < REDIS_WHEEL_SLOTS; slot++) {
+            while ((t = w->slots[level][slot]) != NULL) {
+                w->slots[level][slot] = t->next;
+                free(t);
+            }
+        }
+    }
+    while ((t = w->expired) != NULL) {
+        w->expired = t->next;
+        free(t);
+    }
+    while ((t = w->free) != NULL) {
+        w->free = t->next;
+        free(t);
+    }
+    free(w);
+    ac->timeout.wheel = NULL;
+}
+
 static void __redisRunCallback(redisAsyncContext *ac, redisCallback *cb, redisReply *reply) {
     redisContext *c = &(ac->c);
     if (cb->fn != NULL) {
@@ -251,28 +466,34 @@ static void __redisRunCallback(redisAsyncContext *ac, redisCallback *cb, redisRe
 static void __redisAsyncFree(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     redisCallback cb;
-    dictIterator *it;
     dictEntry *de;
+    unsigned long cursor;
 
-    /* Execute pending callbacks with NULL reply. */
+    /* Execute pending callbacks with NULL reply, except the ones that
+     * already ran because their command timed out. */
     while (__redisShiftCallback(&ac->replies,&cb) == REDIS_OK)
-        __redisRunCallback(ac,&cb,NULL);
+        if (!cb.timedout)
+            __redisRunCallback(ac,&cb,NULL);
 
     /* Execute callbacks for invalid commands */
     while (__redisShiftCallback(&ac->sub.invalid,&cb) == REDIS_OK)
         __redisRunCallback(ac,&cb,NULL);
+    free(ac->replies.slots);
+    free(ac->sub.invalid.slots);
+    if (ac->timeout.wheel != NULL) {
+        _EL_DEL_TIMER(ac);
+        __redisFreeTimeouts(ac);
+    }
 
     /* Run subscription callbacks callbacks with NULL reply */
-    it = dictGetIterator(ac->sub.channels);
-    while ((de = dictNext(it)) != NULL)
+    cursor = 0;
+    while ((de = dictNext(ac->sub.channels,&cursor)) != NULL)
         __redisRunCallback(ac,dictGetEntryVal(de),NULL);
-    dictReleaseIterator(it);
     dictRelease(ac->sub.channels);
 
-    it = dictGetIterator(ac->sub.patterns);
-    while ((de = dictNext(it)) != NULL)
+    cursor = 0;
+    while ((de = dictNext(ac->sub.patterns,&cursor)) != NULL)
         __redisRunCallback(ac,dictGetEntryVal(de),NULL);
-    dictReleaseIterator(it);
     dictRelease(ac->sub.patterns);
 
     /* Signal event lib to clean up */
@@ -333,41 +554,156 @@ static void __redisAsyncDisconnect(redisAsyncContext *ac) {
 void redisAsyncDisconnect(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     c->flags |= REDIS_DISCONNECTING;
-    if (!(c->flags & REDIS_IN_CALLBACK) && ac->replies.head == NULL)
+    if (!(c->flags & REDIS_IN_CALLBACK) && ac->replies.count == 0)
         __redisAsyncDisconnect(ac);
 }
 
-static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply, redisCallback *dstcb) {
+/* Kinds of pub/sub replies. The pattern variants have PUBSUB_PATTERN set. */
+#define PUBSUB_NONE 0
+#define PUBSUB_MESSAGE 1
+#define PUBSUB_SUBSCRIBE 2
+#define PUBSUB_UNSUBSCRIBE 3
+#define PUBSUB_PATTERN 4
+
+/* Classifies a pub/sub reply by its first element. This is done once per
+ * reply, so the hot path compares the type string only once. */
+static int __redisPubsubKind(redisReply *reply) {
+    redisReply *t;
+    const char *s;
+    size_t len;
+    int kind = 0;
+
+    if (reply->elements < 2 || reply->element[0]->type != REDIS_REPLY_STRING)
+        return PUBSUB_NONE;
+    t = reply->element[0];
+    s = t->str;
+    len = t->len;
+    if (len > 0 && tolower(s[0]) == 'p') {
+        kind = PUBSUB_PATTERN;
+        s++;
+        len--;
+    }
+
+    switch(len) {
+    case 7:
+        if (strncasecmp(s,"message",7) == 0) return kind|PUBSUB_MESSAGE;
+        break;
+    case 9:
+        if (strncasecmp(s,"subscribe",9) == 0) return kind|PUBSUB_SUBSCRIBE;
+        break;
+    case 11:
+        if (strncasecmp(s,"unsubscribe",11) == 0) return kind|PUBSUB_UNSUBSCRIBE;
+        break;
+    }
+    return kind|PUBSUB_NONE;
+}
+
+/* Finds the subscription for the channel or pattern "name" without copying
+ * it to a key first. "last" caches the entry of the previous match, which
+ * is all that's needed when messages keep arriving on the same channel. */
+static dictEntry *__redisFindSubscription(dict *d, dictEntry **last, const char *name, size_t len) {
+    dictEntry *de = *last;
+
+    if (de != NULL && de->keylen == len && memcmp(de->key,name,len) == 0)
+        return de;
+    if ((de = dictFind(d,name,len)) != NULL)
+        *last = de;
+    return de;
+}
+
+/* Reply callback of messages when the message callback is set: passes the
+ * reply on as a redisMessage. */
+static void __redisMessageReply(redisAsyncContext *ac, void *reply, void *privdata) {
+    redisReply *r = reply, *pattern = NULL;
+    redisMessage msg;
+
+    if (r == NULL || ac->sub.message == NULL || r->elements < 3)
+        return;
+    if (r->elements > 3)
+        pattern = r->element[1];
+
+    msg.type = pattern ? REDIS_MESSAGE_PATTERN : REDIS_MESSAGE;
+    msg.pattern = pattern ? pattern->str : NULL;
+    msg.patternlen = pattern ? (size_t)pattern->len : 0;
+    msg.channel = r->element[r->elements-2]->str;
+    msg.channellen = r->element[r->elements-2]->len;
+    msg.payload = r->element[r->elements-1]->str;
+    msg.payloadlen = r->element[r->elements-1]->len;
+    ac->sub.message(ac,&msg,privdata);
+}
+
+/* Deliver the messages at the front of the reader buffer to the message
+ * callback without building replies for them. Returns REDIS_ERR when the
+ * context was free'd by a callback. */
+static int __redisDispatchMessages(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
-    dict *callbacks;
+    redisMessage msg;
     dictEntry *de;
-    int pvariant;
-    char *stype;
-    sds sname;
+    redisCallback *cb;
+
+    while (ac->sub.message != NULL &&
+           redisReaderGetMessage(c->reader,&msg) == REDIS_OK &&
+           msg.type != REDIS_MESSAGE_NONE)
+    {
+        if (msg.type == REDIS_MESSAGE_PATTERN)
+            de = __redisFindSubscription(ac->sub.patterns,&ac->sub.lastPattern,
+                                         msg.pattern,msg.patternlen);
+        else
+            de = __redisFindSubscription(ac->sub.channels,&ac->sub.lastChannel,
+                                         msg.channel,msg.channellen);
+        if (de == NULL)
+            continue;
+
+        cb = dictGetEntryVal(de);
+        c->flags |= REDIS_IN_CALLBACK;
+        ac->sub.message(ac,&msg,cb->privdata);
+        c->flags &= ~REDIS_IN_CALLBACK;
+
+        /* Proceed with free'ing when redisAsyncFree() was called. */
+        if (c->flags & REDIS_FREEING) {
+            __redisAsyncFree(ac);
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply, int kind, redisCallback *dstcb) {
+    redisContext *c = &(ac->c);
+    dict *callbacks;
+    dictEntry *de, **last;
+    redisReply *name;
 
     /* Custom reply functions are not supported for pub/sub. This will fail
      * very hard when they are used... */
-    if (reply->type == REDIS_REPLY_ARRAY) {
+    if (reply->type == REDIS_REPLY_ARRAY || reply->type == REDIS_REPLY_PUSH) {
         assert(reply->elements >= 2);
         assert(reply->element[0]->type == REDIS_REPLY_STRING);
-        stype = reply->element[0]->str;
-        pvariant = (tolower(stype[0]) == 'p') ? 1 : 0;
 
-        if (pvariant)
+        if (kind & PUBSUB_PATTERN) {
             callbacks = ac->sub.patterns;
-        else
+            last = &ac->sub.lastPattern;
+        } else {
             callbacks = ac->sub.channels;
+            last = &ac->sub.lastChannel;
+        }
 
-        /* Locate the right callback */
-        assert(reply->element[1]->type == REDIS_REPLY_STRING);
-        sname = sdsnewlen(reply->element[1]->str,reply->element[1]->len);
-        de = dictFind(callbacks,sname);
+        /* Locate the right callback. Messages for channels without one
+         * are dropped. */
+        dstcb->fn = NULL;
+        dstcb->privdata = NULL;
+        name = reply->element[1];
+        assert(name->type == REDIS_REPLY_STRING);
+        de = __redisFindSubscription(callbacks,last,name->str,name->len);
         if (de != NULL) {
             memcpy(dstcb,dictGetEntryVal(de),sizeof(*dstcb));
+            if (ac->sub.message != NULL && (kind & ~PUBSUB_PATTERN) == PUBSUB_MESSAGE)
+                dstcb->fn = __redisMessageReply;
 
             /* If this is an unsubscribe message, remove it. */
-            if (strcasecmp(stype+pvariant,"unsubscribe") == 0) {
-                dictDelete(callbacks,sname);
+            if ((kind & ~PUBSUB_PATTERN) == PUBSUB_UNSUBSCRIBE) {
+                if (*last == de) *last = NULL;
+                dictDelete(callbacks,de);
 
                 /* If this was the last unsubscribe message, revert to
                  * non-subscribe mode. */
@@ -376,7 +712,6 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
                     c->flags &= ~REDIS_SUBSCRIBED;
             }
         }
-        sdsfree(sname);
     } else {
         /* Shift callback for invalid commands. */
         __redisShiftCallback(&ac->sub.invalid,dstcb);
@@ -384,17 +719,45 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
     return REDIS_OK;
 }
 
+/* Called for the first push reply. Replies to commands sent while subscribed
+ * are not pub/sub messages on this connection, so their callbacks are queued
+ * after the regular ones, which were all sent before the subscription. */
+static void __redisEnablePushReplies(redisAsyncContext *ac) {
+    redisCallback cb;
+
+    ac->c.flags |= REDIS_PUSH_REPLIES;
+    while (ac->sub.invalid.count > 0) {
+        cb = ac->sub.invalid.slots[ac->sub.invalid.head];
+        if (__redisPushCallback(&ac->replies,&cb) != REDIS_OK)
+            break;
+        __redisShiftCallback(&ac->sub.invalid,NULL);
+    }
+}
+
 void redisProcessCallbacks(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     redisCallback cb;
     void *reply = NULL;
-    int status;
+    int status, kind, replies;
+
+    /* Push replies can only be told apart when the reader builds redisReply
+     * objects: custom reply objects are passed to the callbacks in order. */
+    replies = __redisReaderBuildsReplies(c->reader);
+
+    for (;;) {
+        /* Messages that can be decoded in place skip the reply objects. An
+         * array can only be a message when no command waits for a reply. */
+        if (ac->sub.message != NULL && (c->flags & REDIS_SUBSCRIBED) &&
+            ac->replies.count == 0 && __redisDispatchMessages(ac) != REDIS_OK)
+            return;
+
+        if ((status = redisGetReply(c,&reply)) != REDIS_OK)
+            break;
 
-    while((status = redisGetReply(c,&reply)) == REDIS_OK) {
         if (reply == NULL) {
             /* When the connection is being disconnected and there are
              * no more replies, this is the cue to really disconnect. */
-            if (c->flags & REDIS_DISCONNECTING && sdslen(c->obuf) == 0) {
+            if (c->flags & REDIS_DISCONNECTING && redisPendingBytes(c) == 0) {
                 __redisAsyncDisconnect(ac);
                 return;
             }
@@ -409,9 +772,24 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
             break;
         }
 
-        /* Even if the context is subscribed, pending regular callbacks will
+        /* Out-of-band push replies (RESP3) never answer a command, so they
+         * don't shift a callback: pub/sub messages go to the subscription
+         * callbacks and everything else to the push callback. Otherwise,
+         * even if the context is subscribed, pending regular callbacks will
          * get a reply before pub/sub messages arrive. */
-        if (__redisShiftCallback(&ac->replies,&cb) != REDIS_OK) {
+        if (replies && ((redisReply*)reply)->type == REDIS_REPLY_PUSH) {
+            if (!(c->flags & REDIS_PUSH_REPLIES))
+                __redisEnablePushReplies(ac);
+            cb.fn = NULL;
+            cb.privdata = NULL;
+            kind = __redisPubsubKind(reply);
+            if ((kind & ~PUBSUB_PATTERN) != PUBSUB_NONE)
+                __redisGetSubscribeCallback(ac,reply,kind,&cb);
+            else
+                cb = ac->push;
+        } else if (__redisShiftCallback(&ac->replies,&cb) == REDIS_OK) {
+            __redisClearTimeout(ac,&cb);
+        } else {
             /*
              * A spontaneous reply in a not-subscribed context can be the error
              * reply that is sent when a new connection exceeds the maximum
@@ -436,7 +814,7 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
             /* No more regular callbacks and no errors, the context *must* be subscribed or monitoring. */
             assert((c->flags & REDIS_SUBSCRIBED || c->flags & REDIS_MONITORING));
             if(c->flags & REDIS_SUBSCRIBED)
-                __redisGetSubscribeCallback(ac,reply,&cb);
+                __redisGetSubscribeCallback(ac,reply,__redisPubsubKind(reply),&cb);
         }
 
         if (cb.fn != NULL) {
@@ -535,6 +913,70 @@ void redisAsyncHandleWrite(redisAsyncContext *ac) {
     }
 }
 
+int redisAsyncSetTimeout(redisAsyncContext *ac, struct timeval tv, unsigned int limit) {
+    if (tv.tv_sec < 0 || tv.tv_usec < 0)
+        return REDIS_ERR;
+
+    /* Round up to the resolution of the timer wheel. */
+    ac->timeout.ms = (long long)tv.tv_sec*1000+(tv.tv_usec+999)/1000;
+    ac->timeout.limit = limit;
+    return REDIS_OK;
+}
+
+/* Run the callbacks of commands that timed out. Their slots stay in the
+ * queue, so replies still match their commands when they arrive later. */
+void redisAsyncHandleTimeout(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    redisCallbackList *list = &ac->replies;
+    redisTimerWheel *w = ac->timeout.wheel;
+    long long now = __redisMonotonicMs();
+    redisCallback *slot, cb;
+    redisTimer *t;
+
+    if (w == NULL)
+        return;
+    w->wake = 0;
+    __redisWheelAdvance(w,now);
+    while ((t = w->expired) != NULL) {
+        __redisTimerUnlink(t);
+        t->next = w->free;
+        w->free = t;
+        w->count--;
+
+        assert(t->seq >= list->shifted && t->seq < list->shifted+list->count);
+        slot = &list->slots[(list->head+(t->seq-list->shifted)) & (list->size-1)];
+        slot->timer = NULL;
+        slot->timedout = 1;
+        ac->timeout.expired++;
+        cb = *slot;
+
+        c->err = REDIS_ERR_TIMEOUT;
+        snprintf(c->errstr,sizeof(c->errstr),"Timeout");
+        __redisAsyncCopyError(ac);
+        __redisRunCallback(ac,&cb,NULL);
+
+        /* Proceed with free'ing when redisAsyncFree() was called. */
+        if (c->flags & REDIS_FREEING) {
+            __redisAsyncFree(ac);
+            return;
+        }
+
+        /* Too many commands without a reply: the connection is stuck. */
+        if (ac->timeout.limit > 0 && ac->timeout.expired >= ac->timeout.limit) {
+            __redisAsyncDisconnect(ac);
+            return;
+        }
+        c->err = 0;
+        c->errstr[0] = '\0';
+        __redisAsyncCopyError(ac);
+    }
+
+    if (w->count == 0)
+        _EL_DEL_TIMER(ac);
+    else
+        __redisScheduleTimeout(ac,now);
+}
+
 /* Sets a pointer to the first argument and its length starting at p. Returns
  * the number of bytes to skip to get to the following argument. */
 static char *nextArgument(char *start, char **str, size_t *len) {
@@ -551,26 +993,28 @@ static char *nextArgument(char *start, char **str, size_t *len) {
     return p+2+(*len)+2;
 }
 
-/* Helper function for the redisAsyncCommand* family of functions. Writes a
- * formatted command to the output buffer and registers the provided callback
- * function with the context. */
-static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, char *cmd, size_t len) {
+/* Helper function for the redisAsyncCommand* family of functions. Registers
+ * the provided callback function for the command of "len" bytes that was just
+ * written to the end of the output buffer, or removes the command from the
+ * buffer again when it can't be sent. */
+static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, size_t len) {
     redisContext *c = &(ac->c);
     redisCallback cb;
     int pvariant, hasnext;
-    char *cstr, *astr;
+    char *cmd, *cstr, *astr;
     size_t clen, alen;
     char *p;
-    sds sname;
-
-    /* Don't accept new commands when the connection is about to be closed. */
-    if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING)) return REDIS_ERR;
+    dict *callbacks;
+    void *val;
 
     /* Setup callback */
     cb.fn = fn;
     cb.privdata = privdata;
+    cb.timer = NULL;
+    cb.timedout = 0;
 
     /* Find out which command will be appended. */
+    cmd = __redisLastCommand(c,len);
     p = nextArgument(cmd,&cstr,&clen);
     assert(p != NULL);
     hasnext = (p[0] == '$');
@@ -581,51 +1025,72 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
     if (hasnext && strncasecmp(cstr,"subscribe\r\n",11) == 0) {
         c->flags |= REDIS_SUBSCRIBED;
 
-        /* Add every channel/pattern to the list of subscription callbacks. */
+        /* Add every channel/pattern to the list of subscription callbacks.
+         * Room for all of them is made up front, so subscribing to many
+         * channels at once grows the table at most once. */
+        callbacks = pvariant ? ac->sub.patterns : ac->sub.channels;
+        dictExpand(callbacks,dictSize(callbacks)+strtoul(cmd+1,NULL,10)-1);
         while ((p = nextArgument(p,&astr,&alen)) != NULL) {
-            sname = sdsnewlen(astr,alen);
-            if (pvariant)
-                dictReplace(ac->sub.patterns,sname,&cb);
-            else
-                dictReplace(ac->sub.channels,sname,&cb);
+            if ((val = dictAdd(callbacks,astr,alen,NULL)) != NULL)
+                memcpy(val,&cb,sizeof(cb));
         }
     } else if (strncasecmp(cstr,"unsubscribe\r\n",13) == 0) {
         /* It is only useful to call (P)UNSUBSCRIBE when the context is
          * subscribed to one or more channels or patterns. */
-        if (!(c->flags & REDIS_SUBSCRIBED)) return REDIS_ERR;
+        if (!(c->flags & REDIS_SUBSCRIBED)) {
+            __redisDropLastCommand(c,len);
+            return REDIS_ERR;
+        }
 
         /* (P)UNSUBSCRIBE does not have its own response: every channel or
          * pattern that is unsubscribed will receive a message. This means we
          * should not append a callback function for this command. */
      } else if(strncasecmp(cstr,"monitor\r\n",9) == 0) {
          /* Set monitor flag and push callback */
+         if (__redisPushCallback(&ac->replies,&cb) != REDIS_OK) {
+             __redisDropLastCommand(c,len);
+             return REDIS_ERR;
+         }
          c->flags |= REDIS_MONITORING;
-         __redisPushCallback(&ac->replies,&cb);
+    } else if ((c->flags & REDIS_SUBSCRIBED) &&
+               !(c->flags & REDIS_PUSH_REPLIES)) {
+        /* This will likely result in an error reply, but it needs to be
+         * received and passed to the callback. */
+        if (__redisPushCallback(&ac->sub.invalid,&cb) != REDIS_OK) {
+            __redisDropLastCommand(c,len);
+            return REDIS_ERR;
+        }
     } else {
-        if (c->flags & REDIS_SUBSCRIBED)
-            /* This will likely result in an error reply, but it needs to be
-             * received and passed to the callback. */
-            __redisPushCallback(&ac->sub.invalid,&cb);
-        else
-            __redisPushCallback(&ac->replies,&cb);
+        if (__redisPushCallback(&ac->replies,&cb) != REDIS_OK) {
+            __redisDropLastCommand(c,len);
+            return REDIS_ERR;
+        }
+        if (ac->timeout.ms > 0 && __redisAddTimeout(ac) != REDIS_OK) {
+            /* Take the callback back out: the command isn't sent. */
+            ac->replies.count--;
+            __redisDropLastCommand(c,len);
+            return REDIS_ERR;
+        }
     }
 
-    __redisAppendCommand(c,cmd,len);
-
     /* Always schedule a write when the write buffer is non-empty */
     _EL_ADD_WRITE(ac);
 
     return REDIS_OK;
 }
 
+/* Commands are formatted straight into the output buffer, unless the
+ * connection is about to be closed. */
+#define __redisAsyncAccepting(ac) \
+    (!((ac)->c.flags & (REDIS_DISCONNECTING | REDIS_FREEING)))
+
 int redisvAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, va_list ap) {
-    char *cmd;
-    int len;
-    int status;
-    len = redisvFormatCommand(&cmd,format,ap);
-    status = __redisAsyncCommand(ac,fn,privdata,cmd,len);
-    free(cmd);
-    return status;
+    size_t pending = redisPendingBytes(&ac->c);
+
+    if (!__redisAsyncAccepting(ac) ||
+        redisvAppendCommand(&ac->c,format,ap) != REDIS_OK)
+        return REDIS_ERR;
+    return __redisAsyncCommand(ac,fn,privdata,redisPendingBytes(&ac->c)-pending);
 }
 
 int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, ...) {
@@ -638,11 +1103,28 @@ int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata
 }
 
 int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
-    char *cmd;
-    int len;
+    size_t pending = redisPendingBytes(&ac->c);
+
+    if (!__redisAsyncAccepting(ac) ||
+        redisAppendCommandArgv(&ac->c,argc,argv,argvlen) != REDIS_OK)
+        return REDIS_ERR;
+    return __redisAsyncCommand(ac,fn,privdata,redisPendingBytes(&ac->c)-pending);
+}
+
+int redisvAsyncPrepared(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisFormat *fmt, va_list ap) {
+    size_t pending = redisPendingBytes(&ac->c);
+
+    if (!__redisAsyncAccepting(ac) ||
+        redisvAppendPrepared(&ac->c,fmt,ap) != REDIS_OK)
+        return REDIS_ERR;
+    return __redisAsyncCommand(ac,fn,privdata,redisPendingBytes(&ac->c)-pending);
+}
+
+int redisAsyncPrepared(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisFormat *fmt, ...) {
+    va_list ap;
     int status;
-    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    status = __redisAsyncCommand(ac,fn,privdata,cmd,len);
-    free(cmd);
+    va_start(ap,fmt);
+    status = redisvAsyncPrepared(ac,fn,privdata,fmt,ap);
+    va_end(ap);
     return status;
 }
@@ -39,20 +39,32 @@ extern "C" {
 
 struct redisAsyncContext; /* need forward declaration of redisAsyncContext */
 struct dict; /* dictionary header is included in async.c */
+struct redisTimer; /* timers are defined in async.c */
+struct redisTimerWheel;
 
 /* Reply callback prototype and container */
 typedef void (redisCallbackFn)(struct redisAsyncContext*, void*, void*);
 typedef struct redisCallback {
-    struct redisCallback *next; /* simple singly linked list */
     redisCallbackFn *fn;
     void *privdata;
+    struct redisTimer *timer; /* Private: timeout of a queued command */
+    int timedout; /* Private: fn already ran because the command timed out */
 } redisCallback;
 
-/* List of callbacks for either regular replies or pub/sub */
+/* Queue of callbacks for either regular replies or pub/sub. The callbacks
+ * are stored in a ring of "size" slots, a power of two that doubles when the
+ * ring is full, so queueing a callback doesn't allocate. */
 typedef struct redisCallbackList {
-    redisCallback *head, *tail;
+    redisCallback *slots;
+    size_t size;
+    size_t head; /* Slot of the first callback */
+    size_t count;
+    unsigned long long shifted; /* Number of the first callback */
 } redisCallbackList;
 
+/* Pub/sub message callback prototype, see redisAsyncSetMessageCallback */
+typedef void (redisMessageCallbackFn)(struct redisAsyncContext*, const redisMessage*, void*);
+
 /* Connection callback prototypes */
 typedef void (redisDisconnectCallback)(const struct redisAsyncContext*, int status);
 typedef void (redisConnectCallback)(const struct redisAsyncContext*, int status);
@@ -80,6 +92,12 @@ typedef struct redisAsyncContext {
         void (*addWrite)(void *privdata);
         void (*delWrite)(void *privdata);
         void (*cleanup)(void *privdata);
+
+        /* Hooks that are called when the library wants
+         * redisAsyncHandleTimeout to be called once after "tv", replacing
+         * a timer that was set before, or no longer needs it. */
+        void (*addTimer)(void *privdata, struct timeval tv);
+        void (*delTimer)(void *privdata);
     } ev;
 
     /* Called when either the connection is terminated due to an error or per
@@ -89,6 +107,9 @@ typedef struct redisAsyncContext {
     /* Called when the first write event was received. */
     redisConnectCallback *onConnect;
 
+    /* Called for RESP3 push replies that are not pub/sub messages. */
+    redisCallback push;
+
     /* Regular command callbacks */
     redisCallbackList replies;
 
@@ -97,7 +118,18 @@ typedef struct redisAsyncContext {
         redisCallbackList invalid;
         struct dict *channels;
         struct dict *patterns;
+        struct dictEntry *lastChannel; /* Last channel a message matched */
+        struct dictEntry *lastPattern; /* Last pattern a message matched */
+        redisMessageCallbackFn *message; /* Typed callback for messages */
     } sub;
+
+    /* Command timeouts, see redisAsyncSetTimeout */
+    struct {
+        long long ms; /* Timeout of new commands, 0 for none */
+        unsigned int expired; /* Timed out commands without a reply yet */
+        unsigned int limit; /* Disconnect when expired reaches it, 0 for never */
+        struct redisTimerWheel *wheel;
+    } timeout;
 } redisAsyncContext;
 
 /* Functions that proxy to hiredis */
@@ -105,18 +137,35 @@ redisAsyncContext *redisAsyncConnect(const char *ip, int port);
 redisAsyncContext *redisAsyncConnectUnix(const char *path);
 int redisAsyncSetConnectCallback(redisAsyncContext *ac, redisConnectCallback *fn);
 int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallback *fn);
+int redisAsyncSetPushCallback(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata);
+
+/* Deliver pub/sub messages to fn instead of the reply callbacks of their
+ * subscriptions, with the privdata of the subscription. Messages are decoded
+ * in place when possible, without building a reply. NULL switches back. */
+int redisAsyncSetMessageCallback(redisAsyncContext *ac, redisMessageCallbackFn *fn);
 void redisAsyncDisconnect(redisAsyncContext *ac);
 void redisAsyncFree(redisAsyncContext *ac);
 
+/* Commands that are sent after this call time out when their reply didn't
+ * arrive within "tv", zero for no timeout. The callback of a command that
+ * timed out is called with a NULL reply and ac->err set to REDIS_ERR_TIMEOUT,
+ * and its reply is discarded when it arrives later. When "limit" commands
+ * timed out without getting their reply, the connection is considered stuck
+ * and is closed with a REDIS_ERR_TIMEOUT error, zero for never. */
+int redisAsyncSetTimeout(redisAsyncContext *ac, struct timeval tv, unsigned int limit);
+
 /* Handle read/write events */
 void redisAsyncHandleRead(redisAsyncContext *ac);
 void redisAsyncHandleWrite(redisAsyncContext *ac);
+void redisAsyncHandleTimeout(redisAsyncContext *ac);
 
 /* Command functions for an async context. Write the command to the
  * output buffer and register the provided callback. */
 int redisvAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
 int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, ...);
 int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+int redisvAsyncPrepared(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisFormat *fmt, va_list ap);
+int redisAsyncPrepared(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisFormat *fmt, ...);
 
 #ifdef __cplusplus
 }
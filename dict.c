@@ -1,9 +1,12 @@
 /* Hash table implementation.
  *
- * This file implements in memory hash tables with insert/del/replace/find/
- * get-random-element operations. Hash tables will auto resize if needed
- * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * This file implements in memory hash tables with insert/del/find
+ * operations, keyed by binary strings. Tables are power of two in size and
+ * use open addressing with linear probing. When a table grows, entries are
+ * moved to the new table a few at a time by the operations that follow, so
+ * no single operation has to move all of them. Keys are hashed with
+ * SipHash-1-3 and a random seed per table. See the source code for more
+ * information... :)
  *
  * Copyright (c) 2006-2010, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -35,273 +38,386 @@
 
 #include "fmacros.h"
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "dict.h"
 
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
-static int _dictKeyIndex(dict *ht, const void *key);
-static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static void _dictRehashStep(dict *ht, unsigned long n);
+static void _dictSeed(dict *ht);
 
 /* -------------------------- hash functions -------------------------------- */
 
-/* Generic hash function (a popular one from Bernstein).
- * I tested a few and this was the best. */
-static unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = 5381;
+#define ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64-(b))))
+
+#define U8TO64_LE(p) \
+    (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) | \
+     ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) | \
+     ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) | \
+     ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1,13); v1 ^= v0; v0 = ROTL(v0,32); \
+    v2 += v3; v3 = ROTL(v3,16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3,21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1,17); v1 ^= v2; v2 = ROTL(v2,32); \
+} while(0)
+
+/* SipHash-1-3 (one compression round, three finalization rounds), the
+ * variant Redis uses for its own tables: keyed by the seed, so the slots
+ * keys end up in can't be predicted from the outside. */
+static uint64_t dictGenHashFunction(const uint64_t seed[2], const unsigned char *buf, size_t len) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ seed[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ seed[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ seed[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ seed[1];
+    uint64_t b = ((uint64_t)len) << 56, m;
+    const unsigned char *end = buf+len-(len%8);
+
+    for (; buf != end; buf += 8) {
+        m = U8TO64_LE(buf);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    switch (len & 7) {
+    case 7: b |= ((uint64_t)buf[6]) << 48; /* fall through */
+    case 6: b |= ((uint64_t)buf[5]) << 40; /* fall through */
+    case 5: b |= ((uint64_t)buf[4]) << 32; /* fall through */
+    case 4: b |= ((uint64_t)buf[3]) << 24; /* fall through */
+    case 3: b |= ((uint64_t)buf[2]) << 16; /* fall through */
+    case 2: b |= ((uint64_t)buf[1]) << 8; /* fall through */
+    case 1: b |= ((uint64_t)buf[0]); break;
+    case 0: break;
+    }
 
-    while (len--)
-        hash = ((hash << 5) + hash) + (*buf++); /* hash * 33 + c */
-    return hash;
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
-/* ----------------------------- API implementation ------------------------- */
+/* Seed the hash function of a table from /dev/urandom. When it can't be
+ * read, the time, the pid and the address of the table are mixed instead. */
+static void _dictSeed(dict *ht) {
+    unsigned char buf[16];
+    struct timeval tv;
+    int fd, ok = 0;
 
-/* Reset an hashtable already initialized with ht_init().
- * NOTE: This function should only called by ht_destroy(). */
-static void _dictReset(dict *ht) {
-    ht->table = NULL;
-    ht->size = 0;
-    ht->sizemask = 0;
-    ht->used = 0;
+    if ((fd = open("/dev/urandom",O_RDONLY)) != -1) {
+        ok = (read(fd,buf,sizeof(buf)) == (ssize_t)sizeof(buf));
+        close(fd);
+    }
+    if (ok) {
+        ht->seed[0] = U8TO64_LE(buf);
+        ht->seed[1] = U8TO64_LE(buf+8);
+    } else {
+        gettimeofday(&tv,NULL);
+        ht->seed[0] = ((uint64_t)tv.tv_sec << 20) ^ (uint64_t)tv.tv_usec;
+        ht->seed[1] = ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)ht;
+        ht->seed[0] = dictGenHashFunction(ht->seed,(unsigned char*)&tv,sizeof(tv));
+    }
+    ht->seeded = 1;
 }
 
-/* Create a new hash table */
-static dict *dictCreate(dictType *type, void *privDataPtr) {
-    dict *ht = malloc(sizeof(*ht));
-    _dictInit(ht,type,privDataPtr);
-    return ht;
+/* ----------------------------- Tables ------------------------------------- */
+
+static void _dictTableReset(dictTable *t) {
+    t->slots = NULL;
+    t->size = 0;
+    t->sizemask = 0;
+    t->used = 0;
 }
 
-/* Initialize the hash table */
-static int _dictInit(dict *ht, dictType *type, void *privDataPtr) {
-    _dictReset(ht);
-    ht->type = type;
-    ht->privdata = privDataPtr;
+static int _dictTableInit(dictTable *t, unsigned long size) {
+    t->slots = calloc(size,sizeof(dictSlot));
+    if (t->slots == NULL)
+        return DICT_ERR;
+    t->size = size;
+    t->sizemask = size-1;
+    t->used = 0;
     return DICT_OK;
 }
 
-/* Expand or create the hashtable */
-static int dictExpand(dict *ht, unsigned long size) {
-    dict n; /* the new hashtable */
-    unsigned long realsize = _dictNextPower(size), i;
+/* Put an entry that is not in the table yet in the first free slot that
+ * follows its home slot. */
+static void _dictTableInsert(dictTable *t, uint64_t hash, dictEntry *de) {
+    unsigned long idx = hash & t->sizemask;
 
-    /* the size is invalid if it is smaller than the number of
-     * elements already inside the hashtable */
-    if (ht->used > size)
-        return DICT_ERR;
+    while (t->slots[idx].entry != NULL)
+        idx = (idx+1) & t->sizemask;
+    t->slots[idx].hash = hash;
+    t->slots[idx].entry = de;
+    t->used++;
+}
+
+/* Return the slot that holds the key, or -1. */
+static long _dictTableFind(dictTable *t, uint64_t hash, const char *key, size_t len) {
+    unsigned long idx;
+    dictEntry *de;
+
+    if (t->used == 0)
+        return -1;
+    idx = hash & t->sizemask;
+    while ((de = t->slots[idx].entry) != NULL) {
+        if (t->slots[idx].hash == hash && de->keylen == len &&
+            memcmp(de->key,key,len) == 0)
+            return (long)idx;
+        idx = (idx+1) & t->sizemask;
+    }
+    return -1;
+}
 
-    _dictInit(&n, ht->type, ht->privdata);
-    n.size = realsize;
-    n.sizemask = realsize-1;
-    n.table = calloc(realsize,sizeof(dictEntry*));
-
-    /* Copy all the elements from the old to the new table:
-     * note that if the old hash table is empty ht->size is zero,
-     * so dictExpand just creates an hash table. */
-    n.used = ht->used;
-    for (i = 0; i < ht->size && ht->used > 0; i++) {
-        dictEntry *he, *nextHe;
-
-        if (ht->table[i] == NULL) continue;
-
-        /* For each hash entry on this slot... */
-        he = ht->table[i];
-        while(he) {
-            unsigned int h;
-
-            nextHe = he->next;
-            /* Get the new element index */
-            h = dictHashKey(ht, he->key) & n.sizemask;
-            he->next = n.table[h];
-            n.table[h] = he;
-            ht->used--;
-            /* Pass to the next element */
-            he = nextHe;
+/* Empty slot i. The entries that follow it are moved back when slot i is
+ * between their home slot and where they are, so every entry can still be
+ * reached from its home slot without crossing an empty slot. */
+static void _dictTableRemove(dictTable *t, unsigned long i) {
+    unsigned long j = i, k;
+
+    for (;;) {
+        j = (j+1) & t->sizemask;
+        if (t->slots[j].entry == NULL)
+            break;
+        k = t->slots[j].hash & t->sizemask;
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            t->slots[i] = t->slots[j];
+            i = j;
         }
     }
-    assert(ht->used == 0);
-    free(ht->table);
+    t->slots[i].entry = NULL;
+    t->used--;
+}
 
-    /* Remap the new hashtable in the old */
-    *ht = n;
-    return DICT_OK;
+/* ----------------------------- API implementation ------------------------- */
+
+/* Create a new hash table with values of valsize bytes */
+static dict *dictCreate(size_t valsize) {
+    dict *ht = malloc(sizeof(*ht));
+
+    if (ht == NULL)
+        return NULL;
+    _dictTableReset(&ht->ht[0]);
+    _dictTableReset(&ht->ht[1]);
+    ht->rehashidx = 0;
+    ht->valsize = valsize;
+    ht->seeded = 0;
+    return ht;
 }
 
-/* Add an element to the target hash table */
-static int dictAdd(dict *ht, void *key, void *val) {
-    int index;
-    dictEntry *entry;
+/* Make room for "size" entries. When the table has entries already, they
+ * are moved to the new table incrementally. Returns DICT_ERR while the
+ * table is rehashing and on OOM. */
+static int dictExpand(dict *ht, unsigned long size) {
+    unsigned long realsize = _dictNextPower(size+size/3+1), idx;
 
-    /* Get the index of the new element, or -1 if
-     * the element already exists. */
-    if ((index = _dictKeyIndex(ht, key)) == -1)
+    if (dictIsRehashing(ht))
         return DICT_ERR;
+    if (realsize <= ht->ht[0].size)
+        return DICT_OK;
+    if (!ht->seeded)
+        _dictSeed(ht);
+
+    if (ht->ht[0].used == 0) {
+        free(ht->ht[0].slots);
+        return _dictTableInit(&ht->ht[0],realsize);
+    }
 
-    /* Allocates the memory and stores key */
-    entry = malloc(sizeof(*entry));
-    entry->next = ht->table[index];
-    ht->table[index] = entry;
+    if (_dictTableInit(&ht->ht[1],realsize) != DICT_OK) {
+        _dictTableReset(&ht->ht[1]);
+        return DICT_ERR;
+    }
 
-    /* Set the hash entry fields. */
-    dictSetHashKey(ht, entry, key);
-    dictSetHashVal(ht, entry, val);
-    ht->used++;
+    /* Start moving right after an empty slot, so clusters are moved from
+     * their first slot on. There always is one, the load is below 3/4. */
+    for (idx = 0; ht->ht[0].slots[idx].entry != NULL; idx++);
+    ht->rehashidx = (idx+1) & ht->ht[0].sizemask;
     return DICT_OK;
 }
 
-/* Add an element, discarding the old if the key already exists.
- * Return 1 if the key was added from scratch, 0 if there was already an
- * element with such key and dictReplace() just performed a value update
- * operation. */
-static int dictReplace(dict *ht, void *key, void *val) {
-    dictEntry *entry, auxentry;
-
-    /* Try to add the element. If the key
-     * does not exists dictAdd will suceed. */
-    if (dictAdd(ht, key, val) == DICT_OK)
-        return 1;
-    /* It already exists, get the entry */
-    entry = dictFind(ht, key);
-    /* Free the old value and set the new one */
-    /* Set the new value and free the old one. Note that it is important
-     * to do that in this order, as the value may just be exactly the same
-     * as the previous one. In this context, think to reference counting,
-     * you want to increment (set), and then decrement (free), and not the
-     * reverse. */
-    auxentry = *entry;
-    dictSetHashVal(ht, entry, val);
-    dictFreeEntryVal(ht, &auxentry);
-    return 0;
-}
+/* Move entries to the new table, visiting n slots of the old one, and
+ * switch to the new table when the old one is empty. */
+static void _dictRehashStep(dict *ht, unsigned long n) {
+    dictTable *t = &ht->ht[0];
+    dictSlot *s;
+    int moved;
+
+    while (t->used > 0 && n > 0) {
+        s = &t->slots[ht->rehashidx];
+        moved = (s->entry != NULL);
+        if (moved) {
+            _dictTableInsert(&ht->ht[1],s->hash,s->entry);
+            s->entry = NULL;
+            t->used--;
+        }
+        ht->rehashidx = (ht->rehashidx+1) & t->sizemask;
+        n--;
 
-/* Search and remove an element */
-static int dictDelete(dict *ht, const void *key) {
-    unsigned int h;
-    dictEntry *de, *prevde;
+        /* Lookups in the old table stop at the first empty slot, so a
+         * cluster of entries is never left half moved. */
+        if (n == 0 && moved && t->slots[ht->rehashidx].entry != NULL)
+            n = 1;
+    }
 
-    if (ht->size == 0)
-        return DICT_ERR;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    de = ht->table[h];
-
-    prevde = NULL;
-    while(de) {
-        if (dictCompareHashKeys(ht,key,de->key)) {
-            /* Unlink the element from the list */
-            if (prevde)
-                prevde->next = de->next;
-            else
-                ht->table[h] = de->next;
-
-            dictFreeEntryKey(ht,de);
-            dictFreeEntryVal(ht,de);
-            free(de);
-            ht->used--;
-            return DICT_OK;
-        }
-        prevde = de;
-        de = de->next;
+    if (t->used == 0) {
+        free(t->slots);
+        *t = ht->ht[1];
+        _dictTableReset(&ht->ht[1]);
+        ht->rehashidx = 0;
     }
-    return DICT_ERR; /* not found */
 }
 
-/* Destroy an entire hash table */
-static int _dictClear(dict *ht) {
-    unsigned long i;
+/* Grow the table before it gets 3/4 full. */
+static int _dictExpandIfNeeded(dict *ht) {
+    dictTable *t;
 
-    /* Free all the elements */
-    for (i = 0; i < ht->size && ht->used > 0; i++) {
-        dictEntry *he, *nextHe;
-
-        if ((he = ht->table[i]) == NULL) continue;
-        while(he) {
-            nextHe = he->next;
-            dictFreeEntryKey(ht, he);
-            dictFreeEntryVal(ht, he);
-            free(he);
-            ht->used--;
-            he = nextHe;
-        }
-    }
-    /* Free the table and the allocated cache structure */
-    free(ht->table);
-    /* Re-initialize the table */
-    _dictReset(ht);
-    return DICT_OK; /* never fails */
-}
+    if (ht->ht[0].size == 0)
+        return dictExpand(ht,DICT_HT_INITIAL_SIZE);
 
-/* Clear & Release the hash table */
-static void dictRelease(dict *ht) {
-    _dictClear(ht);
-    free(ht);
+    t = dictIsRehashing(ht) ? &ht->ht[1] : &ht->ht[0];
+    if ((t->used+1)*4 <= t->size*3)
+        return DICT_OK;
+
+    /* Inserts normally finish rehashing long before the new table fills
+     * up, but expanding it again needs the old one gone. */
+    if (dictIsRehashing(ht))
+        _dictRehashStep(ht,ULONG_MAX);
+    return dictExpand(ht,ht->ht[0].size);
 }
 
-static dictEntry *dictFind(dict *ht, const void *key) {
-    dictEntry *he;
-    unsigned int h;
-
-    if (ht->size == 0) return NULL;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key))
-            return he;
-        he = he->next;
+static dictEntry *_dictFind(dict *ht, uint64_t hash, const char *key, size_t len) {
+    long idx;
+    int j;
+
+    for (j = 0; j < 2; j++) {
+        if ((idx = _dictTableFind(&ht->ht[j],hash,key,len)) != -1)
+            return ht->ht[j].slots[idx].entry;
     }
     return NULL;
 }
 
-static dictIterator *dictGetIterator(dict *ht) {
-    dictIterator *iter = malloc(sizeof(*iter));
-
-    iter->ht = ht;
-    iter->index = -1;
-    iter->entry = NULL;
-    iter->nextEntry = NULL;
-    return iter;
+/* Return the value of the key, adding the key with a zeroed value first
+ * when it is not in the table. *added tells which of the two happened.
+ * Returns NULL on OOM. */
+static void *dictAdd(dict *ht, const char *key, size_t len, int *added) {
+    dictEntry *de;
+    uint64_t hash;
+    size_t vpos;
+
+    if (added != NULL)
+        *added = 0;
+    if (dictIsRehashing(ht))
+        _dictRehashStep(ht,DICT_REHASH_STEP);
+    if (!ht->seeded)
+        _dictSeed(ht);
+
+    hash = dictGenHashFunction(ht->seed,(const unsigned char*)key,len);
+    if ((de = _dictFind(ht,hash,key,len)) != NULL)
+        return de->val;
+    if (_dictExpandIfNeeded(ht) != DICT_OK)
+        return NULL;
+
+    /* The key is stored right after the entry, so comparing it doesn't
+     * touch another cache line for short keys, followed by the value. */
+    vpos = (len+1+7) & ~(size_t)7;
+    de = malloc(sizeof(*de)+vpos+ht->valsize);
+    if (de == NULL)
+        return NULL;
+    de->hash = hash;
+    de->key = (char*)(de+1);
+    de->keylen = len;
+    de->val = de->key+vpos;
+    memcpy(de->key,key,len);
+    de->key[len] = '\0';
+    memset(de->val,0,ht->valsize);
+
+    _dictTableInsert(dictIsRehashing(ht) ? &ht->ht[1] : &ht->ht[0],hash,de);
+    if (added != NULL)
+        *added = 1;
+    return de->val;
 }
 
-static dictEntry *dictNext(dictIterator *iter) {
-    while (1) {
-        if (iter->entry == NULL) {
-            iter->index++;
-            if (iter->index >=
-                    (signed)iter->ht->size) break;
-            iter->entry = iter->ht->table[iter->index];
-        } else {
-            iter->entry = iter->nextEntry;
-        }
-        if (iter->entry) {
-            /* We need to save the 'next' here, the iterator user
-             * may delete the entry we are returning. */
-            iter->nextEntry = iter->entry->next;
-            return iter->entry;
+/* Remove an entry that was returned by dictFind or dictNext */
+static int dictDelete(dict *ht, dictEntry *de) {
+    dictTable *t;
+    unsigned long idx;
+    int j;
+
+    if (dictIsRehashing(ht))
+        _dictRehashStep(ht,DICT_REHASH_STEP);
+
+    for (j = 0; j < 2; j++) {
+        t = &ht->ht[j];
+        if (t->used == 0) continue;
+        idx = de->hash & t->sizemask;
+        while (t->slots[idx].entry != NULL) {
+            if (t->slots[idx].entry == de) {
+                _dictTableRemove(t,idx);
+                free(de);
+                return DICT_OK;
+            }
+            idx = (idx+1) & t->sizemask;
         }
     }
-    return NULL;
+    return DICT_ERR; /* not found */
 }
 
-static void dictReleaseIterator(dictIterator *iter) {
-    free(iter);
+/* Clear & Release the hash table */
+static void dictRelease(dict *ht) {
+    unsigned long i;
+    int j;
+
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < ht->ht[j].size && ht->ht[j].used > 0; i++) {
+            if (ht->ht[j].slots[i].entry != NULL) {
+                free(ht->ht[j].slots[i].entry);
+                ht->ht[j].used--;
+            }
+        }
+        free(ht->ht[j].slots);
+    }
+    free(ht);
 }
 
-/* ------------------------- private functions ------------------------------ */
+static dictEntry *dictFind(dict *ht, const char *key, size_t len) {
+    if (dictSize(ht) == 0)
+        return NULL;
+    if (dictIsRehashing(ht))
+        _dictRehashStep(ht,DICT_REHASH_LOOKUP_STEP);
+    return _dictFind(ht,dictGenHashFunction(ht->seed,(const unsigned char*)key,len),key,len);
+}
 
-/* Expand the hash table if needed */
-static int _dictExpandIfNeeded(dict *ht) {
-    /* If the hash table is empty expand it to the intial size,
-     * if the table is "full" dobule its size. */
-    if (ht->size == 0)
-        return dictExpand(ht, DICT_HT_INITIAL_SIZE);
-    if (ht->used == ht->size)
-        return dictExpand(ht, ht->size*2);
-    return DICT_OK;
+/* Iterate over the entries, starting with *cursor set to 0. Returns NULL
+ * after the last one. The table must not be modified while iterating. */
+static dictEntry *dictNext(dict *ht, unsigned long *cursor) {
+    unsigned long i;
+    dictSlot *s;
+
+    while (*cursor < ht->ht[0].size+ht->ht[1].size) {
+        i = (*cursor)++;
+        if (i < ht->ht[0].size)
+            s = &ht->ht[0].slots[i];
+        else
+            s = &ht->ht[1].slots[i-ht->ht[0].size];
+        if (s->entry != NULL)
+            return s->entry;
+    }
+    return NULL;
 }
 
+/* ------------------------- private functions ------------------------------ */
+
 /* Our hash table capability is a power of two */
 static unsigned long _dictNextPower(unsigned long size) {
     unsigned long i = DICT_HT_INITIAL_SIZE;
@@ -313,26 +429,3 @@ static unsigned long _dictNextPower(unsigned long size) {
         i *= 2;
     }
 }
-
-/* Returns the index of a free slot that can be populated with
- * an hash entry for the given 'key'.
- * If the key already exists, -1 is returned. */
-static int _dictKeyIndex(dict *ht, const void *key) {
-    unsigned int h;
-    dictEntry *he;
-
-    /* Expand the hashtable if needed */
-    if (_dictExpandIfNeeded(ht) == DICT_ERR)
-        return -1;
-    /* Compute the key hash value */
-    h = dictHashKey(ht, key) & ht->sizemask;
-    /* Search if this slot does not already contain the given key */
-    he = ht->table[h];
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key))
-            return -1;
-        he = he->next;
-    }
-    return h;
-}
-
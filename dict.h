@@ -1,9 +1,12 @@
 /* Hash table implementation.
  *
- * This file implements in memory hash tables with insert/del/replace/find/
- * get-random-element operations. Hash tables will auto resize if needed
- * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * This file implements in memory hash tables with insert/del/find
+ * operations, keyed by binary strings. Tables are power of two in size and
+ * use open addressing with linear probing. When a table grows, entries are
+ * moved to the new table a few at a time by the operations that follow, so
+ * no single operation has to move all of them. Keys are hashed with
+ * SipHash-1-3 and a random seed per table. See the source code for more
+ * information... :)
  *
  * Copyright (c) 2006-2010, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -36,91 +39,70 @@
 #ifndef __DICT_H
 #define __DICT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define DICT_OK 0
 #define DICT_ERR 1
 
 /* Unused arguments generate annoying warnings... */
 #define DICT_NOTUSED(V) ((void) V)
 
+/* An entry is a single allocation holding a copy of the key and the value,
+ * so it stays at the same address for as long as it is in the table. */
 typedef struct dictEntry {
-    void *key;
-    void *val;
-    struct dictEntry *next;
+    uint64_t hash;
+    char *key; /* NULL terminated copy of the key */
+    size_t keylen;
+    void *val; /* valsize bytes that belong to the caller */
 } dictEntry;
 
-typedef struct dictType {
-    unsigned int (*hashFunction)(const void *key);
-    void *(*keyDup)(void *privdata, const void *key);
-    void *(*valDup)(void *privdata, const void *obj);
-    int (*keyCompare)(void *privdata, const void *key1, const void *key2);
-    void (*keyDestructor)(void *privdata, void *key);
-    void (*valDestructor)(void *privdata, void *obj);
-} dictType;
+/* Slots keep the hash next to the entry pointer, so probing doesn't touch
+ * the entries of other keys. A NULL entry is an empty slot. */
+typedef struct dictSlot {
+    uint64_t hash;
+    dictEntry *entry;
+} dictSlot;
 
-typedef struct dict {
-    dictEntry **table;
-    dictType *type;
+typedef struct dictTable {
+    dictSlot *slots;
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
-    void *privdata;
-} dict;
+} dictTable;
 
-typedef struct dictIterator {
-    dict *ht;
-    int index;
-    dictEntry *entry, *nextEntry;
-} dictIterator;
+typedef struct dict {
+    dictTable ht[2]; /* ht[1] is only used while rehashing */
+    unsigned long rehashidx; /* Next slot of ht[0] to move when rehashing */
+    size_t valsize;
+    uint64_t seed[2];
+    int seeded;
+} dict;
 
 /* This is the initial size of every hash table */
-#define DICT_HT_INITIAL_SIZE     4
-
-/* ------------------------------- Macros ------------------------------------*/
-#define dictFreeEntryVal(ht, entry) \
-    if ((ht)->type->valDestructor) \
-        (ht)->type->valDestructor((ht)->privdata, (entry)->val)
-
-#define dictSetHashVal(ht, entry, _val_) do { \
-    if ((ht)->type->valDup) \
-        entry->val = (ht)->type->valDup((ht)->privdata, _val_); \
-    else \
-        entry->val = (_val_); \
-} while(0)
-
-#define dictFreeEntryKey(ht, entry) \
-    if ((ht)->type->keyDestructor) \
-        (ht)->type->keyDestructor((ht)->privdata, (entry)->key)
+#define DICT_HT_INITIAL_SIZE     16
 
-#define dictSetHashKey(ht, entry, _key_) do { \
-    if ((ht)->type->keyDup) \
-        entry->key = (ht)->type->keyDup((ht)->privdata, _key_); \
-    else \
-        entry->key = (_key_); \
-} while(0)
-
-#define dictCompareHashKeys(ht, key1, key2) \
-    (((ht)->type->keyCompare) ? \
-        (ht)->type->keyCompare((ht)->privdata, key1, key2) : \
-        (key1) == (key2))
-
-#define dictHashKey(ht, key) (ht)->type->hashFunction(key)
+/* Slots of the old table that are moved by every insert and delete while
+ * rehashing. Lookups move a few as well, so rehashing finishes even when
+ * the table is only read. */
+#define DICT_REHASH_STEP 64
+#define DICT_REHASH_LOOKUP_STEP 4
 
+/* ------------------------------- Macros ------------------------------------*/
 #define dictGetEntryKey(he) ((he)->key)
 #define dictGetEntryVal(he) ((he)->val)
-#define dictSlots(ht) ((ht)->size)
-#define dictSize(ht) ((ht)->used)
+#define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
+#define dictIsRehashing(d) ((d)->ht[1].size != 0)
 
 /* API */
-static unsigned int dictGenHashFunction(const unsigned char *buf, int len);
-static dict *dictCreate(dictType *type, void *privDataPtr);
+static uint64_t dictGenHashFunction(const uint64_t seed[2], const unsigned char *buf, size_t len);
+static dict *dictCreate(size_t valsize);
 static int dictExpand(dict *ht, unsigned long size);
-static int dictAdd(dict *ht, void *key, void *val);
-static int dictReplace(dict *ht, void *key, void *val);
-static int dictDelete(dict *ht, const void *key);
+static void *dictAdd(dict *ht, const char *key, size_t len, int *added);
+static int dictDelete(dict *ht, dictEntry *de);
 static void dictRelease(dict *ht);
-static dictEntry * dictFind(dict *ht, const void *key);
-static dictIterator *dictGetIterator(dict *ht);
-static dictEntry *dictNext(dictIterator *iter);
-static void dictReleaseIterator(dictIterator *iter);
+static dictEntry *dictFind(dict *ht, const char *key, size_t len);
+static dictEntry *dictNext(dict *ht, unsigned long *cursor);
 
 #endif /* __DICT_H */
@@ -36,16 +36,53 @@
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <locale.h>
+#include <limits.h>
+#include <stdint.h>
 
 #include "hiredis.h"
 #include "net.h"
 #include "sds.h"
 
+#if defined(__linux__)
+#define HIREDIS_SENDFILE
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+/* splice(2) is only declared with _GNU_SOURCE, which would also select the
+ * GNU strerror_r, so it is called through syscall. */
+#if defined(__linux__) && defined(SYS_splice)
+#define HIREDIS_SPLICE
+#define redisSplice(in,out,len) syscall(SYS_splice,(in),NULL,(out),NULL,(len),0)
+#endif
+
+/* Vectorized \r\n search. SSE2 is used when the compiler targets it (always
+ * the case on x86-64), AVX2 is selected at runtime when the CPU has it.
+ * Define HIREDIS_NO_SIMD to always use the portable implementation. */
+#if !defined(HIREDIS_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#define HIREDIS_SIMD_SSE2
+#include <emmintrin.h>
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define HIREDIS_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 static redisReply *createReplyObject(int type);
 static void *createStringObject(const redisReadTask *task, char *str, size_t len);
 static void *createArrayObject(const redisReadTask *task, int elements);
 static void *createIntegerObject(const redisReadTask *task, long long value);
 static void *createNilObject(const redisReadTask *task);
+static void *createDoubleObject(const redisReadTask *task, double value, char *str, size_t len);
+static void *createBoolObject(const redisReadTask *task, int value);
+static void *createArenaStringObject(const redisReadTask *task, char *str, size_t len);
+static void *createArenaArrayObject(const redisReadTask *task, int elements);
+static void *createArenaIntegerObject(const redisReadTask *task, long long value);
+static void *createArenaNilObject(const redisReadTask *task);
+static void *createArenaDoubleObject(const redisReadTask *task, double value, char *str, size_t len);
+static void *createArenaBoolObject(const redisReadTask *task, int value);
 
 /* Default set of functions to build the reply. Keep in mind that such a
  * function returning NULL is interpreted as OOM. */
@@ -54,9 +91,356 @@ static redisReplyObjectFunctions defaultFunctions = {
     createArrayObject,
     createIntegerObject,
     createNilObject,
-    freeReplyObject
+    freeReplyObject,
+    NULL,
+    NULL,
+    NULL,
+    createDoubleObject,
+    createBoolObject
+};
+
+/* Reply functions used by redisReaderEnableReplyArena(). */
+static redisReplyObjectFunctions arenaFunctions = {
+    createArenaStringObject,
+    createArenaArrayObject,
+    createArenaIntegerObject,
+    createArenaNilObject,
+    freeReplyObject,
+    NULL,
+    NULL,
+    NULL,
+    createArenaDoubleObject,
+    createArenaBoolObject
 };
 
+/* Returns 1 for the reply types that hold elements. */
+static int isAggregateType(int type) {
+    return type == REDIS_REPLY_ARRAY || type == REDIS_REPLY_MAP ||
+           type == REDIS_REPLY_SET || type == REDIS_REPLY_PUSH;
+}
+
+/* Kinds of memory owners a reply can point to with its "owner" field. Every
+ * owner struct starts with an int holding one of these. */
+#define REDIS_OWNER_ARENA 1
+#define REDIS_OWNER_BUFFER 2
+#define REDIS_OWNER_LAZY 3
+
+/* The reader buffer is a segment: a fixed size block that is filled by
+ * redisReaderFeed and consumed in place by the parser. Borrowed string
+ * replies point into a segment and hold a reference on it, so a segment is
+ * never moved or reused while referenced. */
+#define REDIS_READER_SEGMENT (1024*16)
+
+/* Bulks of at least this size get a segment of exactly the size they need as
+ * soon as their length is read, and become the string of their reply instead
+ * of being copied. */
+#define REDIS_READER_LARGE_BULK (1024*64)
+
+/* Bounds for the adaptive size of reads done by redisReaderReserve. */
+#define REDIS_READER_MIN_READ (1024*16)
+#define REDIS_READER_MAX_READ (1024*1024)
+
+typedef struct redisReaderSegment {
+    int kind; /* REDIS_OWNER_BUFFER */
+    int refcount; /* Number of replies + 1 while used by the reader */
+    size_t size; /* Usable bytes in data */
+    char data[];
+} redisReaderSegment;
+
+static redisReaderSegment *createSegment(size_t size) {
+    redisReaderSegment *seg = malloc(sizeof(*seg)+size);
+    if (seg == NULL)
+        return NULL;
+    seg->kind = REDIS_OWNER_BUFFER;
+    seg->refcount = 1;
+    seg->size = size;
+    return seg;
+}
+
+static void releaseSegment(redisReaderSegment *seg) {
+    if (--seg->refcount == 0)
+        free(seg);
+}
+
+/* In arena mode, a reply tree is allocated from a list of chunks. The first
+ * chunk holds the arena header and the root reply, further chunks are only
+ * needed for trees that outgrow it. */
+#define REDIS_ARENA_MIN_CHUNK (1024*4)
+#define REDIS_ARENA_MAX_CHUNK (1024*1024)
+#define REDIS_ARENA_ALIGN(n) (((n)+sizeof(long long)-1) & ~(sizeof(long long)-1))
+
+typedef struct redisArenaChunk {
+    struct redisArenaChunk *next; /* Chunk allocated before this one */
+    size_t size; /* Usable bytes in data */
+    size_t used;
+    long long data[]; /* long long for alignment */
+} redisArenaChunk;
+
+/* Reader segments referenced by borrowed strings in the arena. */
+typedef struct redisArenaPin {
+    struct redisArenaPin *next;
+    redisReaderSegment *seg;
+} redisArenaPin;
+
+typedef struct redisArena {
+    int kind; /* REDIS_OWNER_ARENA */
+    redisReply *root;
+    redisArenaChunk *chunk; /* Chunk that is currently carved from */
+    size_t nextsize; /* Size of the next chunk to allocate */
+    redisArenaPin *pins;
+} redisArena;
+
+static redisArenaChunk *createArenaChunk(size_t size) {
+    redisArenaChunk *chunk = malloc(sizeof(*chunk)+size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void *arenaAlloc(redisArena *a, size_t size) {
+    redisArenaChunk *chunk = a->chunk;
+    void *p;
+
+    size = REDIS_ARENA_ALIGN(size);
+    if (chunk->size-chunk->used < size) {
+        chunk = createArenaChunk(size > a->nextsize ? size : a->nextsize);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = a->chunk;
+        a->chunk = chunk;
+        if (a->nextsize < REDIS_ARENA_MAX_CHUNK)
+            a->nextsize *= 2;
+    }
+
+    p = (char*)chunk->data+chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+/* Make the arena hold a reference on a reader segment. */
+static int arenaPin(redisArena *a, redisReaderSegment *seg) {
+    redisArenaPin *ap;
+
+    /* Strings in a tree mostly come from the same segment. */
+    if (a->pins != NULL && a->pins->seg == seg)
+        return REDIS_OK;
+
+    ap = arenaAlloc(a,sizeof(*ap));
+    if (ap == NULL)
+        return REDIS_ERR;
+    ap->seg = seg;
+    ap->next = a->pins;
+    a->pins = ap;
+    seg->refcount++;
+    return REDIS_OK;
+}
+
+/* Free every chunk of the arena, including the one holding the header. */
+static void freeArena(redisArena *a) {
+    redisArenaChunk *chunk = a->chunk, *next;
+    redisArenaPin *ap;
+
+    /* The list of pins lives in the chunks, so release them first. */
+    for (ap = a->pins; ap != NULL; ap = ap->next)
+        releaseSegment(ap->seg);
+
+    while (chunk != NULL) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/* Create a reply in the arena of its parent, or in a new arena when it is
+ * the root of the tree. "hint" is the number of bytes that will be carved
+ * for the reply right away, so a small tree fits in the first chunk. */
+static redisReply *createArenaReplyObject(const redisReadTask *task, int type, size_t hint) {
+    redisArenaChunk *chunk;
+    redisReply *r, *parent;
+    redisArena *a;
+    size_t size;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(isAggregateType(parent->type));
+        a = parent->owner;
+        r = arenaAlloc(a,sizeof(*r));
+        if (r == NULL)
+            return NULL;
+        parent->element[task->idx] = r;
+    } else {
+        size = REDIS_ARENA_ALIGN(sizeof(*a))+REDIS_ARENA_ALIGN(sizeof(*r));
+        size += REDIS_ARENA_ALIGN(hint);
+        chunk = createArenaChunk(size > REDIS_ARENA_MIN_CHUNK ? size : REDIS_ARENA_MIN_CHUNK);
+        if (chunk == NULL)
+            return NULL;
+        a = (redisArena*)chunk->data;
+        chunk->used = REDIS_ARENA_ALIGN(sizeof(*a));
+        a->kind = REDIS_OWNER_ARENA;
+        a->chunk = chunk;
+        a->nextsize = REDIS_ARENA_MIN_CHUNK*2;
+        a->pins = NULL;
+        r = arenaAlloc(a,sizeof(*r));
+        a->root = r;
+    }
+
+    memset(r,0,sizeof(*r));
+    r->type = type;
+    r->owner = a;
+    return r;
+}
+
+static void *createArenaStringObject(const redisReadTask *task, char *str, size_t len) {
+    redisReply *r;
+
+    assert(task->type == REDIS_REPLY_ERROR  ||
+           task->type == REDIS_REPLY_STATUS ||
+           task->type == REDIS_REPLY_STRING ||
+           task->type == REDIS_REPLY_BIGNUM ||
+           task->type == REDIS_REPLY_VERB);
+
+    /* The reader checked that a verbatim string starts with "xxx:". */
+    if (task->type == REDIS_REPLY_VERB) {
+        str += 4;
+        len -= 4;
+    }
+
+    r = createArenaReplyObject(task,task->type,len+1);
+    if (r == NULL)
+        return NULL;
+    if (task->type == REDIS_REPLY_VERB)
+        memcpy(r->vtype,str-4,3);
+
+    /* Cannot fail for a root reply because of the size hint, otherwise the
+     * arena is free'd together with the root on error. */
+    r->str = arenaAlloc(r->owner,len+1);
+    if (r->str == NULL)
+        return NULL;
+
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+    return r;
+}
+
+static void *createArenaArrayObject(const redisReadTask *task, int elements) {
+    redisReply *r;
+
+    r = createArenaReplyObject(task,task->type,
+        elements > 0 ? sizeof(redisReply*)*elements : 0);
+    if (r == NULL)
+        return NULL;
+
+    if (elements > 0) {
+        r->element = arenaAlloc(r->owner,sizeof(redisReply*)*elements);
+        if (r->element == NULL)
+            return NULL;
+        memset(r->element,0,sizeof(redisReply*)*elements);
+    }
+
+    r->elements = elements;
+    return r;
+}
+
+static void *createArenaIntegerObject(const redisReadTask *task, long long value) {
+    redisReply *r;
+
+    r = createArenaReplyObject(task,REDIS_REPLY_INTEGER,0);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = value;
+    return r;
+}
+
+static void *createArenaNilObject(const redisReadTask *task) {
+    return createArenaReplyObject(task,REDIS_REPLY_NIL,0);
+}
+
+static void *createArenaDoubleObject(const redisReadTask *task, double value, char *str, size_t len) {
+    redisReply *r;
+
+    r = createArenaReplyObject(task,REDIS_REPLY_DOUBLE,len+1);
+    if (r == NULL)
+        return NULL;
+
+    r->str = arenaAlloc(r->owner,len+1);
+    if (r->str == NULL)
+        return NULL;
+
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+    r->dval = value;
+    return r;
+}
+
+static void *createArenaBoolObject(const redisReadTask *task, int value) {
+    redisReply *r;
+
+    r = createArenaReplyObject(task,REDIS_REPLY_BOOL,0);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = value != 0;
+    return r;
+}
+
+/* A lazy array reply keeps the bytes of its elements in a reader segment
+ * and only decodes an element when it is accessed with redisReplyElement.
+ * While the reply is read, "framed" bytes of it were parsed and the start
+ * of every element that was seen is recorded in "offsets". */
+typedef struct redisLazyArray {
+    int kind; /* REDIS_OWNER_LAZY */
+    redisReaderSegment *seg; /* Holds the reply, NULL while it is read */
+    char *base; /* Start of the reply in seg */
+    size_t *offsets; /* Element start offsets from base, plus the end */
+    size_t elements; /* Number of elements */
+    size_t count; /* Number of offsets that were recorded */
+    size_t framed; /* Bytes that were parsed */
+    int type; /* Type of the reply */
+    int expect; /* Set when the next token starts an element */
+} redisLazyArray;
+
+static void freeLazyArray(redisLazyArray *la) {
+    if (la->seg != NULL)
+        releaseSegment(la->seg);
+    free(la->offsets);
+    free(la);
+}
+
+/* Release a reply that doesn't own its memory. Replies inside an arena are
+ * only free'd together with their root. */
+static void freeOwnedReplyObject(redisReply *r) {
+    size_t j;
+
+    switch(*(int*)r->owner) {
+    case REDIS_OWNER_ARENA:
+        if (((redisArena*)r->owner)->root == r)
+            freeArena(r->owner);
+        break;
+    case REDIS_OWNER_BUFFER:
+        releaseSegment(r->owner);
+        free(r);
+        break;
+    case REDIS_OWNER_LAZY:
+        if (r->element != NULL) {
+            for (j = 0; j < r->elements; j++)
+                if (r->element[j] != NULL)
+                    freeReplyObject(r->element[j]);
+            free(r->element);
+        }
+        freeLazyArray(r->owner);
+        free(r);
+        break;
+    default:
+        assert(NULL);
+    }
+}
+
 /* Create a reply object */
 static redisReply *createReplyObject(int type) {
     redisReply *r = calloc(1,sizeof(*r));
@@ -73,10 +457,18 @@ void freeReplyObject(void *reply) {
     redisReply *r = reply;
     size_t j;
 
+    if (r->owner != NULL) {
+        freeOwnedReplyObject(r);
+        return;
+    }
+
     switch(r->type) {
     case REDIS_REPLY_INTEGER:
         break; /* Nothing to free */
     case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_PUSH:
         if (r->element != NULL) {
             for (j = 0; j < r->elements; j++)
                 if (r->element[j] != NULL)
@@ -87,6 +479,9 @@ void freeReplyObject(void *reply) {
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_DOUBLE:
+    case REDIS_REPLY_BIGNUM:
+    case REDIS_REPLY_VERB:
         if (r->str != NULL)
             free(r->str);
         break;
@@ -102,6 +497,13 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
     if (r == NULL)
         return NULL;
 
+    /* The reader checked that a verbatim string starts with "xxx:". */
+    if (task->type == REDIS_REPLY_VERB) {
+        memcpy(r->vtype,str,3);
+        str += 4;
+        len -= 4;
+    }
+
     buf = malloc(len+1);
     if (buf == NULL) {
         freeReplyObject(r);
@@ -110,7 +512,9 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 
     assert(task->type == REDIS_REPLY_ERROR  ||
            task->type == REDIS_REPLY_STATUS ||
-           task->type == REDIS_REPLY_STRING);
+           task->type == REDIS_REPLY_STRING ||
+           task->type == REDIS_REPLY_BIGNUM ||
+           task->type == REDIS_REPLY_VERB);
 
     /* Copy string value */
     memcpy(buf,str,len);
@@ -120,7 +524,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -129,7 +533,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 static void *createArrayObject(const redisReadTask *task, int elements) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_ARRAY);
+    r = createReplyObject(task->type);
     if (r == NULL)
         return NULL;
 
@@ -145,7 +549,7 @@ static void *createArrayObject(const redisReadTask *task, int elements) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -162,7 +566,7 @@ static void *createIntegerObject(const redisReadTask *task, long long value) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -177,12 +581,211 @@ static void *createNilObject(const redisReadTask *task) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createDoubleObject(const redisReadTask *task, double value, char *str, size_t len) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_DOUBLE);
+    if (r == NULL)
+        return NULL;
+
+    /* Keep the string representation, as a double can't always hold the
+     * exact value that was sent. */
+    r->str = malloc(len+1);
+    if (r->str == NULL) {
+        freeReplyObject(r);
+        return NULL;
+    }
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+    r->dval = value;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(isAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createBoolObject(const redisReadTask *task, int value) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_BOOL);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = value != 0;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
 }
 
+/* Returns 1 when the reader segment is referenced by borrowed replies. */
+static int segmentPinned(redisReader *r) {
+    return r->segment->refcount > 1;
+}
+
+/* Make room for "len" more bytes after the end of the buffer. The bytes that
+ * were not consumed yet -- normally the start of a reply that is still
+ * incomplete -- are moved to the front of the segment when it is not pinned
+ * and they fit, or to a new segment otherwise. The old segment is left to
+ * the replies that borrow from it. */
+static int makeRoomForFeed(redisReader *r, size_t len) {
+    redisReaderSegment *seg = r->segment;
+    size_t tail = r->len-r->pos, size;
+
+    if (!segmentPinned(r) && tail+len <= seg->size) {
+        memmove(seg->data,seg->data+r->pos,tail);
+    } else {
+        /* Grow geometrically when a single item outgrows the segment, so
+         * a large bulk that arrives in many reads is not copied each time.
+         * The size is exact when the end of a large bulk is known. */
+        size = tail+len;
+        if (size < REDIS_READER_SEGMENT)
+            size = REDIS_READER_SEGMENT;
+        else if (tail > 0 && r->bulkend == 0)
+            size *= 2;
+
+        seg = createSegment(size);
+        if (seg == NULL)
+            return REDIS_ERR;
+        memcpy(seg->data,r->buf+r->pos,tail);
+        releaseSegment(r->segment);
+        r->segment = seg;
+        r->buf = seg->data;
+    }
+
+    r->scanpos = r->scanpos > r->pos ? r->scanpos-r->pos : 0;
+    r->bulkend = r->bulkend > r->pos ? r->bulkend-r->pos : 0;
+    r->pos = 0;
+    r->len = tail;
+    return REDIS_OK;
+}
+
+/* Bytes to make room for when "len" more bytes are fed: up to the end of a
+ * large bulk when that is further. */
+static size_t feedRoom(redisReader *r, size_t len) {
+    if (r->bulkend > r->len && r->bulkend-r->len > len)
+        return r->bulkend-r->len;
+    return len;
+}
+
+/* Start over at the beginning of the segment when everything was consumed,
+ * replacing it when it is larger than both maxbuf and what the next reads
+ * need (the large one is simply kept when that allocation fails). A pinned
+ * segment is left as is: new data is appended after the borrowed bytes
+ * while there is room. */
+static void rewindBuffer(redisReader *r) {
+    redisReaderSegment *seg;
+
+    if (r->pos != r->len || segmentPinned(r))
+        return;
+
+    if (r->maxbuf != 0 && r->segment->size > r->maxbuf &&
+        r->segment->size > REDIS_READER_SEGMENT &&
+        r->segment->size > r->readsize*4)
+    {
+        seg = createSegment(REDIS_READER_SEGMENT);
+        if (seg != NULL) {
+            releaseSegment(r->segment);
+            r->segment = seg;
+            r->buf = seg->data;
+        }
+    }
+
+    r->pos = r->len = r->scanpos = 0;
+    r->bulkend = 0;
+}
+
+/* Create a string reply that points into the reader buffer. The \r that
+ * follows the string was already consumed, so it is overwritten to keep
+ * the string NULL terminated. */
+static void *createBorrowedStringObject(redisReader *r, const redisReadTask *task, char *str, size_t len) {
+    redisReaderSegment *seg = r->segment;
+    redisReply *reply, *parent;
+
+    assert(task->type == REDIS_REPLY_ERROR  ||
+           task->type == REDIS_REPLY_STATUS ||
+           task->type == REDIS_REPLY_STRING ||
+           task->type == REDIS_REPLY_BIGNUM ||
+           task->type == REDIS_REPLY_VERB);
+
+    if (r->fn == &arenaFunctions) {
+        reply = createArenaReplyObject(task,task->type,0);
+        if (reply == NULL)
+            return NULL;
+        if (arenaPin(reply->owner,seg) != REDIS_OK)
+            return NULL;
+    } else {
+        reply = createReplyObject(task->type);
+        if (reply == NULL)
+            return NULL;
+        reply->owner = seg;
+        seg->refcount++;
+        if (task->parent) {
+            parent = task->parent->obj;
+            assert(isAggregateType(parent->type));
+            parent->element[task->idx] = reply;
+        }
+    }
+
+    str[len] = '\0';
+    if (task->type == REDIS_REPLY_VERB) {
+        memcpy(reply->vtype,str,3);
+        str += 4;
+        len -= 4;
+    }
+    reply->str = str;
+    reply->len = len;
+    return reply;
+}
+
+/* A large bulk that ends at the end of the segment, which was sized for it
+ * when its length was read, becomes the string of the reply instead of being
+ * copied. The reader continues in a new segment, so the reply is the only
+ * owner of the old one and can be free'd from any thread. */
+static void *createSegmentStringObject(redisReader *r, const redisReadTask *task, char *str, size_t len) {
+    redisReaderSegment *seg, *old = r->segment;
+    void *reply;
+
+    if ((seg = createSegment(REDIS_READER_SEGMENT)) == NULL)
+        return r->fn->createString(task,str,len);
+    if ((reply = createBorrowedStringObject(r,task,str,len)) == NULL) {
+        releaseSegment(seg);
+        return NULL;
+    }
+
+    r->segment = seg;
+    r->buf = seg->data;
+    r->pos = r->len = r->scanpos = 0;
+    releaseSegment(old);
+    return reply;
+}
+
+/* Create a string using the reply object functions, or as a borrowed
+ * string when enabled for the default functions. */
+static void *createString(redisReader *r, const redisReadTask *task, char *str, size_t len) {
+    if (r->fn == &defaultFunctions || r->fn == &arenaFunctions) {
+        if (r->flags & REDIS_READER_BORROW)
+            return createBorrowedStringObject(r,task,str,len);
+        if (len >= REDIS_READER_LARGE_BULK && r->segment != NULL &&
+            r->pos == r->segment->size)
+            return createSegmentStringObject(r,task,str,len);
+    }
+    return r->fn->createString(task,str,len);
+}
+
 static void __redisReaderSetError(redisReader *r, int type, const char *str) {
     size_t len;
 
@@ -192,14 +795,25 @@ static void __redisReaderSetError(redisReader *r, int type, const char *str) {
     }
 
     /* Clear input buffer on errors. */
-    if (r->buf != NULL) {
-        sdsfree(r->buf);
+    if (r->segment != NULL) {
+        releaseSegment(r->segment);
+        r->segment = NULL;
         r->buf = NULL;
         r->pos = r->len = 0;
+        r->scanpos = 0;
+        r->bulkend = 0;
     }
 
-    /* Reset task stack. */
+    if (r->lazy != NULL) {
+        freeLazyArray(r->lazy);
+        r->lazy = NULL;
+    }
+
+    /* Reset task stack and parser state. */
     r->ridx = -1;
+    r->depth = 0;
+    r->attrs = 0;
+    r->bulkleft = 0;
 
     /* Set error. */
     r->err = type;
@@ -246,668 +860,2033 @@ static void __redisReaderSetErrorOOM(redisReader *r) {
     __redisReaderSetError(r,REDIS_ERR_OOM,"Out of memory");
 }
 
-static char *readBytes(redisReader *r, unsigned int bytes) {
-    char *p;
-    if (r->len-r->pos >= bytes) {
-        p = r->buf+r->pos;
-        r->pos += bytes;
-        return p;
-    }
-    return NULL;
-}
-
-/* Find pointer to \r\n. */
-static char *seekNewline(char *s, size_t len) {
-    int pos = 0;
-    int _len = len-1;
+/* Find pointer to \r\n. Note that strchr cannot be used because it doesn't
+ * allow to search a limited length and the buffer that is being searched
+ * might not have a trailing NULL character. */
+static char *seekNewlineScalar(char *s, size_t len) {
+    char *p = s, *end;
 
     /* Position should be < len-1 because the character at "pos" should be
-     * followed by a \n. Note that strchr cannot be used because it doesn't
-     * allow to search a limited length and the buffer that is being searched
-     * might not have a trailing NULL character. */
-    while (pos < _len) {
-        while(pos < _len && s[pos] != '\r') pos++;
-        if (s[pos] != '\r') {
-            /* Not found. */
+     * followed by a \n. */
+    if (len < 2)
+        return NULL;
+
+    end = s+len-1;
+    while (p < end) {
+        p = memchr(p,'\r',end-p);
+        if (p == NULL)
             return NULL;
-        } else {
-            if (s[pos+1] == '\n') {
-                /* Found. */
-                return s+pos;
-            } else {
-                /* Continue searching. */
-                pos++;
-            }
-        }
+        if (p[1] == '\n')
+            return p;
+        p++;
     }
     return NULL;
 }
 
-/* Read a long long value starting at *s, under the assumption that it will be
- * terminated by \r\n. Ambiguously returns -1 for unexpected input. */
-static long long readLongLong(char *s) {
-    long long v = 0;
-    int dec, mult = 1;
-    char c;
-
-    if (*s == '-') {
-        mult = -1;
-        s++;
-    } else if (*s == '+') {
-        mult = 1;
-        s++;
+#ifdef HIREDIS_SIMD_SSE2
+/* Compare 16 bytes against '\r' and the same 16 bytes shifted by one against
+ * '\n', so every set bit in the mask is a complete \r\n pair. */
+static char *seekNewlineSSE2(char *s, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t pos = 0;
+    int mask;
+
+    while (pos+16 < len) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s+pos));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s+pos+1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,cr),
+                                               _mm_cmpeq_epi8(b,lf)));
+        if (mask != 0)
+            return s+pos+__builtin_ctz(mask);
+        pos += 16;
     }
-
-    while ((c = *(s++)) != '\r') {
-        dec = c - '0';
-        if (dec >= 0 && dec < 10) {
-            v *= 10;
-            v += dec;
-        } else {
-            /* Should not happen... */
-            return -1;
-        }
+    return seekNewlineScalar(s+pos,len-pos);
+}
+#endif
+
+#ifdef HIREDIS_SIMD_AVX2
+/* Same as seekNewlineSSE2, 32 bytes at a time. Only called when the CPU
+ * reports AVX2 support at runtime. */
+__attribute__((target("avx2")))
+static char *seekNewlineAVX2(char *s, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t pos = 0;
+    unsigned int mask;
+
+    while (pos+32 < len) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s+pos));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s+pos+1));
+        mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a,cr),_mm256_cmpeq_epi8(b,lf)));
+        if (mask != 0)
+            return s+pos+__builtin_ctz(mask);
+        pos += 32;
     }
-
-    return mult*v;
+    return seekNewlineSSE2(s+pos,len-pos);
 }
-
-static char *readLine(redisReader *r, int *_len) {
-    char *p, *s;
-    int len;
-
-    p = r->buf+r->pos;
-    s = seekNewline(p,(r->len-r->pos));
-    if (s != NULL) {
-        len = s-(r->buf+r->pos);
-        r->pos += len+2; /* skip \r\n */
-        if (_len) *_len = len;
-        return p;
+#endif
+
+/* Implementation used by seekNewline, upgraded by seekNewlineInit() when the
+ * CPU supports a wider instruction set than the one compiled for. */
+#ifdef HIREDIS_SIMD_SSE2
+static char *(*seekNewline)(char *s, size_t len) = seekNewlineSSE2;
+#else
+static char *(*seekNewline)(char *s, size_t len) = seekNewlineScalar;
+#endif
+
+#ifdef HIREDIS_SIMD_AVX2
+/* Runs once when the library is loaded, before any thread can create a
+ * reader, so seekNewline is never written while it is being used. */
+__attribute__((constructor))
+static void seekNewlineInit(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        seekNewline = seekNewlineAVX2;
+}
+#endif
+
+/* Find the \r\n terminating the line that starts at the reader cursor. The
+ * reader remembers how far an incomplete line was searched, so a line that
+ * arrives in many small reads is only scanned once. */
+static char *seekLineEnd(redisReader *r) {
+    size_t from = r->scanpos > r->pos ? r->scanpos : r->pos;
+    char *s;
+
+    s = seekNewline(r->buf+from,r->len-from);
+    if (s == NULL && r->len > from) {
+        /* The last byte can be a \r that is completed by the next feed. */
+        r->scanpos = r->len-1;
     }
-    return NULL;
+    return s;
 }
 
-static void moveToNextTask(redisReader *r) {
-    redisReadTask *cur, *prv;
-    while (r->ridx >= 0) {
-        /* Return a.s.a.p. when the stack is now empty. */
-        if (r->ridx == 0) {
-            r->ridx--;
-            return;
-        }
+/* Digits are checked and converted eight (and then four) at a time on little
+ * endian CPUs, where the first digit ends up in the lowest byte of a load. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HIREDIS_SWAR_DIGITS
+#endif
+
+#ifdef HIREDIS_SWAR_DIGITS
+/* Returns 1 when all 8 bytes in v are ASCII digits: the high nibble must be
+ * 3, also after adding 6 to the low nibble. */
+static int swarAllDigits(uint64_t v) {
+    return ((v & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((v+0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+           0x3333333333333333ULL;
+}
 
-        cur = &(r->rstack[r->ridx]);
-        prv = &(r->rstack[r->ridx-1]);
-        assert(prv->type == REDIS_REPLY_ARRAY);
-        if (cur->idx == prv->elements-1) {
-            r->ridx--;
-        } else {
-            /* Reset the type because the next item can be anything */
-            assert(cur->idx < prv->elements);
-            cur->type = -1;
-            cur->elements = -1;
-            cur->idx++;
-            return;
-        }
-    }
+/* Convert 8 ASCII digits by combining pairs, then quads, then both halves. */
+static uint64_t swarParseDigits(uint64_t v) {
+    v = ((v & 0x0F0F0F0F0F0F0F0FULL)*2561) >> 8;
+    v = ((v & 0x00FF00FF00FF00FFULL)*6553601) >> 16;
+    return ((v & 0x0000FFFF0000FFFFULL)*42949672960001ULL) >> 32;
 }
 
-static int processLineItem(redisReader *r) {
-    redisReadTask *cur = &(r->rstack[r->ridx]);
-    void *obj;
-    char *p;
-    int len;
+/* Same as the above for 4 digits. */
+static int swarAllDigits4(uint32_t v) {
+    return ((v & 0xF0F0F0F0U) | (((v+0x06060606U) & 0xF0F0F0F0U) >> 4)) ==
+           0x33333333U;
+}
 
-    if ((p = readLine(r,&len)) != NULL) {
-        if (cur->type == REDIS_REPLY_INTEGER) {
-            if (r->fn && r->fn->createInteger)
-                obj = r->fn->createInteger(cur,readLongLong(p));
-            else
-                obj = (void*)REDIS_REPLY_INTEGER;
-        } else {
-            /* Type will be error or status. */
-            if (r->fn && r->fn->createString)
-                obj = r->fn->createString(cur,p,len);
-            else
-                obj = (void*)(size_t)(cur->type);
-        }
+static uint32_t swarParseDigits4(uint32_t v) {
+    v = ((v & 0x0F0F0F0FU)*2561) >> 8;
+    return ((v & 0x00FF00FFU)*6553601) >> 16;
+}
+#endif
+
+/* Parse the integer in the len bytes at s. Anything but an optional minus
+ * sign followed by digits is rejected, as is a value that doesn't fit in a
+ * long long, so the caller can tell errors apart from a valid -1. */
+static int string2ll(const char *s, size_t len, long long *value) {
+    const char *p = s, *end = s+len;
+    unsigned long long v = 0;
+    int negative = 0;
+#ifdef HIREDIS_SWAR_DIGITS
+    uint64_t chunk;
+    uint32_t chunk4;
+#endif
+
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    if (p == end)
+        return REDIS_ERR;
 
-        if (obj == NULL) {
-            __redisReaderSetErrorOOM(r);
+    /* At most 19 digits, which can't overflow an unsigned long long. Leading
+     * zeros don't count. */
+    if (end-p > 19) {
+        while (end-p > 1 && *p == '0')
+            p++;
+        if (end-p > 19)
             return REDIS_ERR;
-        }
-
-        /* Set reply if this is the root object. */
-        if (r->ridx == 0) r->reply = obj;
-        moveToNextTask(r);
-        return REDIS_OK;
     }
 
-    return REDIS_ERR;
-}
+#ifdef HIREDIS_SWAR_DIGITS
+    while (end-p >= 8) {
+        memcpy(&chunk,p,8);
+        if (!swarAllDigits(chunk))
+            return REDIS_ERR;
+        v = v*100000000+swarParseDigits(chunk);
+        p += 8;
+    }
+    if (end-p >= 4) {
+        memcpy(&chunk4,p,4);
+        if (!swarAllDigits4(chunk4))
+            return REDIS_ERR;
+        v = v*10000+swarParseDigits4(chunk4);
+        p += 4;
+    }
+#endif
+    while (p < end) {
+        unsigned int d = (unsigned char)*p-'0';
+        if (d > 9)
+            return REDIS_ERR;
+        v = v*10+d;
+        p++;
+    }
 
-static int processBulkItem(redisReader *r) {
-    redisReadTask *cur = &(r->rstack[r->ridx]);
-    void *obj = NULL;
+    if (negative) {
+        if (v > (unsigned long long)LLONG_MAX+1)
+            return REDIS_ERR;
+        *value = (v == (unsigned long long)LLONG_MAX+1) ? LLONG_MIN : -(long long)v;
+    } else {
+        if (v > LLONG_MAX)
+            return REDIS_ERR;
+        *value = v;
+    }
+    return REDIS_OK;
+}
+
+/* Powers of ten that are exact doubles. */
+static const double exactPow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* 128 bit approximations of the powers of ten from 1e-64 to 1e64, high word
+ * first, normalized so the top bit is set. Doubles outside of this range are
+ * rare in replies and go to strtod. */
+#define POW10_MIN_EXP -64
+#define POW10_MAX_EXP 64
+static const uint64_t pow10Significands[][2] = {
+    {0xA87FEA27A539E9A5ULL,0x3F2398D747B36224ULL}, {0xD29FE4B18E88640EULL,0x8EEC7F0D19A03AADULL},
+    {0x83A3EEEEF9153E89ULL,0x1953CF68300424ACULL}, {0xA48CEAAAB75A8E2BULL,0x5FA8C3423C052DD7ULL},
+    {0xCDB02555653131B6ULL,0x3792F412CB06794DULL}, {0x808E17555F3EBF11ULL,0xE2BBD88BBEE40BD0ULL},
+    {0xA0B19D2AB70E6ED6ULL,0x5B6ACEAEAE9D0EC4ULL}, {0xC8DE047564D20A8BULL,0xF245825A5A445275ULL},
+    {0xFB158592BE068D2EULL,0xEED6E2F0F0D56712ULL}, {0x9CED737BB6C4183DULL,0x55464DD69685606BULL},
+    {0xC428D05AA4751E4CULL,0xAA97E14C3C26B886ULL}, {0xF53304714D9265DFULL,0xD53DD99F4B3066A8ULL},
+    {0x993FE2C6D07B7FABULL,0xE546A8038EFE4029ULL}, {0xBF8FDB78849A5F96ULL,0xDE98520472BDD033ULL},
+    {0xEF73D256A5C0F77CULL,0x963E66858F6D4440ULL}, {0x95A8637627989AADULL,0xDDE7001379A44AA8ULL},
+    {0xBB127C53B17EC159ULL,0x5560C018580D5D52ULL}, {0xE9D71B689DDE71AFULL,0xAAB8F01E6E10B4A6ULL},
+    {0x9226712162AB070DULL,0xCAB3961304CA70E8ULL}, {0xB6B00D69BB55C8D1ULL,0x3D607B97C5FD0D22ULL},
+    {0xE45C10C42A2B3B05ULL,0x8CB89A7DB77C506AULL}, {0x8EB98A7A9A5B04E3ULL,0x77F3608E92ADB242ULL},
+    {0xB267ED1940F1C61CULL,0x55F038B237591ED3ULL}, {0xDF01E85F912E37A3ULL,0x6B6C46DEC52F6688ULL},
+    {0x8B61313BBABCE2C6ULL,0x2323AC4B3B3DA015ULL}, {0xAE397D8AA96C1B77ULL,0xABEC975E0A0D081AULL},
+    {0xD9C7DCED53C72255ULL,0x96E7BD358C904A21ULL}, {0x881CEA14545C7575ULL,0x7E50D64177DA2E54ULL},
+    {0xAA242499697392D2ULL,0xDDE50BD1D5D0B9E9ULL}, {0xD4AD2DBFC3D07787ULL,0x955E4EC64B44E864ULL},
+    {0x84EC3C97DA624AB4ULL,0xBD5AF13BEF0B113EULL}, {0xA6274BBDD0FADD61ULL,0xECB1AD8AEACDD58EULL},
+    {0xCFB11EAD453994BAULL,0x67DE18EDA5814AF2ULL}, {0x81CEB32C4B43FCF4ULL,0x80EACF948770CED7ULL},
+    {0xA2425FF75E14FC31ULL,0xA1258379A94D028DULL}, {0xCAD2F7F5359A3B3EULL,0x096EE45813A04330ULL},
+    {0xFD87B5F28300CA0DULL,0x8BCA9D6E188853FCULL}, {0x9E74D1B791E07E48ULL,0x775EA264CF55347EULL},
+    {0xC612062576589DDAULL,0x95364AFE032A819EULL}, {0xF79687AED3EEC551ULL,0x3A83DDBD83F52205ULL},
+    {0x9ABE14CD44753B52ULL,0xC4926A9672793543ULL}, {0xC16D9A0095928A27ULL,0x75B7053C0F178294ULL},
+    {0xF1C90080BAF72CB1ULL,0x5324C68B12DD6339ULL}, {0x971DA05074DA7BEEULL,0xD3F6FC16EBCA5E04ULL},
+    {0xBCE5086492111AEAULL,0x88F4BB1CA6BCF585ULL}, {0xEC1E4A7DB69561A5ULL,0x2B31E9E3D06C32E6ULL},
+    {0x9392EE8E921D5D07ULL,0x3AFF322E62439FD0ULL}, {0xB877AA3236A4B449ULL,0x09BEFEB9FAD487C3ULL},
+    {0xE69594BEC44DE15BULL,0x4C2EBE687989A9B4ULL}, {0x901D7CF73AB0ACD9ULL,0x0F9D37014BF60A11ULL},
+    {0xB424DC35095CD80FULL,0x538484C19EF38C95ULL}, {0xE12E13424BB40E13ULL,0x2865A5F206B06FBAULL},
+    {0x8CBCCC096F5088CBULL,0xF93F87B7442E45D4ULL}, {0xAFEBFF0BCB24AAFEULL,0xF78F69A51539D749ULL},
+    {0xDBE6FECEBDEDD5BEULL,0xB573440E5A884D1CULL}, {0x89705F4136B4A597ULL,0x31680A88F8953031ULL},
+    {0xABCC77118461CEFCULL,0xFDC20D2B36BA7C3EULL}, {0xD6BF94D5E57A42BCULL,0x3D32907604691B4DULL},
+    {0x8637BD05AF6C69B5ULL,0xA63F9A49C2C1B110ULL}, {0xA7C5AC471B478423ULL,0x0FCF80DC33721D54ULL},
+    {0xD1B71758E219652BULL,0xD3C36113404EA4A9ULL}, {0x83126E978D4FDF3BULL,0x645A1CAC083126EAULL},
+    {0xA3D70A3D70A3D70AULL,0x3D70A3D70A3D70A4ULL}, {0xCCCCCCCCCCCCCCCCULL,0xCCCCCCCCCCCCCCCDULL},
+    {0x8000000000000000ULL,0x0000000000000000ULL}, {0xA000000000000000ULL,0x0000000000000000ULL},
+    {0xC800000000000000ULL,0x0000000000000000ULL}, {0xFA00000000000000ULL,0x0000000000000000ULL},
+    {0x9C40000000000000ULL,0x0000000000000000ULL}, {0xC350000000000000ULL,0x0000000000000000ULL},
+    {0xF424000000000000ULL,0x0000000000000000ULL}, {0x9896800000000000ULL,0x0000000000000000ULL},
+    {0xBEBC200000000000ULL,0x0000000000000000ULL}, {0xEE6B280000000000ULL,0x0000000000000000ULL},
+    {0x9502F90000000000ULL,0x0000000000000000ULL}, {0xBA43B74000000000ULL,0x0000000000000000ULL},
+    {0xE8D4A51000000000ULL,0x0000000000000000ULL}, {0x9184E72A00000000ULL,0x0000000000000000ULL},
+    {0xB5E620F480000000ULL,0x0000000000000000ULL}, {0xE35FA931A0000000ULL,0x0000000000000000ULL},
+    {0x8E1BC9BF04000000ULL,0x0000000000000000ULL}, {0xB1A2BC2EC5000000ULL,0x0000000000000000ULL},
+    {0xDE0B6B3A76400000ULL,0x0000000000000000ULL}, {0x8AC7230489E80000ULL,0x0000000000000000ULL},
+    {0xAD78EBC5AC620000ULL,0x0000000000000000ULL}, {0xD8D726B7177A8000ULL,0x0000000000000000ULL},
+    {0x878678326EAC9000ULL,0x0000000000000000ULL}, {0xA968163F0A57B400ULL,0x0000000000000000ULL},
+    {0xD3C21BCECCEDA100ULL,0x0000000000000000ULL}, {0x84595161401484A0ULL,0x0000000000000000ULL},
+    {0xA56FA5B99019A5C8ULL,0x0000000000000000ULL}, {0xCECB8F27F4200F3AULL,0x0000000000000000ULL},
+    {0x813F3978F8940984ULL,0x4000000000000000ULL}, {0xA18F07D736B90BE5ULL,0x5000000000000000ULL},
+    {0xC9F2C9CD04674EDEULL,0xA400000000000000ULL}, {0xFC6F7C4045812296ULL,0x4D00000000000000ULL},
+    {0x9DC5ADA82B70B59DULL,0xF020000000000000ULL}, {0xC5371912364CE305ULL,0x6C28000000000000ULL},
+    {0xF684DF56C3E01BC6ULL,0xC732000000000000ULL}, {0x9A130B963A6C115CULL,0x3C7F400000000000ULL},
+    {0xC097CE7BC90715B3ULL,0x4B9F100000000000ULL}, {0xF0BDC21ABB48DB20ULL,0x1E86D40000000000ULL},
+    {0x96769950B50D88F4ULL,0x1314448000000000ULL}, {0xBC143FA4E250EB31ULL,0x17D955A000000000ULL},
+    {0xEB194F8E1AE525FDULL,0x5DCFAB0800000000ULL}, {0x92EFD1B8D0CF37BEULL,0x5AA1CAE500000000ULL},
+    {0xB7ABC627050305ADULL,0xF14A3D9E40000000ULL}, {0xE596B7B0C643C719ULL,0x6D9CCD05D0000000ULL},
+    {0x8F7E32CE7BEA5C6FULL,0xE4820023A2000000ULL}, {0xB35DBF821AE4F38BULL,0xDDA2802C8A800000ULL},
+    {0xE0352F62A19E306EULL,0xD50B2037AD200000ULL}, {0x8C213D9DA502DE45ULL,0x4526F422CC340000ULL},
+    {0xAF298D050E4395D6ULL,0x9670B12B7F410000ULL}, {0xDAF3F04651D47B4CULL,0x3C0CDD765F114000ULL},
+    {0x88D8762BF324CD0FULL,0xA5880A69FB6AC800ULL}, {0xAB0E93B6EFEE0053ULL,0x8EEA0D047A457A00ULL},
+    {0xD5D238A4ABE98068ULL,0x72A4904598D6D880ULL}, {0x85A36366EB71F041ULL,0x47A6DA2B7F864750ULL},
+    {0xA70C3C40A64E6C51ULL,0x999090B65F67D924ULL}, {0xD0CF4B50CFE20765ULL,0xFFF4B4E3F741CF6DULL},
+    {0x82818F1281ED449FULL,0xBFF8F10E7A8921A4ULL}, {0xA321F2D7226895C7ULL,0xAFF72D52192B6A0DULL},
+    {0xCBEA6F8CEB02BB39ULL,0x9BF4F8A69F764490ULL}, {0xFEE50B7025C36A08ULL,0x02F236D04753D5B4ULL},
+    {0x9F4F2726179A2245ULL,0x01D762422C946590ULL}, {0xC722F0EF9D80AAD6ULL,0x424D3AD2B7B97EF5ULL},
+    {0xF8EBAD2B84E0D58BULL,0xD2E0898765A7DEB2ULL}, {0x9B934C3B330C8577ULL,0x63CC55F49F88EB2FULL},
+    {0xC2781F49FFCFA6D5ULL,0x3CBF6B71C76B25FBULL}
+};
+
+/* 64x64 to 128 bit multiplication. */
+static uint64_t mul64(uint64_t a, uint64_t b, uint64_t *lo) {
+    uint64_t alo = a & 0xFFFFFFFF, ahi = a >> 32;
+    uint64_t blo = b & 0xFFFFFFFF, bhi = b >> 32;
+    uint64_t ll = alo*blo, lh = alo*bhi, hl = ahi*blo, hh = ahi*bhi;
+    uint64_t mid = (ll >> 32)+(lh & 0xFFFFFFFF)+(hl & 0xFFFFFFFF);
+
+    *lo = (mid << 32) | (ll & 0xFFFFFFFF);
+    return hh+(lh >> 32)+(hl >> 32)+(mid >> 32);
+}
+
+/* Compute m*10^exp, correctly rounded, with the Eisel-Lemire algorithm: the
+ * normalized mantissa is multiplied by a truncated 128 bit power of ten,
+ * which is enough to round correctly unless the result is too close to a
+ * halfway point to tell. Returns 0 in that case and when the result is out
+ * of the normal range, so the caller can fall back to strtod. m can't be 0. */
+static int eiselLemire(uint64_t m, long long exp, int negative, double *value) {
+    const uint64_t *pow10;
+    uint64_t hi, lo, yhi, ylo, mantissa, bits;
+    int64_t exp2;
+    int clz = 0, msb;
+
+    if (exp < POW10_MIN_EXP || exp > POW10_MAX_EXP)
+        return 0;
+    pow10 = pow10Significands[exp-POW10_MIN_EXP];
+
+    while (!(m & (1ULL << 63))) {
+        m <<= 1;
+        clz++;
+    }
+    /* 217706/65536 approximates log2(10). */
+    exp2 = ((217706*exp) >> 16)+64+1023-clz;
+
+    hi = mul64(m,pow10[0],&lo);
+    if ((hi & 0x1FF) == 0x1FF && lo+m < m) {
+        /* The low bits are inconclusive, use the rest of the power. */
+        yhi = mul64(m,pow10[1],&ylo);
+        lo += yhi;
+        if (lo < yhi) hi++;
+        if ((hi & 0x1FF) == 0x1FF && lo+1 == 0 && ylo+m < m)
+            return 0;
+    }
+
+    msb = hi >> 63;
+    mantissa = hi >> (msb+9);
+    exp2 -= 1^msb;
+    if (lo == 0 && (hi & 0x1FF) == 0 && (mantissa & 3) == 1)
+        return 0;
+
+    /* Round the 54 bits we have to 53. */
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >> 53) {
+        mantissa >>= 1;
+        exp2++;
+    }
+    if (exp2 <= 0 || exp2 >= 0x7FF)
+        return 0;
+
+    bits = ((uint64_t)exp2 << 52) | (mantissa & 0x000FFFFFFFFFFFFFULL);
+    if (negative) bits |= 1ULL << 63;
+    memcpy(value,&bits,sizeof(*value));
+    return 1;
+}
+
+/* Accumulate a run of digits into *m and return how many were consumed.
+ * *ndigits counts significant digits: when there are more than 19, *m is no
+ * longer exact and *inexact is set. */
+static inline size_t readDigits(const char **pp, const char *end, unsigned long long *m,
+                                int *ndigits, int *inexact)
+{
+    const char *p = *pp;
+    unsigned int d;
+    size_t n;
+#ifdef HIREDIS_SWAR_DIGITS
+    uint64_t chunk;
+
+    /* Leading zeros in a chunk are counted as well, which is harmless. */
+    while (end-p >= 8 && *ndigits <= 11) {
+        memcpy(&chunk,p,8);
+        if (!swarAllDigits(chunk))
+            break;
+        *m = *m*100000000+swarParseDigits(chunk);
+        if (*m != 0) *ndigits += 8;
+        p += 8;
+    }
+#endif
+    while (p < end && (d = (unsigned char)*p-'0') <= 9) {
+        if (*ndigits < 19) {
+            *m = *m*10+d;
+            if (*m != 0) (*ndigits)++;
+        } else {
+            *inexact = 1;
+        }
+        p++;
+    }
+    n = p-*pp;
+    *pp = p;
+    return n;
+}
+
+/* Case insensitive match of the len bytes at p against a lower case word. */
+static int matchWord(const char *p, size_t len, const char *word) {
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (word[i] == '\0' || (p[i]|0x20) != word[i])
+            return 0;
+    return word[i] == '\0';
+}
+
+/* Parse the double in the len bytes at s. The syntax is the one Redis uses
+ * for doubles: an optional sign, digits with an optional fraction and
+ * exponent, or inf and nan. A value with at most 19 significant digits whose
+ * mantissa and power of ten are both exact doubles is correctly rounded with
+ * a single multiplication or division, other values with at most 19
+ * significant digits mostly with eiselLemire. Everything else goes to
+ * strtod, with the '.' swapped for the decimal point of the current locale. */
+static int string2d(const char *s, size_t len, double *value) {
+    const char *p = s, *end = s+len, *point;
+    unsigned long long m = 0;
+    long long exp = 0;
+    size_t intdigits, fracdigits = 0, pointlen, i, j;
+    int ndigits = 0, inexact = 0, negative = 0, expnegative = 0;
+    char buf[64], *copy, *eptr;
+    double d;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    if (p < end && ((*p|0x20) == 'i' || (*p|0x20) == 'n')) {
+        if (!matchWord(p,end-p,"inf") && !matchWord(p,end-p,"nan") &&
+            !matchWord(p,end-p,"infinity"))
+            return REDIS_ERR;
+        inexact = 1;
+    } else {
+        intdigits = readDigits(&p,end,&m,&ndigits,&inexact);
+        if (p < end && *p == '.') {
+            p++;
+            fracdigits = readDigits(&p,end,&m,&ndigits,&inexact);
+        }
+        if (intdigits+fracdigits == 0)
+            return REDIS_ERR;
+
+        if (p < end && (*p|0x20) == 'e') {
+            p++;
+            if (p < end && (*p == '-' || *p == '+')) {
+                expnegative = (*p == '-');
+                p++;
+            }
+            if (p == end)
+                return REDIS_ERR;
+            while (p < end && (unsigned int)((unsigned char)*p-'0') <= 9) {
+                if (exp < 100000) exp = exp*10+(*p-'0');
+                p++;
+            }
+        }
+        if (p != end)
+            return REDIS_ERR;
+
+        if (expnegative) exp = -exp;
+        exp -= (long long)fracdigits;
+        if (m == 0 && !inexact) {
+            *value = negative ? -0.0 : 0.0;
+            return REDIS_OK;
+        }
+        if (!inexact && m <= (1ULL << 53) && exp >= -22 && exp <= 22) {
+            d = (double)m;
+            d = exp < 0 ? d/exactPow10[-exp] : d*exactPow10[exp];
+            *value = negative ? -d : d;
+            return REDIS_OK;
+        }
+        if (!inexact && eiselLemire(m,exp,negative,value))
+            return REDIS_OK;
+    }
+
+    /* Slow path. The syntax was checked above, so strtod has to consume the
+     * copy completely. */
+    point = localeconv()->decimal_point;
+    pointlen = strlen(point);
+    if (len+pointlen < sizeof(buf)) {
+        copy = buf;
+    } else if ((copy = malloc(len+pointlen+1)) == NULL) {
+        return REDIS_ERR;
+    }
+    for (i = 0, j = 0; i < len; i++) {
+        if (s[i] == '.') {
+            memcpy(copy+j,point,pointlen);
+            j += pointlen;
+        } else {
+            copy[j++] = s[i];
+        }
+    }
+    copy[j] = '\0';
+    d = strtod(copy,&eptr);
+    if (copy != buf) free(copy);
+    if (eptr != copy+j)
+        return REDIS_ERR;
+    *value = d;
+    return REDIS_OK;
+}
+
+/* Tokens used to stream a bulk that is not completely buffered. These are
+ * only produced for the tree builder when the reply object functions
+ * implement streaming. */
+#define REDIS_EVENT_STRING_BEGIN 16 /* Length in integer */
+#define REDIS_EVENT_STRING_CHUNK 17
+#define REDIS_EVENT_STRING_END 18
+
+/* Token type for every valid type byte, REDIS_EVENT_NONE for the others. */
+static const unsigned char eventTypes[256] = {
+    ['$'] = REDIS_EVENT_STRING,
+    ['*'] = REDIS_EVENT_ARRAY,
+    [':'] = REDIS_EVENT_INTEGER,
+    ['_'] = REDIS_EVENT_NIL,
+    ['+'] = REDIS_EVENT_STATUS,
+    ['-'] = REDIS_EVENT_ERROR,
+    ['!'] = REDIS_EVENT_ERROR,
+    [','] = REDIS_EVENT_DOUBLE,
+    ['#'] = REDIS_EVENT_BOOL,
+    ['%'] = REDIS_EVENT_MAP,
+    ['~'] = REDIS_EVENT_SET,
+    ['|'] = REDIS_EVENT_ATTR,
+    ['>'] = REDIS_EVENT_PUSH,
+    ['('] = REDIS_EVENT_BIGNUM,
+    ['='] = REDIS_EVENT_VERB
+};
+
+/* Returns 1 for the tokens that start an aggregate. */
+static int isAggregateEvent(int type) {
+    return type == REDIS_EVENT_ARRAY || type == REDIS_EVENT_MAP ||
+           type == REDIS_EVENT_SET || type == REDIS_EVENT_ATTR ||
+           type == REDIS_EVENT_PUSH;
+}
+
+/* An element of the innermost open array was read completely. */
+static void finishElement(redisReader *r) {
+    if (r->depth > 0)
+        r->pending[r->depth-1]--;
+}
+
+/* Return the buffered part of a streamed bulk payload, and finish the string
+ * once the payload and its \r\n were consumed. */
+static int readBulkChunk(redisReader *r, redisReaderEvent *ev) {
+    size_t avail = r->len-r->pos, n;
+
+    ev->depth = r->depth;
+    if (r->bulkleft > 2) {
+        if (avail == 0)
+            return REDIS_OK;
+
+        n = r->bulkleft-2 < avail ? r->bulkleft-2 : avail;
+        ev->type = REDIS_EVENT_STRING_CHUNK;
+        ev->str = r->buf+r->pos;
+        ev->len = n;
+        r->pos += n;
+        r->bulkleft -= n;
+        return REDIS_OK;
+    }
+
+    /* Skip the \r\n, which may arrive in separate reads. */
+    n = r->bulkleft < avail ? r->bulkleft : avail;
+    r->pos += n;
+    r->bulkleft -= n;
+    if (r->bulkleft == 0) {
+        ev->type = REDIS_EVENT_STRING_END;
+        finishElement(r);
+    }
+    return REDIS_OK;
+}
+
+/* Flags for readEvent. */
+#define REDIS_READ_STREAM 0x1 /* Hand out bulk strings in chunks */
+#define REDIS_READ_REPLY 0x2 /* Bulks become strings of redisReply objects */
+#define REDIS_READ_PEEK 0x4 /* Don't put the reader in an error state */
+
+/* Fail to read a token with a protocol error, which is only recorded in the
+ * reader when it is not peeking ahead. */
+static int readEventError(redisReader *r, int flags, const char *str) {
+    if (!(flags & REDIS_READ_PEEK))
+        __redisReaderSetError(r,REDIS_ERR_PROTOCOL,str);
+    return REDIS_ERR;
+}
+
+/* Read the next token from the buffer. A bulk is only returned once it is
+ * completely buffered, unless REDIS_READ_STREAM is set. */
+static int readEvent(redisReader *r, redisReaderEvent *ev, int flags) {
     char *p, *s;
-    long len;
-    unsigned long bytelen;
-    int success = 0;
+    long long len;
+    size_t avail;
+    int type;
+
+    ev->type = REDIS_EVENT_NONE;
+
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return REDIS_ERR;
+
+    if (r->bulkleft > 0)
+        return readBulkChunk(r,ev);
+
+    /* Close the innermost array when all of its elements were read. An
+     * attribute is not an element of its parent. */
+    if (r->depth > 0 && r->pending[r->depth-1] == 0) {
+        r->depth--;
+        ev->type = REDIS_EVENT_ARRAY_END;
+        ev->depth = r->depth;
+        ev->integer = r->ptype[r->depth];
+        if (ev->integer == REDIS_EVENT_ATTR)
+            r->attrs &= ~(1u << r->depth);
+        else
+            finishElement(r);
+        return REDIS_OK;
+    }
+
+    if (r->pos == r->len)
+        return REDIS_OK;
+
+    /* Check the type byte before waiting for the rest of the line. */
+    p = r->buf+r->pos;
+    type = eventTypes[(unsigned char)*p];
+    if (type == REDIS_EVENT_NONE) {
+        if (!(flags & REDIS_READ_PEEK))
+            __redisReaderSetErrorProtocolByte(r,*p);
+        return REDIS_ERR;
+    }
+
+    /* Set error for nested multi bulks with depth > 7 */
+    if (isAggregateEvent(type) && r->depth == 8) {
+        return readEventError(r,flags,
+            "No support for nested multi bulk replies with depth > 7");
+    }
+
+    if ((s = seekLineEnd(r)) == NULL)
+        return REDIS_OK;
+
+    ev->depth = r->depth;
+    switch (*p) {
+    case '-':
+    case '+':
+    case '(':
+        ev->type = type;
+        ev->str = p+1;
+        ev->len = s-(p+1);
+        break;
+    case ':':
+        if (string2ll(p+1,s-(p+1),&ev->integer) != REDIS_OK) {
+            return readEventError(r,flags,"Bad integer value");
+        }
+        ev->type = REDIS_EVENT_INTEGER;
+        break;
+    case '_':
+        ev->type = REDIS_EVENT_NIL;
+        break;
+    case ',':
+        if (string2d(p+1,s-(p+1),&ev->dval) != REDIS_OK) {
+            return readEventError(r,flags,"Bad double value");
+        }
+        ev->type = REDIS_EVENT_DOUBLE;
+        ev->str = p+1;
+        ev->len = s-(p+1);
+        break;
+    case '#':
+        if (s != p+2 || (p[1] != 't' && p[1] != 'f')) {
+            return readEventError(r,flags,"Bad bool value");
+        }
+        ev->type = REDIS_EVENT_BOOL;
+        ev->integer = (p[1] == 't');
+        break;
+    case '$':
+    case '!':
+    case '=':
+        if (string2ll(p+1,s-(p+1),&len) != REDIS_OK || len < -1) {
+            return readEventError(r,flags,"Bad bulk string length");
+        }
+        if (len < 0) {
+            ev->type = REDIS_EVENT_NIL;
+            break;
+        }
+
+        /* Refuse bulks that don't fit the reply before making room for
+         * them. Streamed strings are never held in a reply. */
+        if ((unsigned long long)len > SIZE_MAX/2 ||
+            ((flags & REDIS_READ_REPLY) &&
+             (unsigned long long)len > REDIS_REPLY_LEN_MAX &&
+             !((flags & REDIS_READ_STREAM) && type == REDIS_EVENT_STRING)))
+        {
+            return readEventError(r,flags,"Bulk length out of range");
+        }
+
+        /* Only continue when the buffer contains the entire bulk item,
+         * or hand out the payload in chunks when streaming. */
+        avail = r->len-(s+2-r->buf);
+        if ((unsigned long long)len+2 <= avail) {
+            if (type == REDIS_EVENT_VERB && (len < 4 || s[2+3] != ':')) {
+                return readEventError(r,flags,"Bad verbatim string");
+            }
+            ev->type = type;
+            ev->str = s+2;
+            ev->len = len;
+            r->pos = (s+2+len+2)-r->buf;
+            r->bulkend = 0;
+            finishElement(r);
+        } else if ((flags & REDIS_READ_STREAM) && type == REDIS_EVENT_STRING) {
+            ev->type = REDIS_EVENT_STRING_BEGIN;
+            ev->integer = len;
+            r->pos = (s+2)-r->buf;
+            r->bulkleft = len+2;
+        } else if (len >= REDIS_READER_LARGE_BULK) {
+            /* Make room for the whole bulk with the next read. */
+            r->bulkend = (s+2+len+2)-r->buf;
+        }
+        return REDIS_OK;
+    default:
+        if (string2ll(p+1,s-(p+1),&len) != REDIS_OK || len < -1 ||
+            len > LLONG_MAX/2)
+        {
+            return readEventError(r,flags,"Bad multi-bulk length");
+        }
+        if (len < 0) {
+            ev->type = REDIS_EVENT_NIL;
+            break;
+        }
+
+        /* Maps and attributes hold a key and a value per entry. The
+         * elements follow, closed by an REDIS_EVENT_ARRAY_END. */
+        if (type == REDIS_EVENT_MAP || type == REDIS_EVENT_ATTR)
+            len *= 2;
+        if (type == REDIS_EVENT_ATTR)
+            r->attrs |= 1u << r->depth;
+        ev->type = type;
+        ev->integer = len;
+        r->pos = (s+2)-r->buf;
+        r->ptype[r->depth] = type;
+        r->pending[r->depth++] = len;
+        return REDIS_OK;
+    }
+
+    r->pos = (s+2)-r->buf;
+    finishElement(r);
+    return REDIS_OK;
+}
+
+/* Move on to the next element of the parent array, or end the reply when the
+ * task at "ridx" is the root. */
+static void moveToNextTask(redisReader *r) {
+    redisReadTask *cur = &(r->rstack[r->ridx]);
+
+    if (r->ridx == 0) {
+        r->ridx--;
+        return;
+    }
+
+    /* Reset the type because the next item can be anything */
+    cur->type = -1;
+    cur->elements = -1;
+    cur->obj = NULL;
+    cur->idx++;
+}
+
+/* Create the reply object for a token, using the reply object functions. */
+static int buildReply(redisReader *r, const redisReaderEvent *ev) {
+    redisReadTask *cur, *next;
+    void *obj = NULL;
+
+    /* Attributes are not part of the reply tree. */
+    if (ev->type == REDIS_EVENT_ATTR ||
+        (ev->type == REDIS_EVENT_ARRAY_END && ev->integer == REDIS_EVENT_ATTR) ||
+        (r->attrs & ((1u << ev->depth)-1)))
+        return REDIS_OK;
+
+    /* Set first item to process when the stack is empty. */
+    if (r->ridx == -1) {
+        r->rstack[0].type = -1;
+        r->rstack[0].elements = -1;
+        r->rstack[0].idx = -1;
+        r->rstack[0].obj = NULL;
+        r->rstack[0].parent = NULL;
+        r->rstack[0].privdata = r->privdata;
+        r->ridx = 0;
+    }
+
+    r->ridx = ev->depth;
+    cur = &(r->rstack[r->ridx]);
+
+    switch (ev->type) {
+    case REDIS_EVENT_STATUS:
+    case REDIS_EVENT_ERROR:
+    case REDIS_EVENT_STRING:
+    case REDIS_EVENT_BIGNUM:
+    case REDIS_EVENT_VERB:
+        cur->type = ev->type;
+        if (r->fn && r->fn->createString)
+            obj = createString(r,cur,ev->str,ev->len);
+        else
+            obj = (void*)(size_t)(cur->type);
+        break;
+    case REDIS_EVENT_INTEGER:
+        cur->type = REDIS_REPLY_INTEGER;
+        if (r->fn && r->fn->createInteger)
+            obj = r->fn->createInteger(cur,ev->integer);
+        else
+            obj = (void*)REDIS_REPLY_INTEGER;
+        break;
+    case REDIS_EVENT_NIL:
+        cur->type = REDIS_REPLY_NIL;
+        if (r->fn && r->fn->createNil)
+            obj = r->fn->createNil(cur);
+        else
+            obj = (void*)REDIS_REPLY_NIL;
+        break;
+    case REDIS_EVENT_DOUBLE:
+        cur->type = REDIS_REPLY_DOUBLE;
+        if (r->fn && r->fn->createDouble)
+            obj = r->fn->createDouble(cur,ev->dval,ev->str,ev->len);
+        else if (r->fn && r->fn->createString)
+            obj = r->fn->createString(cur,ev->str,ev->len);
+        else
+            obj = (void*)REDIS_REPLY_DOUBLE;
+        break;
+    case REDIS_EVENT_BOOL:
+        cur->type = REDIS_REPLY_BOOL;
+        if (r->fn && r->fn->createBool)
+            obj = r->fn->createBool(cur,ev->integer);
+        else if (r->fn && r->fn->createInteger)
+            obj = r->fn->createInteger(cur,ev->integer);
+        else
+            obj = (void*)REDIS_REPLY_BOOL;
+        break;
+    case REDIS_EVENT_ARRAY:
+    case REDIS_EVENT_MAP:
+    case REDIS_EVENT_SET:
+    case REDIS_EVENT_PUSH:
+        /* Reply objects count elements in an int. */
+        if (ev->integer > INT_MAX) {
+            __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                "Multi-bulk length out of range");
+            return REDIS_ERR;
+        }
+        cur->type = ev->type;
+        if (r->fn && r->fn->createArray)
+            obj = r->fn->createArray(cur,ev->integer);
+        else
+            obj = (void*)(size_t)(cur->type);
+
+        if (obj == NULL) {
+            __redisReaderSetErrorOOM(r);
+            return REDIS_ERR;
+        }
+
+        /* Set reply if this is the root object, so it is free'd on errors,
+         * and continue with the first element. */
+        if (r->ridx == 0) r->reply = obj;
+        cur->elements = ev->integer;
+        cur->obj = obj;
+        r->ridx++;
+        next = &(r->rstack[r->ridx]);
+        next->type = -1;
+        next->elements = -1;
+        next->idx = 0;
+        next->obj = NULL;
+        next->parent = cur;
+        next->privdata = r->privdata;
+        return REDIS_OK;
+    case REDIS_EVENT_ARRAY_END:
+        moveToNextTask(r);
+        return REDIS_OK;
+    case REDIS_EVENT_STRING_BEGIN:
+        cur->type = REDIS_REPLY_STRING;
+        obj = r->fn->beginString(cur,ev->integer);
+        if (obj == NULL) {
+            __redisReaderSetErrorOOM(r);
+            return REDIS_ERR;
+        }
+
+        /* Make sure the object is free'd on errors. */
+        if (r->ridx == 0) r->reply = obj;
+        cur->obj = obj;
+        return REDIS_OK;
+    case REDIS_EVENT_STRING_CHUNK:
+        if (r->fn->appendString(cur,cur->obj,ev->str,ev->len) != REDIS_OK) {
+            __redisReaderSetErrorOOM(r);
+            return REDIS_ERR;
+        }
+        return REDIS_OK;
+    case REDIS_EVENT_STRING_END:
+        obj = cur->obj;
+        if (r->fn->endString && r->fn->endString(cur,obj) != REDIS_OK) {
+            __redisReaderSetErrorOOM(r);
+            return REDIS_ERR;
+        }
+        break;
+    default:
+        assert(NULL);
+        return REDIS_ERR; /* Avoid warning. */
+    }
+
+    if (obj == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return REDIS_ERR;
+    }
+
+    /* Set reply if this is the root object. */
+    if (r->ridx == 0) r->reply = obj;
+    moveToNextTask(r);
+    return REDIS_OK;
+}
+
+redisReader *redisReaderCreate(void) {
+    redisReader *r;
+
+    r = calloc(sizeof(redisReader),1);
+    if (r == NULL)
+        return NULL;
+
+    r->err = 0;
+    r->errstr[0] = '\0';
+    r->fn = &defaultFunctions;
+    r->segment = createSegment(REDIS_READER_SEGMENT);
+    r->maxbuf = REDIS_READER_MAX_BUF;
+    if (r->segment == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->buf = r->segment->data;
+    r->readsize = REDIS_READER_MIN_READ;
+
+    r->ridx = -1;
+    return r;
+}
+
+void redisReaderFree(redisReader *r) {
+    if (r->reply != NULL && r->fn && r->fn->freeObject)
+        r->fn->freeObject(r->reply);
+    if (r->lazy != NULL)
+        freeLazyArray(r->lazy);
+    if (r->segment != NULL)
+        releaseSegment(r->segment);
+    free(r);
+}
+
+int redisReaderEnableReplyArena(redisReader *r) {
+    if (r->fn != &defaultFunctions && r->fn != &arenaFunctions)
+        return REDIS_ERR;
+    r->fn = &arenaFunctions;
+    return REDIS_OK;
+}
+
+int redisReaderEnableBorrowedStrings(redisReader *r) {
+    if (r->fn != &defaultFunctions && r->fn != &arenaFunctions)
+        return REDIS_ERR;
+    r->flags |= REDIS_READER_BORROW;
+    return REDIS_OK;
+}
+
+int redisReaderEnableLazyArrays(redisReader *r) {
+    if (r->fn != &defaultFunctions)
+        return REDIS_ERR;
+    r->flags |= REDIS_READER_LAZY;
+    return REDIS_OK;
+}
+
+int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return REDIS_ERR;
+
+    /* Copy the provided buffer. */
+    if (buf != NULL && len >= 1) {
+        rewindBuffer(r);
+        if (r->segment->size-r->len < len &&
+            makeRoomForFeed(r,feedRoom(r,len)) != REDIS_OK)
+        {
+            __redisReaderSetErrorOOM(r);
+            return REDIS_ERR;
+        }
+
+        memcpy(r->buf+r->len,buf,len);
+        r->len += len;
+    }
+
+    return REDIS_OK;
+}
+
+char *redisReaderReserve(redisReader *r, size_t *len) {
+    size_t room;
+
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return NULL;
+
+    rewindBuffer(r);
+    room = feedRoom(r,r->readsize);
+    if (r->segment->size-r->len < room && makeRoomForFeed(r,room) != REDIS_OK) {
+        __redisReaderSetErrorOOM(r);
+        return NULL;
+    }
+
+    *len = r->segment->size-r->len;
+    return r->buf+r->len;
+}
+
+int redisReaderCommit(redisReader *r, size_t len) {
+    if (r->err)
+        return REDIS_ERR;
+
+    assert(len <= r->segment->size-r->len);
+    r->len += len;
+
+    /* Double the next read when this one filled the reserved size, and halve
+     * it when replies turn out to be much smaller. */
+    if (len >= r->readsize && r->readsize < REDIS_READER_MAX_READ)
+        r->readsize *= 2;
+    else if (len < r->readsize/4 && r->readsize > REDIS_READER_MIN_READ)
+        r->readsize /= 2;
+    return REDIS_OK;
+}
+
+int redisReaderNextEvent(redisReader *r, redisReaderEvent *ev) {
+    return readEvent(r,ev,0);
+}
+
+static int readLazyReply(redisReader *r, void **reply);
+
+/* Flags to read the tokens of a reply with, see readEvent. */
+static int replyReadFlags(redisReader *r) {
+    int flags = 0;
+
+    if (r->fn && r->fn->beginString && r->fn->appendString)
+        flags |= REDIS_READ_STREAM;
+    if (r->fn == &defaultFunctions || r->fn == &arenaFunctions)
+        flags |= REDIS_READ_REPLY;
+    return flags;
+}
+
+/* Returns 1 when the reader creates redisReply objects, for async.c. */
+int __redisReaderBuildsReplies(redisReader *r) {
+    return (replyReadFlags(r) & REDIS_READ_REPLY) != 0;
+}
+
+/* Build the next reply out of the tokens that are buffered. *reply is set
+ * to NULL when the reply is not complete yet. */
+static int readReply(redisReader *r, void **reply) {
+    redisReaderEvent ev;
+    int flags;
+
+    if (r->lazy != NULL ||
+        ((r->flags & REDIS_READER_LAZY) && r->fn == &defaultFunctions &&
+         r->ridx == -1 && r->pos < r->len &&
+         (r->buf[r->pos] == '*' || r->buf[r->pos] == '%' ||
+          r->buf[r->pos] == '~')))
+        return readLazyReply(r,reply);
+
+    *reply = NULL;
+    flags = replyReadFlags(r);
+    do {
+        if (readEvent(r,&ev,flags) != REDIS_OK)
+            return REDIS_ERR;
+        if (ev.type == REDIS_EVENT_NONE)
+            return REDIS_OK;
+        if (buildReply(r,&ev) != REDIS_OK)
+            return REDIS_ERR;
+    } while (r->ridx >= 0 || r->reply == NULL);
+
+    *reply = r->reply;
+    r->reply = NULL;
+    return REDIS_OK;
+}
+
+/* Record where the elements of a lazy array start, without building them.
+ * The reply stays in the buffer: r->pos is left at its start until the reply
+ * is complete, so it is not discarded or moved apart when the reader makes
+ * room for new data. */
+static int readLazyReply(redisReader *r, void **reply) {
+    redisLazyArray *la = r->lazy;
+    redisReaderEvent ev;
+    size_t start = r->pos, before;
+    redisReply *obj;
+
+    *reply = NULL;
+    if (la == NULL) {
+        if (readEvent(r,&ev,REDIS_READ_REPLY) != REDIS_OK)
+            return REDIS_ERR;
+        if (ev.type == REDIS_EVENT_NONE)
+            return REDIS_OK;
+
+        /* A nil array is built right away. */
+        if (ev.type == REDIS_EVENT_NIL) {
+            if (buildReply(r,&ev) != REDIS_OK)
+                return REDIS_ERR;
+            *reply = r->reply;
+            r->reply = NULL;
+            return REDIS_OK;
+        }
+
+        la = calloc(1,sizeof(*la));
+        if (la != NULL)
+            la->offsets = malloc(sizeof(size_t)*(ev.integer+1));
+        if (la == NULL || la->offsets == NULL) {
+            free(la);
+            __redisReaderSetErrorOOM(r);
+            return REDIS_ERR;
+        }
+        la->kind = REDIS_OWNER_LAZY;
+        la->elements = ev.integer;
+        la->type = ev.type;
+        la->expect = 1;
+        la->framed = r->pos-start;
+        r->lazy = la;
+    }
+
+    r->pos = start+la->framed;
+    for (;;) {
+        before = r->pos;
+        if (readEvent(r,&ev,REDIS_READ_REPLY) != REDIS_OK)
+            return REDIS_ERR;
+        if (ev.type == REDIS_EVENT_NONE)
+            break;
+
+        if (ev.depth == 0)
+            break; /* The end of the reply */
+        if (ev.depth > 1)
+            continue;
+
+        /* An element starts with the first token at depth 1 after the
+         * previous element, which may be an attribute. */
+        if (la->expect && ev.type != REDIS_EVENT_ARRAY_END) {
+            la->offsets[la->count++] = before-start;
+            la->expect = 0;
+        }
+        if (ev.type == REDIS_EVENT_ARRAY_END ? ev.integer != REDIS_EVENT_ATTR
+                                             : !isAggregateEvent(ev.type))
+            la->expect = 1;
+    }
+
+    if (ev.type == REDIS_EVENT_NONE) {
+        la->framed = r->pos-start;
+        r->pos = start;
+        return REDIS_OK;
+    }
+
+    /* The reply is complete: keep its segment alive and consume it. */
+    obj = createReplyObject(la->type);
+    if (obj != NULL && la->elements > 0) {
+        obj->element = calloc(la->elements,sizeof(redisReply*));
+        if (obj->element == NULL) {
+            free(obj);
+            obj = NULL;
+        }
+    }
+    if (obj == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return REDIS_ERR;
+    }
+
+    la->offsets[la->count] = r->pos-start;
+    la->seg = r->segment;
+    la->seg->refcount++;
+    la->base = r->buf+start;
+    obj->elements = la->elements;
+    obj->owner = la;
+    r->lazy = NULL;
+    *reply = obj;
+    return REDIS_OK;
+}
+
+/* Decode an element of a lazy array with a reader on the stack that reads
+ * straight from the retained segment. */
+static redisReply *decodeLazyElement(redisLazyArray *la, size_t idx) {
+    redisReader r;
+    void *obj;
+
+    memset(&r,0,sizeof(r));
+    r.buf = la->base+la->offsets[idx];
+    r.len = la->offsets[idx+1]-la->offsets[idx];
+    r.fn = &defaultFunctions;
+    r.ridx = -1;
+    if (readReply(&r,&obj) != REDIS_OK)
+        return NULL;
+    return obj;
+}
+
+static int isLazyElement(const redisReply *reply, size_t idx) {
+    return reply->element[idx] == NULL && reply->owner != NULL &&
+           *(int*)reply->owner == REDIS_OWNER_LAZY;
+}
+
+redisReply *redisReplyElement(redisReply *reply, size_t idx) {
+    if (idx >= reply->elements)
+        return NULL;
+
+    if (isLazyElement(reply,idx))
+        reply->element[idx] = decodeLazyElement(reply->owner,idx);
+    return reply->element[idx];
+}
+
+/* Convert a reply to a number. Integers and doubles are converted directly,
+ * strings, status replies and big numbers are parsed. */
+int redisReplyAsDouble(const redisReply *reply, double *value) {
+    long long ll;
+
+    switch(reply->type) {
+    case REDIS_REPLY_DOUBLE:
+        *value = reply->dval;
+        return REDIS_OK;
+    case REDIS_REPLY_INTEGER:
+        *value = (double)reply->integer;
+        return REDIS_OK;
+    case REDIS_REPLY_BIGNUM:
+        /* Big numbers are allowed to lose precision here. */
+        if (string2ll(reply->str,reply->len,&ll) == REDIS_OK) {
+            *value = (double)ll;
+            return REDIS_OK;
+        }
+        /* fall through */
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
+        return string2d(reply->str,reply->len,value);
+    default:
+        return REDIS_ERR;
+    }
+}
+
+int redisReplyAsInt64(const redisReply *reply, int64_t *value) {
+    long long ll;
+
+    switch(reply->type) {
+    case REDIS_REPLY_INTEGER:
+        *value = reply->integer;
+        return REDIS_OK;
+    case REDIS_REPLY_DOUBLE:
+        /* Only doubles without a fraction that are in range. */
+        if (!(reply->dval >= -9223372036854775808.0 &&
+              reply->dval < 9223372036854775808.0) ||
+            (double)(long long)reply->dval != reply->dval)
+            return REDIS_ERR;
+        *value = (long long)reply->dval;
+        return REDIS_OK;
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_BIGNUM:
+        if (string2ll(reply->str,reply->len,&ll) != REDIS_OK)
+            return REDIS_ERR;
+        *value = ll;
+        return REDIS_OK;
+    default:
+        return REDIS_ERR;
+    }
+}
+
+/* Find the text of a lazy array element that wasn't decoded yet, so it can
+ * be converted without creating a reply object. Sets *type to the protocol
+ * type byte. Only scalar elements have text. */
+static int lazyElementText(redisLazyArray *la, size_t idx, char *type,
+                           const char **str, size_t *len)
+{
+    const char *p = la->base+la->offsets[idx];
+    const char *end = la->base+la->offsets[idx+1]-2; /* Strip \r\n */
+
+    *type = *p;
+    switch(*p) {
+    case '$':
+        if (p[1] == '-')
+            return REDIS_ERR;
+        p = memchr(p,'\n',end-p);
+        break;
+    case '+':
+    case ':':
+    case ',':
+    case '(':
+        break;
+    default:
+        return REDIS_ERR;
+    }
+    *str = p+1;
+    *len = end-(p+1);
+    return REDIS_OK;
+}
+
+/* Convert elements first, first+step, ... of an aggregate reply. Elements of
+ * lazy arrays that weren't accessed yet are converted straight from the
+ * protocol without decoding them. */
+int redisReplyArrayAsDoubles(redisReply *reply, size_t first, size_t step,
+                             double *values, size_t *n)
+{
+    const char *str;
+    size_t idx, len;
+    long long ll;
+    char type;
+    redisReply *elem;
+
+    *n = 0;
+    if (!isAggregateType(reply->type) || step == 0)
+        return REDIS_ERR;
+
+    for (idx = first; idx < reply->elements; idx += step) {
+        if (isLazyElement(reply,idx) &&
+            lazyElementText(reply->owner,idx,&type,&str,&len) == REDIS_OK)
+        {
+            if (type == ':') {
+                if (string2ll(str,len,&ll) != REDIS_OK)
+                    return REDIS_ERR;
+                values[*n] = (double)ll;
+            } else if (string2d(str,len,&values[*n]) != REDIS_OK) {
+                return REDIS_ERR;
+            }
+        } else if ((elem = redisReplyElement(reply,idx)) == NULL ||
+                   redisReplyAsDouble(elem,&values[*n]) != REDIS_OK)
+        {
+            return REDIS_ERR;
+        }
+        (*n)++;
+    }
+    return REDIS_OK;
+}
+
+int redisReplyArrayAsInt64s(redisReply *reply, size_t first, size_t step,
+                            int64_t *values, size_t *n)
+{
+    const char *str;
+    size_t idx, len;
+    long long ll;
+    char type;
+    redisReply *elem;
+
+    *n = 0;
+    if (!isAggregateType(reply->type) || step == 0)
+        return REDIS_ERR;
+
+    for (idx = first; idx < reply->elements; idx += step) {
+        if (isLazyElement(reply,idx) &&
+            lazyElementText(reply->owner,idx,&type,&str,&len) == REDIS_OK &&
+            type != ',')
+        {
+            if (string2ll(str,len,&ll) != REDIS_OK)
+                return REDIS_ERR;
+            values[*n] = ll;
+        } else if ((elem = redisReplyElement(reply,idx)) == NULL ||
+                   redisReplyAsInt64(elem,&values[*n]) != REDIS_OK)
+        {
+            return REDIS_ERR;
+        }
+        (*n)++;
+    }
+    return REDIS_OK;
+}
+
+int redisReaderGetReply(redisReader *r, void **reply) {
+    void *obj;
+
+    /* Default target pointer to NULL. */
+    if (reply != NULL)
+        *reply = NULL;
+
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return REDIS_ERR;
 
-    p = r->buf+r->pos;
-    s = seekNewline(p,r->len-r->pos);
-    if (s != NULL) {
-        p = r->buf+r->pos;
-        bytelen = s-(r->buf+r->pos)+2; /* include \r\n */
-        len = readLongLong(p);
+    /* When the buffer is empty, there will never be a reply. */
+    if (r->len == 0)
+        return REDIS_OK;
 
-        if (len < 0) {
-            /* The nil object can always be created. */
-            if (r->fn && r->fn->createNil)
-                obj = r->fn->createNil(cur);
-            else
-                obj = (void*)REDIS_REPLY_NIL;
-            success = 1;
-        } else {
-            /* Only continue when the buffer contains the entire bulk item. */
-            bytelen += len+2; /* include \r\n */
-            if (r->pos+bytelen <= r->len) {
-                if (r->fn && r->fn->createString)
-                    obj = r->fn->createString(cur,s+2,len);
-                else
-                    obj = (void*)REDIS_REPLY_STRING;
-                success = 1;
-            }
-        }
+    if (readReply(r,&obj) != REDIS_OK)
+        return REDIS_ERR;
 
-        /* Proceed when obj was created. */
-        if (success) {
-            if (obj == NULL) {
-                __redisReaderSetErrorOOM(r);
-                return REDIS_ERR;
-            }
+    /* Consumed bytes are never moved: the buffer is only rewound once
+     * everything was consumed, and redisReaderFeed makes room for new
+     * data when the segment is full. */
+    rewindBuffer(r);
+
+    if (reply != NULL)
+        *reply = obj;
+    return REDIS_OK;
+}
 
-            r->pos += bytelen;
+int redisReaderGetReplies(redisReader *r, void **replies, size_t max, size_t *n) {
+    void *obj;
+    int ret = REDIS_OK;
 
-            /* Set reply if this is the root object. */
-            if (r->ridx == 0) r->reply = obj;
-            moveToNextTask(r);
-            return REDIS_OK;
-        }
+    *n = 0;
+
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return REDIS_ERR;
+
+    while (*n < max) {
+        if ((ret = readReply(r,&obj)) != REDIS_OK || obj == NULL)
+            break;
+        replies[(*n)++] = obj;
     }
 
-    return REDIS_ERR;
+    /* Rewind once for the whole batch. */
+    if (ret == REDIS_OK)
+        rewindBuffer(r);
+    return ret;
 }
 
-static int processMultiBulkItem(redisReader *r) {
-    redisReadTask *cur = &(r->rstack[r->ridx]);
-    void *obj;
-    char *p;
-    long elements;
-    int root = 0;
+int redisReaderCountReplies(redisReader *r, size_t *count) {
+    size_t pos = r->pos, scanpos = r->scanpos, bulkleft = r->bulkleft;
+    long long pending[sizeof(r->pending)/sizeof(r->pending[0])];
+    int ptype[sizeof(r->ptype)/sizeof(r->ptype[0])];
+    int depth = r->depth;
+    int flags = (replyReadFlags(r) & ~REDIS_READ_STREAM) | REDIS_READ_PEEK;
+    unsigned int attrs = r->attrs;
+    redisReaderEvent ev;
 
-    /* Set error for nested multi bulks with depth > 7 */
-    if (r->ridx == 8) {
-        __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
-            "No support for nested multi bulk replies with depth > 7");
+    *count = 0;
+    if (r->err)
         return REDIS_ERR;
+
+    /* Run the parser ahead and put its state back afterwards. Nothing is
+     * built, so the buffer is not modified. Counting stops at a malformed
+     * reply: its error is reported by the call that reads it. */
+    if (r->lazy != NULL)
+        r->pos += r->lazy->framed;
+    memcpy(pending,r->pending,sizeof(pending));
+    memcpy(ptype,r->ptype,sizeof(ptype));
+    while (readEvent(r,&ev,flags) == REDIS_OK && ev.type != REDIS_EVENT_NONE) {
+        if (ev.depth == 0 && !isAggregateEvent(ev.type) &&
+            ev.type != REDIS_EVENT_STRING_CHUNK &&
+            (ev.type != REDIS_EVENT_ARRAY_END || ev.integer != REDIS_EVENT_ATTR))
+            (*count)++;
     }
 
-    if ((p = readLine(r,NULL)) != NULL) {
-        elements = readLongLong(p);
-        root = (r->ridx == 0);
+    r->pos = pos;
+    r->scanpos = scanpos;
+    r->bulkleft = bulkleft;
+    r->depth = depth;
+    r->attrs = attrs;
+    memcpy(r->pending,pending,sizeof(pending));
+    memcpy(r->ptype,ptype,sizeof(ptype));
+    return REDIS_OK;
+}
 
-        if (elements == -1) {
-            if (r->fn && r->fn->createNil)
-                obj = r->fn->createNil(cur);
-            else
-                obj = (void*)REDIS_REPLY_NIL;
+/* Parse the bulk string "$<len>\r\n<str>\r\n" at p. Returns a pointer past
+ * it, or NULL when it is something else or doesn't end before end. */
+static const char *messageBulk(const char *p, const char *end, const char **str, size_t *len) {
+    unsigned long long n = 0;
+    int digits = 0;
 
-            if (obj == NULL) {
-                __redisReaderSetErrorOOM(r);
-                return REDIS_ERR;
-            }
+    if (p == end || *p++ != '$')
+        return NULL;
+    while (p < end && *p >= '0' && *p <= '9' && digits < 18) {
+        n = n*10+(*p++ - '0');
+        digits++;
+    }
+    if (digits == 0 || end-p < 2 || p[0] != '\r' || p[1] != '\n')
+        return NULL;
+    p += 2;
+    if ((unsigned long long)(end-p) < n+2 || n > REDIS_REPLY_LEN_MAX ||
+        p[n] != '\r' || p[n+1] != '\n')
+        return NULL;
+    *str = p;
+    *len = (size_t)n;
+    return p+n+2;
+}
 
-            moveToNextTask(r);
-        } else {
-            if (r->fn && r->fn->createArray)
-                obj = r->fn->createArray(cur,elements);
-            else
-                obj = (void*)REDIS_REPLY_ARRAY;
+int redisReaderGetMessage(redisReader *r, redisMessage *msg) {
+    const char *p = r->buf+r->pos, *end = r->buf+r->len;
+    const char *type;
+    size_t typelen;
 
-            if (obj == NULL) {
-                __redisReaderSetErrorOOM(r);
-                return REDIS_ERR;
-            }
+    msg->type = REDIS_MESSAGE_NONE;
+    if (r->err)
+        return REDIS_ERR;
 
-            /* Modify task stack when there are more than 0 elements. */
-            if (elements > 0) {
-                cur->elements = elements;
-                cur->obj = obj;
-                r->ridx++;
-                r->rstack[r->ridx].type = -1;
-                r->rstack[r->ridx].elements = -1;
-                r->rstack[r->ridx].idx = 0;
-                r->rstack[r->ridx].obj = NULL;
-                r->rstack[r->ridx].parent = cur;
-                r->rstack[r->ridx].privdata = r->privdata;
-            } else {
-                moveToNextTask(r);
-            }
-        }
+    /* Only a reply that starts at the cursor and is buffered completely can
+     * be decoded here, so the parser must not be in the middle of one. */
+    if (r->ridx != -1 || r->depth != 0 || r->lazy != NULL || r->bulkleft != 0)
+        return REDIS_OK;
+    if (end-p < 4 || (p[0] != '*' && p[0] != '>') ||
+        (p[1] != '3' && p[1] != '4') || p[2] != '\r' || p[3] != '\n')
+        return REDIS_OK;
+    if ((p = messageBulk(p+4,end,&type,&typelen)) == NULL)
+        return REDIS_OK;
 
-        /* Set reply if this is the root object. */
-        if (root) r->reply = obj;
+    if (r->buf[r->pos+1] == '3' && typelen == 7 &&
+        memcmp(type,"message",7) == 0)
+    {
+        msg->pattern = NULL;
+        msg->patternlen = 0;
+    } else if (r->buf[r->pos+1] == '4' && typelen == 8 &&
+               memcmp(type,"pmessage",8) == 0)
+    {
+        if ((p = messageBulk(p,end,&msg->pattern,&msg->patternlen)) == NULL)
+            return REDIS_OK;
+    } else {
         return REDIS_OK;
     }
 
-    return REDIS_ERR;
-}
+    if ((p = messageBulk(p,end,&msg->channel,&msg->channellen)) == NULL ||
+        (p = messageBulk(p,end,&msg->payload,&msg->payloadlen)) == NULL)
+        return REDIS_OK;
 
-static int processItem(redisReader *r) {
-    redisReadTask *cur = &(r->rstack[r->ridx]);
-    char *p;
+    msg->type = msg->pattern ? REDIS_MESSAGE_PATTERN : REDIS_MESSAGE;
+    r->pos = p-r->buf;
+    return REDIS_OK;
+}
 
-    /* check if we need to read type */
-    if (cur->type < 0) {
-        if ((p = readBytes(r,1)) != NULL) {
-            switch (p[0]) {
-            case '-':
-                cur->type = REDIS_REPLY_ERROR;
-                break;
-            case '+':
-                cur->type = REDIS_REPLY_STATUS;
-                break;
-            case ':':
-                cur->type = REDIS_REPLY_INTEGER;
-                break;
-            case '$':
-                cur->type = REDIS_REPLY_STRING;
-                break;
-            case '*':
-                cur->type = REDIS_REPLY_ARRAY;
-                break;
-            default:
-                __redisReaderSetErrorProtocolByte(r,*p);
-                return REDIS_ERR;
-            }
-        } else {
-            /* could not consume 1 byte */
-            return REDIS_ERR;
-        }
+/* Number of decimal digits of v. */
+static int countDigits(unsigned long long v) {
+    int len = 1;
+
+    for (;;) {
+        if (v < 10) return len;
+        if (v < 100) return len+1;
+        if (v < 1000) return len+2;
+        if (v < 10000) return len+3;
+        v /= 10000;
+        len += 4;
     }
+}
 
-    /* process typed item */
-    switch(cur->type) {
-    case REDIS_REPLY_ERROR:
-    case REDIS_REPLY_STATUS:
-    case REDIS_REPLY_INTEGER:
-        return processLineItem(r);
-    case REDIS_REPLY_STRING:
-        return processBulkItem(r);
-    case REDIS_REPLY_ARRAY:
-        return processMultiBulkItem(r);
-    default:
-        assert(NULL);
-        return REDIS_ERR; /* Avoid warning. */
+/* Write the decimal digits of v to dst, without a terminating nul byte, and
+ * return their number. */
+static int ull2str(char *dst, unsigned long long v) {
+    static const char digits[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    int len = countDigits(v), next = len-1;
+
+    while (v >= 100) {
+        int i = (v%100)*2;
+        v /= 100;
+        dst[next] = digits[i+1];
+        dst[next-1] = digits[i];
+        next -= 2;
     }
+    if (v < 10) {
+        dst[next] = '0'+v;
+    } else {
+        dst[next] = digits[v*2+1];
+        dst[next-1] = digits[v*2];
+    }
+    return len;
 }
 
-redisReader *redisReaderCreate(void) {
-    redisReader *r;
-
-    r = calloc(sizeof(redisReader),1);
-    if (r == NULL)
-        return NULL;
-
-    r->err = 0;
-    r->errstr[0] = '\0';
-    r->fn = &defaultFunctions;
-    r->buf = sdsempty();
-    r->maxbuf = REDIS_READER_MAX_BUF;
-    if (r->buf == NULL) {
-        free(r);
-        return NULL;
+static int ll2str(char *dst, long long v) {
+    if (v < 0) {
+        *dst = '-';
+        return 1+ull2str(dst+1,-(unsigned long long)v);
     }
-
-    r->ridx = -1;
-    return r;
+    return ull2str(dst,v);
 }
 
-void redisReaderFree(redisReader *r) {
-    if (r->reply != NULL && r->fn && r->fn->freeObject)
-        r->fn->freeObject(r->reply);
-    if (r->buf != NULL)
-        sdsfree(r->buf);
-    free(r);
-}
+/* Operations of a prepared format. A run of arguments without conversions
+ * is encoded up front and copied verbatim (REDIS_FMT_RAW). Every other
+ * argument starts with REDIS_FMT_ARG, followed by its literal parts and
+ * conversions. */
+#define REDIS_FMT_RAW 0 /* Copy "len" bytes at "off" in the literals */
+#define REDIS_FMT_ARG 1 /* Argument made of the next "count" operations */
+#define REDIS_FMT_LIT 2 /* Literal part of an argument, like RAW */
+#define REDIS_FMT_STRING 3 /* %s */
+#define REDIS_FMT_BINARY 4 /* %b */
+#define REDIS_FMT_INT 5 /* %d and %i, "size" holds the va_arg type */
+#define REDIS_FMT_UINT 6 /* %u */
+#define REDIS_FMT_PRINTF 7 /* Any other conversion, the printf format is at "off" */
+
+/* va_arg types of integer and printf conversions. */
+#define REDIS_FMT_SIZE_INT 0
+#define REDIS_FMT_SIZE_LONG 1
+#define REDIS_FMT_SIZE_LONGLONG 2
+#define REDIS_FMT_SIZE_DOUBLE 3
+
+typedef struct redisFormatOp {
+    int type;
+    int size; /* REDIS_FMT_SIZE_* */
+    size_t off; /* Offset in the literals */
+    size_t len; /* Bytes of literals, for an argument those of its parts */
+    int count; /* Operations that make up an argument */
+} redisFormatOp;
+
+struct redisFormat {
+    int argc;
+    int nops;
+    int nslots; /* Number of conversions */
+    size_t fixedlen; /* Bytes written for every command, without conversions */
+    redisFormatOp *ops;
+    sds lits;
+};
 
-int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
-    sds newbuf;
+/* The value of a conversion when a prepared format is used. */
+typedef struct redisFormatSlot {
+    const char *p;
+    size_t len;
+    char *alloc; /* Set when the text doesn't fit in buf */
+    char buf[32];
+} redisFormatSlot;
 
-    /* Return early when this reader is in an erroneous state. */
-    if (r->err)
-        return REDIS_ERR;
+/* Number of conversions that are resolved without a heap allocation. */
+#define REDIS_FORMAT_STACK_SLOTS 16
 
-    /* Copy the provided buffer. */
-    if (buf != NULL && len >= 1) {
-        /* Destroy internal buffer when it is empty and is quite large. */
-        if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf) {
-            sdsfree(r->buf);
-            r->buf = sdsempty();
-            r->pos = 0;
-
-            /* r->buf should not be NULL since we just free'd a larger one. */
-            assert(r->buf != NULL);
-        }
+static int addFormatOp(redisFormat *fmt, int type, int size, size_t off, size_t len) {
+    redisFormatOp *ops, *op;
 
-        newbuf = sdscatlen(r->buf,buf,len);
-        if (newbuf == NULL) {
-            __redisReaderSetErrorOOM(r);
+    if ((fmt->nops & (fmt->nops-1)) == 0) {
+        ops = realloc(fmt->ops,sizeof(*ops)*(fmt->nops ? fmt->nops*2 : 4));
+        if (ops == NULL)
             return REDIS_ERR;
-        }
-
-        r->buf = newbuf;
-        r->len = sdslen(r->buf);
+        fmt->ops = ops;
     }
-
+    op = &fmt->ops[fmt->nops++];
+    op->type = type;
+    op->size = size;
+    op->off = off;
+    op->len = len;
+    op->count = 0;
     return REDIS_OK;
 }
 
-int redisReaderGetReply(redisReader *r, void **reply) {
-    /* Default target pointer to NULL. */
-    if (reply != NULL)
-        *reply = NULL;
+/* Append literal bytes to the current argument, which starts at operation
+ * "first". Consecutive bytes are merged into a single operation. */
+static int addFormatLiteral(redisFormat *fmt, int first, const char *s, size_t len) {
+    redisFormatOp *last = fmt->nops > first ? &fmt->ops[fmt->nops-1] : NULL;
+    size_t off = sdslen(fmt->lits);
+    sds lits;
 
-    /* Return early when this reader is in an erroneous state. */
-    if (r->err)
+    if ((lits = sdscatlen(fmt->lits,s,len)) == NULL)
         return REDIS_ERR;
-
-    /* When the buffer is empty, there will never be a reply. */
-    if (r->len == 0)
+    fmt->lits = lits;
+    if (last != NULL && last->type == REDIS_FMT_LIT) {
+        last->len += len;
         return REDIS_OK;
-
-    /* Set first item to process when the stack is empty. */
-    if (r->ridx == -1) {
-        r->rstack[0].type = -1;
-        r->rstack[0].elements = -1;
-        r->rstack[0].idx = -1;
-        r->rstack[0].obj = NULL;
-        r->rstack[0].parent = NULL;
-        r->rstack[0].privdata = r->privdata;
-        r->ridx = 0;
     }
+    return addFormatOp(fmt,REDIS_FMT_LIT,0,off,len);
+}
 
-    /* Process items in reply. */
-    while (r->ridx >= 0)
-        if (processItem(r) != REDIS_OK)
-            break;
+/* Close the argument that starts at operation "first". An argument without
+ * conversions is encoded as a bulk right away, and merged with the raw bytes
+ * before it. */
+static int endFormatArgument(redisFormat *fmt, int first) {
+    redisFormatOp *op;
+    char header[32];
+    size_t off, len = 0;
+    int j, slots = 0, hlen;
+    sds lits;
+
+    for (j = first; j < fmt->nops; j++) {
+        if (fmt->ops[j].type == REDIS_FMT_LIT)
+            len += fmt->ops[j].len;
+        else
+            slots++;
+    }
+    fmt->argc++;
+
+    if (slots == 0) {
+        off = fmt->nops > first ? fmt->ops[first].off : sdslen(fmt->lits);
+        header[0] = '$';
+        hlen = 1+ull2str(header+1,len);
+        header[hlen++] = '\r';
+        header[hlen++] = '\n';
+
+        /* Rewrite the literal as a bulk in place. */
+        lits = sdsgrowzero(fmt->lits,off+hlen+len+2);
+        if (lits == NULL)
+            return REDIS_ERR;
+        memmove(lits+off+hlen,lits+off,len);
+        memcpy(lits+off,header,hlen);
+        memcpy(lits+off+hlen+len,"\r\n",2);
+        fmt->lits = lits;
+        fmt->nops = first;
+        fmt->fixedlen += hlen+len+2;
+
+        op = fmt->nops > 0 ? &fmt->ops[fmt->nops-1] : NULL;
+        if (op != NULL && op->type == REDIS_FMT_RAW && op->off+op->len == off) {
+            op->len += hlen+len+2;
+            return REDIS_OK;
+        }
+        return addFormatOp(fmt,REDIS_FMT_RAW,0,off,hlen+len+2);
+    }
 
-    /* Return ASAP when an error occurred. */
-    if (r->err)
+    /* Insert the argument operation in front of its parts. */
+    if (addFormatOp(fmt,REDIS_FMT_ARG,0,0,len) != REDIS_OK)
         return REDIS_ERR;
+    op = &fmt->ops[fmt->nops-1];
+    memmove(&fmt->ops[first+1],&fmt->ops[first],sizeof(*op)*(fmt->nops-1-first));
+    fmt->ops[first].type = REDIS_FMT_ARG;
+    fmt->ops[first].size = 0;
+    fmt->ops[first].off = 0;
+    fmt->ops[first].len = len;
+    fmt->ops[first].count = fmt->nops-1-first;
+    fmt->nslots += slots;
+    fmt->fixedlen += 1+2+len+2; /* $, \r\n, literals, \r\n */
+    return REDIS_OK;
+}
 
-    /* Discard part of the buffer when we've consumed at least 1k, to avoid
-     * doing unnecessary calls to memmove() in sds.c. */
-    if (r->pos >= 1024) {
-        r->buf = sdsrange(r->buf,r->pos,-1);
-        r->pos = 0;
-        r->len = sdslen(r->buf);
+/* Parse a printf conversion the way redisvFormatCommand does. On success,
+ * *type and *size describe the conversion and *end points to its last
+ * character. */
+static int parseConversion(const char *c, int *type, int *size, const char **end) {
+    static const char intfmts[] = "diouxX";
+    const char *p = c+1;
+    int plain;
+
+    /* Flags */
+    if (*p != '\0' && *p == '#') p++;
+    if (*p != '\0' && *p == '0') p++;
+    if (*p != '\0' && *p == '-') p++;
+    if (*p != '\0' && *p == ' ') p++;
+    if (*p != '\0' && *p == '+') p++;
+
+    /* Field width */
+    while (*p != '\0' && isdigit(*p)) p++;
+
+    /* Precision */
+    if (*p == '.') {
+        p++;
+        while (*p != '\0' && isdigit(*p)) p++;
     }
+    plain = (p == c+1);
 
-    /* Emit a reply when there is one. */
-    if (r->ridx == -1) {
-        if (reply != NULL)
-            *reply = r->reply;
-        r->reply = NULL;
-    }
-    return REDIS_OK;
-}
+    *type = REDIS_FMT_PRINTF;
+    if (*p != '\0' && strchr("eEfFgGaA",*p) != NULL) {
+        *size = REDIS_FMT_SIZE_DOUBLE;
+    } else {
+        *size = REDIS_FMT_SIZE_INT;
+        if (p[0] == 'h' && p[1] == 'h') {
+            p += 2;
+            plain = 0;
+        } else if (p[0] == 'h') {
+            p += 1;
+            plain = 0;
+        } else if (p[0] == 'l' && p[1] == 'l') {
+            p += 2;
+            *size = REDIS_FMT_SIZE_LONGLONG;
+        } else if (p[0] == 'l') {
+            p += 1;
+            *size = REDIS_FMT_SIZE_LONG;
+        }
+        if (*p == '\0' || strchr(intfmts,*p) == NULL)
+            return REDIS_ERR;
 
-/* Calculate the number of bytes needed to represent an integer as string. */
-static int intlen(int i) {
-    int len = 0;
-    if (i < 0) {
-        len++;
-        i = -i;
+        /* Decimal conversions without flags are encoded without printf. */
+        if (plain && (*p == 'd' || *p == 'i'))
+            *type = REDIS_FMT_INT;
+        else if (plain && *p == 'u')
+            *type = REDIS_FMT_UINT;
     }
-    do {
-        len++;
-        i /= 10;
-    } while(i);
-    return len;
+    if ((p+1)-c >= 14) /* Same limit as redisvFormatCommand */
+        return REDIS_ERR;
+    *end = p;
+    return REDIS_OK;
 }
 
-/* Helper that calculates the bulk length given a certain string length. */
-static size_t bulklen(size_t len) {
-    return 1+intlen(len)+2+len+2;
+void redisFreeFormat(redisFormat *fmt) {
+    if (fmt == NULL)
+        return;
+    free(fmt->ops);
+    sdsfree(fmt->lits);
+    free(fmt);
 }
 
-int redisvFormatCommand(char **target, const char *format, va_list ap) {
-    const char *c = format;
-    char *cmd = NULL; /* final command */
-    int pos; /* position in final command */
-    sds curarg, newarg; /* current argument */
-    int touched = 0; /* was the current argument touched? */
-    char **curargv = NULL, **newargv = NULL;
-    int argc = 0;
-    int totlen = 0;
-    int j;
-
-    /* Abort if there is not target to set */
-    if (target == NULL)
-        return -1;
-
-    /* Build the command string accordingly to protocol */
-    curarg = sdsempty();
-    if (curarg == NULL)
-        return -1;
+/* Compile a format accepted by redisvFormatCommand, so commands can be
+ * formatted with it without parsing it again. Returns NULL when the format
+ * is invalid or on OOM. */
+redisFormat *redisPrepareFormat(const char *format) {
+    const char *c = format, *end;
+    redisFormat *fmt;
+    int first = 0, touched = 0, type, size;
+    size_t off;
+
+    fmt = calloc(1,sizeof(*fmt));
+    if (fmt == NULL)
+        return NULL;
+    if ((fmt->lits = sdsempty()) == NULL)
+        goto err;
 
-    while(*c != '\0') {
+    while (*c != '\0') {
         if (*c != '%' || c[1] == '\0') {
             if (*c == ' ') {
                 if (touched) {
-                    newargv = realloc(curargv,sizeof(char*)*(argc+1));
-                    if (newargv == NULL) goto err;
-                    curargv = newargv;
-                    curargv[argc++] = curarg;
-                    totlen += bulklen(sdslen(curarg));
-
-                    /* curarg is put in argv so it can be overwritten. */
-                    curarg = sdsempty();
-                    if (curarg == NULL) goto err;
+                    if (endFormatArgument(fmt,first) != REDIS_OK) goto err;
+                    first = fmt->nops;
                     touched = 0;
                 }
             } else {
-                newarg = sdscatlen(curarg,c,1);
-                if (newarg == NULL) goto err;
-                curarg = newarg;
+                /* Add the run of plain characters at once. */
+                size_t run = strcspn(c+1," %")+1;
+                if (addFormatLiteral(fmt,first,c,run) != REDIS_OK) goto err;
                 touched = 1;
+                c += run-1;
             }
         } else {
-            char *arg;
-            size_t size;
-
-            /* Set newarg so it can be checked even if it is not touched. */
-            newarg = curarg;
-
             switch(c[1]) {
             case 's':
-                arg = va_arg(ap,char*);
-                size = strlen(arg);
-                if (size > 0)
-                    newarg = sdscatlen(curarg,arg,size);
+                if (addFormatOp(fmt,REDIS_FMT_STRING,0,0,0) != REDIS_OK) goto err;
                 break;
             case 'b':
-                arg = va_arg(ap,char*);
-                size = va_arg(ap,size_t);
-                if (size > 0)
-                    newarg = sdscatlen(curarg,arg,size);
+                if (addFormatOp(fmt,REDIS_FMT_BINARY,0,0,0) != REDIS_OK) goto err;
                 break;
             case '%':
-                newarg = sdscat(curarg,"%");
+                if (addFormatLiteral(fmt,first,"%",1) != REDIS_OK) goto err;
                 break;
             default:
-                /* Try to detect printf format */
-                {
-                    static const char intfmts[] = "diouxX";
-                    char _format[16];
-                    const char *_p = c+1;
-                    size_t _l = 0;
-                    va_list _cpy;
-
-                    /* Flags */
-                    if (*_p != '\0' && *_p == '#') _p++;
-                    if (*_p != '\0' && *_p == '0') _p++;
-                    if (*_p != '\0' && *_p == '-') _p++;
-                    if (*_p != '\0' && *_p == ' ') _p++;
-                    if (*_p != '\0' && *_p == '+') _p++;
-
-                    /* Field width */
-                    while (*_p != '\0' && isdigit(*_p)) _p++;
-
-                    /* Precision */
-                    if (*_p == '.') {
-                        _p++;
-                        while (*_p != '\0' && isdigit(*_p)) _p++;
-                    }
-
-                    /* Copy va_list before consuming with va_arg */
-                    va_copy(_cpy,ap);
-
-                    /* Integer conversion (without modifiers) */
-                    if (strchr(intfmts,*_p) != NULL) {
-                        va_arg(ap,int);
-                        goto fmt_valid;
-                    }
-
-                    /* Double conversion (without modifiers) */
-                    if (strchr("eEfFgGaA",*_p) != NULL) {
-                        va_arg(ap,double);
-                        goto fmt_valid;
-                    }
-
-                    /* Size: char */
-                    if (_p[0] == 'h' && _p[1] == 'h') {
-                        _p += 2;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,int); /* char gets promoted to int */
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: short */
-                    if (_p[0] == 'h') {
-                        _p += 1;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,int); /* short gets promoted to int */
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: long long */
-                    if (_p[0] == 'l' && _p[1] == 'l') {
-                        _p += 2;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,long long);
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: long */
-                    if (_p[0] == 'l') {
-                        _p += 1;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,long);
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                fmt_invalid:
-                    va_end(_cpy);
-                    goto err;
-
-                fmt_valid:
-                    _l = (_p+1)-c;
-                    if (_l < sizeof(_format)-2) {
-                        memcpy(_format,c,_l);
-                        _format[_l] = '\0';
-                        newarg = sdscatvprintf(curarg,_format,_cpy);
-
-                        /* Update current position (note: outer blocks
-                         * increment c twice so compensate here) */
-                        c = _p-1;
-                    }
-
-                    va_end(_cpy);
-                    break;
+                if (parseConversion(c,&type,&size,&end) != REDIS_OK) goto err;
+                off = 0;
+                if (type == REDIS_FMT_PRINTF) {
+                    /* Keep the conversion with a nul byte for snprintf. */
+                    off = sdslen(fmt->lits);
+                    if ((fmt->lits = sdscatlen(fmt->lits,c,(end+1)-c)) == NULL ||
+                        (fmt->lits = sdscatlen(fmt->lits,"",1)) == NULL)
+                        goto err;
                 }
+                if (addFormatOp(fmt,type,size,off,0) != REDIS_OK) goto err;
+                /* Note: the loop increments c twice. */
+                c = end-1;
+                break;
             }
-
-            if (newarg == NULL) goto err;
-            curarg = newarg;
-
             touched = 1;
             c++;
         }
         c++;
     }
+    if (touched && endFormatArgument(fmt,first) != REDIS_OK)
+        goto err;
 
-    /* Add the last argument if needed */
-    if (touched) {
-        newargv = realloc(curargv,sizeof(char*)*(argc+1));
-        if (newargv == NULL) goto err;
-        curargv = newargv;
-        curargv[argc++] = curarg;
-        totlen += bulklen(sdslen(curarg));
-    } else {
-        sdsfree(curarg);
+    /* Bytes needed to hold the multi bulk count */
+    fmt->fixedlen += 1+countDigits(fmt->argc)+2;
+    return fmt;
+
+err:
+    redisFreeFormat(fmt);
+    return NULL;
+}
+
+/* Format a printf conversion of a prepared format. */
+static int printfConversion(char *dst, size_t size, const char *spec, int type,
+                            long long ll, double d)
+{
+    switch(type) {
+    case REDIS_FMT_SIZE_DOUBLE:
+        return snprintf(dst,size,spec,d);
+    case REDIS_FMT_SIZE_LONGLONG:
+        return snprintf(dst,size,spec,ll);
+    case REDIS_FMT_SIZE_LONG:
+        return snprintf(dst,size,spec,(long)ll);
+    default:
+        return snprintf(dst,size,spec,(int)ll);
+    }
+}
+
+/* Fetch the arguments for the conversions of a prepared format and return
+ * the length of the command, or -1 on OOM. */
+static long long resolveFormatSlots(const redisFormat *fmt, redisFormatSlot *slots, va_list ap) {
+    long long totlen = fmt->fixedlen, ll = 0;
+    const redisFormatOp *op;
+    redisFormatSlot *slot = slots;
+    size_t arglen;
+    double d = 0;
+    int j, k, n;
+
+    for (j = 0; j < fmt->nops; j++) {
+        if (fmt->ops[j].type != REDIS_FMT_ARG)
+            continue;
+
+        arglen = fmt->ops[j].len;
+        for (k = j+1; k <= j+fmt->ops[j].count; k++) {
+            op = &fmt->ops[k];
+            if (op->type == REDIS_FMT_LIT)
+                continue;
+
+            switch(op->type) {
+            case REDIS_FMT_STRING:
+                slot->p = va_arg(ap,char*);
+                slot->len = strlen(slot->p);
+                break;
+            case REDIS_FMT_BINARY:
+                slot->p = va_arg(ap,char*);
+                slot->len = va_arg(ap,size_t);
+                break;
+            case REDIS_FMT_INT:
+                if (op->size == REDIS_FMT_SIZE_INT) ll = va_arg(ap,int);
+                else if (op->size == REDIS_FMT_SIZE_LONG) ll = va_arg(ap,long);
+                else ll = va_arg(ap,long long);
+                slot->p = slot->buf;
+                slot->len = ll2str(slot->buf,ll);
+                break;
+            case REDIS_FMT_UINT:
+                slot->p = slot->buf;
+                if (op->size == REDIS_FMT_SIZE_INT)
+                    slot->len = ull2str(slot->buf,va_arg(ap,unsigned int));
+                else if (op->size == REDIS_FMT_SIZE_LONG)
+                    slot->len = ull2str(slot->buf,va_arg(ap,unsigned long));
+                else
+                    slot->len = ull2str(slot->buf,va_arg(ap,unsigned long long));
+                break;
+            case REDIS_FMT_PRINTF:
+                if (op->size == REDIS_FMT_SIZE_DOUBLE) d = va_arg(ap,double);
+                else if (op->size == REDIS_FMT_SIZE_LONGLONG) ll = va_arg(ap,long long);
+                else if (op->size == REDIS_FMT_SIZE_LONG) ll = va_arg(ap,long);
+                else ll = va_arg(ap,int);
+
+                n = printfConversion(slot->buf,sizeof(slot->buf),fmt->lits+op->off,
+                                     op->size,ll,d);
+                if (n < 0) n = 0;
+                slot->p = slot->buf;
+                if ((size_t)n >= sizeof(slot->buf)) {
+                    /* Too long for buf, format again in a buffer of the
+                     * right size. */
+                    if ((slot->alloc = malloc(n+1)) == NULL)
+                        return -1;
+                    printfConversion(slot->alloc,n+1,fmt->lits+op->off,op->size,ll,d);
+                    slot->p = slot->alloc;
+                }
+                slot->len = n;
+                break;
+            default:
+                assert(NULL);
+            }
+            arglen += slot->len;
+            totlen += slot->len;
+            slot++;
+        }
+        totlen += countDigits(arglen);
+        j += fmt->ops[j].count;
     }
+    return totlen;
+}
 
-    /* Clear curarg because it was put in curargv or was free'd. */
-    curarg = NULL;
+static void freeFormatSlots(const redisFormat *fmt, redisFormatSlot *slots) {
+    int j;
 
-    /* Add bytes needed to hold multi bulk count */
-    totlen += 1+intlen(argc)+2;
+    for (j = 0; j < fmt->nslots; j++)
+        free(slots[j].alloc);
+    if (fmt->nslots > REDIS_FORMAT_STACK_SLOTS)
+        free(slots);
+}
 
-    /* Build the command at protocol level */
-    cmd = malloc(totlen+1);
-    if (cmd == NULL) goto err;
+/* Write a command with a prepared format and resolved conversions to buf,
+ * which must have room for the length returned by resolveFormatSlots. */
+static size_t writePrepared(const redisFormat *fmt, const redisFormatSlot *slots, char *buf) {
+    const redisFormatOp *op;
+    const redisFormatSlot *slot;
+    char *p = buf;
+    size_t arglen;
+    int j, k;
+
+    *p++ = '*';
+    p += ull2str(p,fmt->argc);
+    *p++ = '\r';
+    *p++ = '\n';
+
+    for (j = 0; j < fmt->nops; j++) {
+        op = &fmt->ops[j];
+        if (op->type == REDIS_FMT_RAW) {
+            memcpy(p,fmt->lits+op->off,op->len);
+            p += op->len;
+            continue;
+        }
 
-    pos = sprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-        pos += sprintf(cmd+pos,"$%zu\r\n",sdslen(curargv[j]));
-        memcpy(cmd+pos,curargv[j],sdslen(curargv[j]));
-        pos += sdslen(curargv[j]);
-        sdsfree(curargv[j]);
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
+        assert(op->type == REDIS_FMT_ARG);
+        arglen = op->len;
+        for (k = j+1, slot = slots; k <= j+op->count; k++)
+            if (fmt->ops[k].type != REDIS_FMT_LIT)
+                arglen += (slot++)->len;
+
+        *p++ = '$';
+        p += ull2str(p,arglen);
+        *p++ = '\r';
+        *p++ = '\n';
+        for (k = j+1; k <= j+op->count; k++) {
+            if (fmt->ops[k].type == REDIS_FMT_LIT) {
+                memcpy(p,fmt->lits+fmt->ops[k].off,fmt->ops[k].len);
+                p += fmt->ops[k].len;
+            } else {
+                if (slots->len > 0)
+                    memcpy(p,slots->p,slots->len);
+                p += slots->len;
+                slots++;
+            }
+        }
+        *p++ = '\r';
+        *p++ = '\n';
+        j += op->count;
+    }
+    return p-buf;
+}
+
+/* Resolve the conversions of a prepared format into *slots, which is either
+ * "stack" or allocated when the format has more conversions than fit. */
+static long long prepareFormatSlots(const redisFormat *fmt, redisFormatSlot *stack,
+                                    redisFormatSlot **slots, va_list ap)
+{
+    long long len;
+    int j;
+
+    *slots = stack;
+    if (fmt->nslots > REDIS_FORMAT_STACK_SLOTS &&
+        (*slots = malloc(sizeof(**slots)*fmt->nslots)) == NULL)
+        return -1;
+    for (j = 0; j < fmt->nslots; j++)
+        (*slots)[j].alloc = NULL;
+    len = resolveFormatSlots(fmt,*slots,ap);
+    if (len == -1)
+        freeFormatSlots(fmt,*slots);
+    return len;
+}
+
+int redisvFormatPrepared(char **target, const redisFormat *fmt, va_list ap) {
+    redisFormatSlot stack[REDIS_FORMAT_STACK_SLOTS], *slots;
+    long long len;
+    size_t pos;
+    char *cmd;
+
+    if (target == NULL)
+        return -1;
+    if ((len = prepareFormatSlots(fmt,stack,&slots,ap)) == -1)
+        return -1;
+    if (len > INT_MAX || (cmd = malloc(len+1)) == NULL) {
+        freeFormatSlots(fmt,slots);
+        return -1;
     }
-    assert(pos == totlen);
-    cmd[pos] = '\0';
 
-    free(curargv);
+    pos = writePrepared(fmt,slots,cmd);
+    assert(pos == (size_t)len);
+    cmd[len] = '\0';
+    freeFormatSlots(fmt,slots);
     *target = cmd;
-    return totlen;
+    return len;
+}
 
-err:
-    while(argc--)
-        sdsfree(curargv[argc]);
-    free(curargv);
+int redisFormatPrepared(char **target, const redisFormat *fmt, ...) {
+    va_list ap;
+    int len;
+    va_start(ap,fmt);
+    len = redisvFormatPrepared(target,fmt,ap);
+    va_end(ap);
+    return len;
+}
 
-    if (curarg != NULL)
-        sdsfree(curarg);
+int redisvFormatCommand(char **target, const char *format, va_list ap) {
+    redisFormat *fmt;
+    int len;
 
-    /* No need to check cmd since it is the last statement that can fail,
-     * but do it anyway to be as defensive as possible. */
-    if (cmd != NULL)
-        free(cmd);
+    /* Abort if there is not target to set */
+    if (target == NULL)
+        return -1;
 
-    return -1;
+    if ((fmt = redisPrepareFormat(format)) == NULL)
+        return -1;
+    len = redisvFormatPrepared(target,fmt,ap);
+    redisFreeFormat(fmt);
+    return len;
 }
 
 /* Format a command according to the Redis protocol. This function
@@ -931,6 +2910,44 @@ int redisFormatCommand(char **target, const char *format, ...) {
     return len;
 }
 
+/* Length of the command formatted from argc/argv, see redisFormatCommandArgv. */
+static size_t argvCommandLength(int argc, const char **argv, const size_t *argvlen) {
+    size_t totlen, len;
+    int j;
+
+    totlen = 1+countDigits(argc)+2;
+    for (j = 0; j < argc; j++) {
+        len = argvlen ? argvlen[j] : strlen(argv[j]);
+        totlen += 1+countDigits(len)+2+len+2;
+    }
+    return totlen;
+}
+
+/* Write the command formatted from argc/argv to buf, which must have room for
+ * argvCommandLength bytes. */
+static size_t writeArgvCommand(char *buf, int argc, const char **argv, const size_t *argvlen) {
+    char *p = buf;
+    size_t len;
+    int j;
+
+    *p++ = '*';
+    p += ull2str(p,argc);
+    *p++ = '\r';
+    *p++ = '\n';
+    for (j = 0; j < argc; j++) {
+        len = argvlen ? argvlen[j] : strlen(argv[j]);
+        *p++ = '$';
+        p += ull2str(p,len);
+        *p++ = '\r';
+        *p++ = '\n';
+        memcpy(p,argv[j],len);
+        p += len;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    return p-buf;
+}
+
 /* Format a command according to the Redis protocol. This function takes the
  * number of arguments, an array with arguments and an array with their
  * lengths. If the latter is set to NULL, strlen will be used to compute the
@@ -938,31 +2955,20 @@ int redisFormatCommand(char **target, const char *format, ...) {
  */
 int redisFormatCommandArgv(char **target, int argc, const char **argv, const size_t *argvlen) {
     char *cmd = NULL; /* final command */
-    int pos; /* position in final command */
-    size_t len;
-    int totlen, j;
+    size_t pos; /* position in final command */
+    size_t totlen;
 
     /* Calculate number of bytes needed for the command */
-    totlen = 1+intlen(argc)+2;
-    for (j = 0; j < argc; j++) {
-        len = argvlen ? argvlen[j] : strlen(argv[j]);
-        totlen += bulklen(len);
-    }
+    totlen = argvCommandLength(argc,argv,argvlen);
+    if (totlen > INT_MAX)
+        return -1;
 
     /* Build the command at protocol level */
     cmd = malloc(totlen+1);
     if (cmd == NULL)
         return -1;
 
-    pos = sprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-        len = argvlen ? argvlen[j] : strlen(argv[j]);
-        pos += sprintf(cmd+pos,"$%zu\r\n",len);
-        memcpy(cmd+pos,argv[j],len);
-        pos += len;
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
-    }
+    pos = writeArgvCommand(cmd,argc,argv,argvlen);
     assert(pos == totlen);
     cmd[pos] = '\0';
 
@@ -986,6 +2992,204 @@ void __redisSetError(redisContext *c, int type, const char *str) {
     }
 }
 
+/* Output that is queued before c->obuf, the block that commands are appended
+ * to. A block either owns an sds, or references a buffer or a file of the
+ * caller (see redisAppendCommandArgs). Blocks are trimmed from the head as
+ * they are written, so a partial write never moves the output that is left. */
+typedef struct redisOutputBlock {
+    const char *buf; /* Advances as the block is written, NULL for a file */
+    size_t len;
+    int fd;
+    off_t offset; /* Advances as the file is written */
+    sds data; /* Owned data, NULL for a buffer of the caller */
+    redisReleaseFn *release; /* Only set on the last buffer of a command */
+    void *privdata;
+    struct redisOutputBlock *next;
+} redisOutputBlock;
+
+/* Size of the blocks commands are appended to. A command that doesn't fit
+ * gets a block of its own size. */
+#define REDIS_OUTPUT_BLOCK (1024*16)
+
+/* Maximum number of free blocks that are kept for reuse. */
+#define REDIS_OUTPUT_POOL 8
+
+/* Maximum number of iovecs passed to a single writev. */
+#define REDIS_WRITEV_MAX 64
+
+/* Return a block with an empty sds that has room for at least len bytes. */
+static redisOutputBlock *getOutputBlock(redisContext *c, size_t len) {
+    redisOutputBlock *b;
+    sds data;
+
+    if (len <= REDIS_OUTPUT_BLOCK && c->opool != NULL) {
+        b = c->opool;
+        c->opool = b->next;
+        c->opoolsize--;
+        b->next = NULL;
+        return b;
+    }
+
+    if (len < REDIS_OUTPUT_BLOCK)
+        len = REDIS_OUTPUT_BLOCK;
+    if (len > INT_MAX || (b = calloc(1,sizeof(*b))) == NULL)
+        return NULL;
+    if ((data = sdsempty()) == NULL ||
+        (b->data = sdsMakeRoomForNonGreedy(data,len)) == NULL)
+    {
+        sdsfree(data);
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+/* Release a block that was written or dropped. Blocks of the regular size
+ * go back to the pool. */
+static void putOutputBlock(redisContext *c, redisOutputBlock *b) {
+    if (b->release != NULL)
+        b->release(b->privdata);
+    if (b->data != NULL && c->opoolsize < REDIS_OUTPUT_POOL &&
+        sdslen(b->data)+sdsavail(b->data) == REDIS_OUTPUT_BLOCK)
+    {
+        sdsIncrLen(b->data,-(int)sdslen(b->data));
+        b->buf = NULL;
+        b->len = 0;
+        b->release = NULL;
+        b->next = c->opool;
+        c->opool = b;
+        c->opoolsize++;
+        return;
+    }
+    sdsfree(b->data);
+    free(b);
+}
+
+static void queueOutputBlock(redisContext *c, redisOutputBlock *b) {
+    b->next = NULL;
+    if (c->oqueuetail == NULL)
+        c->oqueue = b;
+    else
+        c->oqueuetail->next = b;
+    c->oqueuetail = b;
+    c->oqueuelen += b->len;
+}
+
+/* Queue c->obuf and continue in the data of block b. */
+static void sealOutputBuffer(redisContext *c, redisOutputBlock *b) {
+    sds data = b->data;
+
+    b->data = c->obuf;
+    b->buf = c->obuf;
+    b->len = sdslen(c->obuf);
+    c->obuf = data;
+    queueOutputBlock(c,b);
+}
+
+/* Make room for len bytes at the end of c->obuf. When they don't fit, the
+ * current block is queued and a new one is started, instead of growing the
+ * output buffer by doubling it. */
+static int reserveOutput(redisContext *c, size_t len) {
+    redisOutputBlock *b;
+    sds data;
+
+    if (sdsavail(c->obuf) >= len)
+        return REDIS_OK;
+
+    if (sdslen(c->obuf) == 0) {
+        if (len < REDIS_OUTPUT_BLOCK)
+            len = REDIS_OUTPUT_BLOCK;
+        if (len > INT_MAX || (data = sdsMakeRoomForNonGreedy(c->obuf,len)) == NULL)
+            return REDIS_ERR;
+        c->obuf = data;
+    } else {
+        if ((b = getOutputBlock(c,len)) == NULL)
+            return REDIS_ERR;
+        sealOutputBuffer(c,b);
+    }
+    return REDIS_OK;
+}
+
+/* Commands larger than this are written to a buffer of their own instead of
+ * an sds, which can't hold more than 2GB. */
+#define REDIS_OUTPUT_LARGE (1024*1024)
+
+/* Return where a command of len bytes is written. It goes to the end of
+ * c->obuf and is added with commitCommand once written, unless it is larger
+ * than REDIS_OUTPUT_LARGE. Then it gets a malloc'ed block that is queued
+ * right away, which is fine because nothing is written before the command
+ * is complete. */
+static char *reserveCommand(redisContext *c, size_t len) {
+    redisOutputBlock *b, *seal = NULL;
+    char *buf;
+
+    if (len <= REDIS_OUTPUT_LARGE) {
+        if (reserveOutput(c,len) != REDIS_OK)
+            return NULL;
+        return c->obuf+sdslen(c->obuf);
+    }
+
+    /* Like the output buffer, the block is NULL terminated: async.c walks
+     * the arguments of the command with string functions. */
+    if ((buf = malloc(len+1)) == NULL)
+        return NULL;
+    buf[len] = '\0';
+    if ((b = calloc(1,sizeof(*b))) == NULL ||
+        (sdslen(c->obuf) > 0 && (seal = getOutputBlock(c,0)) == NULL))
+    {
+        free(b);
+        free(buf);
+        return NULL;
+    }
+    if (seal != NULL)
+        sealOutputBuffer(c,seal);
+    b->buf = buf;
+    b->len = len;
+    b->release = free;
+    b->privdata = buf;
+    queueOutputBlock(c,b);
+    return buf;
+}
+
+static void commitCommand(redisContext *c, size_t len) {
+    if (len <= REDIS_OUTPUT_LARGE)
+        sdsIncrLen(c->obuf,len);
+}
+
+/* Return the start of the last command of len bytes that was appended to
+ * the output, for async.c. */
+char *__redisLastCommand(redisContext *c, size_t len) {
+    if (len <= REDIS_OUTPUT_LARGE)
+        return c->obuf+sdslen(c->obuf)-len;
+    return (char*)c->oqueuetail->buf;
+}
+
+/* Remove the last command of len bytes again. */
+void __redisDropLastCommand(redisContext *c, size_t len) {
+    redisOutputBlock *b = c->oqueuetail, *prev = NULL;
+
+    if (len <= REDIS_OUTPUT_LARGE) {
+        sdsIncrLen(c->obuf,-(int)len);
+        return;
+    }
+
+    if (c->oqueue != b) {
+        prev = c->oqueue;
+        while (prev->next != b)
+            prev = prev->next;
+        prev->next = NULL;
+    } else {
+        c->oqueue = NULL;
+    }
+    c->oqueuetail = prev;
+    c->oqueuelen -= b->len;
+    putOutputBlock(c,b);
+}
+
+size_t redisPendingBytes(redisContext *c) {
+    return c->oqueuelen+sdslen(c->obuf);
+}
+
 static redisContext *redisContextInit(void) {
     redisContext *c;
 
@@ -1001,8 +3205,19 @@ static redisContext *redisContextInit(void) {
 }
 
 void redisFree(redisContext *c) {
+    redisOutputBlock *b;
+
     if (c->fd > 0)
         close(c->fd);
+    while ((b = c->oqueue) != NULL) {
+        c->oqueue = b->next;
+        putOutputBlock(c,b);
+    }
+    while ((b = c->opool) != NULL) {
+        c->opool = b->next;
+        sdsfree(b->data);
+        free(b);
+    }
     if (c->obuf != NULL)
         sdsfree(c->obuf);
     if (c->reader != NULL)
@@ -1099,20 +3314,46 @@ int redisEnableKeepAlive(redisContext *c) {
     return REDIS_OK;
 }
 
+/* Allocate every reply tree on this connection from a single arena, see
+ * redisReaderEnableReplyArena. */
+int redisEnableReplyArena(redisContext *c) {
+    return redisReaderEnableReplyArena(c->reader);
+}
+
+/* Let string replies on this connection point into the reader buffer, see
+ * redisReaderEnableBorrowedStrings. */
+int redisEnableBorrowedStrings(redisContext *c) {
+    return redisReaderEnableBorrowedStrings(c->reader);
+}
+
+/* Decode the elements of array replies on this connection when accessed, see
+ * redisReaderEnableLazyArrays. Not supported by the async API. */
+int redisEnableLazyArrays(redisContext *c) {
+    return redisReaderEnableLazyArrays(c->reader);
+}
+
 /* Use this function to handle a read event on the descriptor. It will try
  * and read some bytes from the socket and feed them to the reply parser.
  *
  * After this function is called, you may use redisContextReadReply to
  * see if there is a reply available. */
 int redisBufferRead(redisContext *c) {
-    char buf[1024*16];
-    int nread;
+    char *buf;
+    size_t len;
+    ssize_t nread;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
 
-    nread = read(c->fd,buf,sizeof(buf));
+    /* Read straight into the reader buffer. */
+    buf = redisReaderReserve(c->reader,&len);
+    if (buf == NULL) {
+        __redisSetError(c,c->reader->err,c->reader->errstr);
+        return REDIS_ERR;
+    }
+
+    nread = read(c->fd,buf,len);
     if (nread == -1) {
         if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
             /* Try again later */
@@ -1124,7 +3365,7 @@ int redisBufferRead(redisContext *c) {
         __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
         return REDIS_ERR;
     } else {
-        if (redisReaderFeed(c->reader,buf,nread) != REDIS_OK) {
+        if (redisReaderCommit(c->reader,nread) != REDIS_OK) {
             __redisSetError(c,c->reader->err,c->reader->errstr);
             return REDIS_ERR;
         }
@@ -1132,6 +3373,118 @@ int redisBufferRead(redisContext *c) {
     return REDIS_OK;
 }
 
+static void dropOutputBlock(redisContext *c) {
+    redisOutputBlock *b = c->oqueue;
+
+    c->oqueuelen -= b->len;
+    c->oqueue = b->next;
+    if (c->oqueue == NULL)
+        c->oqueuetail = NULL;
+    putOutputBlock(c,b);
+}
+
+/* Write (a part of) the block at the head of the queue, that is read from a
+ * file. It is sent with sendfile when possible, and read into a buffer
+ * otherwise. */
+static ssize_t writeFileBlock(redisContext *c, redisOutputBlock *b) {
+    char buf[REDIS_OUTPUT_BLOCK];
+    ssize_t nwritten = -1, nread;
+    size_t len = b->len;
+    off_t offset = b->offset;
+
+#ifdef HIREDIS_SENDFILE
+    nwritten = sendfile(c->fd,b->fd,&offset,len);
+    if (nwritten == -1 && errno != EINVAL && errno != ENOSYS)
+        return -1;
+#endif
+    if (nwritten == -1) {
+        if (len > sizeof(buf))
+            len = sizeof(buf);
+        if ((nread = pread(b->fd,buf,len,b->offset)) <= 0) {
+            if (nread == 0)
+                errno = EIO;
+            return -1;
+        }
+        nwritten = write(c->fd,buf,nread);
+    }
+    if (nwritten == 0) {
+        /* The file is shorter than the length of the argument. */
+        errno = EIO;
+        return -1;
+    }
+
+    if (nwritten > 0) {
+        b->offset += nwritten;
+        b->len -= nwritten;
+        c->oqueuelen -= nwritten;
+        if (b->len == 0)
+            dropOutputBlock(c);
+    }
+    return nwritten;
+}
+
+/* Write the queued blocks and the output buffer with a single writev, up to
+ * the first block that is read from a file. */
+static ssize_t writeOutput(redisContext *c) {
+    struct iovec iov[REDIS_WRITEV_MAX];
+    redisOutputBlock *b;
+    ssize_t nwritten;
+    size_t left;
+    int n = 0;
+
+    if (c->oqueue != NULL && c->oqueue->buf == NULL)
+        return writeFileBlock(c,c->oqueue);
+
+    for (b = c->oqueue; b != NULL && b->buf != NULL && n < REDIS_WRITEV_MAX; b = b->next) {
+        iov[n].iov_base = (void*)b->buf;
+        iov[n++].iov_len = b->len;
+    }
+    if (b == NULL && n < REDIS_WRITEV_MAX && sdslen(c->obuf) > 0) {
+        iov[n].iov_base = c->obuf;
+        iov[n++].iov_len = sdslen(c->obuf);
+    }
+
+    if (n == 1)
+        nwritten = write(c->fd,iov[0].iov_base,iov[0].iov_len);
+    else
+        nwritten = writev(c->fd,iov,n);
+    if (nwritten <= 0)
+        return nwritten;
+
+    /* Drop the blocks that were written, and trim the first one that
+     * wasn't written completely. */
+    left = nwritten;
+    while ((b = c->oqueue) != NULL && b->buf != NULL && left >= b->len) {
+        left -= b->len;
+        dropOutputBlock(c);
+    }
+    if (left == 0)
+        return nwritten;
+
+    if (b != NULL) {
+        b->buf += left;
+        b->len -= left;
+        c->oqueuelen -= left;
+    } else if (left == sdslen(c->obuf)) {
+        if (sdslen(c->obuf)+sdsavail(c->obuf) > REDIS_OUTPUT_BLOCK) {
+            /* Don't hold on to the memory of a large command. */
+            sdsfree(c->obuf);
+            c->obuf = sdsempty();
+        } else {
+            sdsIncrLen(c->obuf,-(int)left);
+        }
+    } else if ((b = getOutputBlock(c,0)) != NULL) {
+        /* Queue the rest of the output buffer instead of moving it. */
+        sealOutputBuffer(c,b);
+        b->buf += left;
+        b->len -= left;
+        c->oqueuelen -= left;
+    } else {
+        c->obuf = sdsrange(c->obuf,left,-1);
+    }
+    return nwritten;
+}
+
 /* Write the output buffer to the socket.
  *
  * Returns REDIS_OK when the buffer is empty, or (a part of) the buffer was
@@ -1142,31 +3495,21 @@ int redisBufferRead(redisContext *c) {
  * c->errstr to hold the appropriate error string.
  */
 int redisBufferWrite(redisContext *c, int *done) {
-    int nwritten;
-
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
 
-    if (sdslen(c->obuf) > 0) {
-        nwritten = write(c->fd,c->obuf,sdslen(c->obuf));
-        if (nwritten == -1) {
+    if (redisPendingBytes(c) > 0) {
+        if (writeOutput(c) == -1) {
             if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
                 /* Try again later */
             } else {
                 __redisSetError(c,REDIS_ERR_IO,NULL);
                 return REDIS_ERR;
             }
-        } else if (nwritten > 0) {
-            if (nwritten == (signed)sdslen(c->obuf)) {
-                sdsfree(c->obuf);
-                c->obuf = sdsempty();
-            } else {
-                c->obuf = sdsrange(c->obuf,nwritten,-1);
-            }
         }
     }
-    if (done != NULL) *done = (sdslen(c->obuf) == 0);
+    if (done != NULL) *done = (redisPendingBytes(c) == 0);
     return REDIS_OK;
 }
 
@@ -1180,6 +3523,36 @@ int redisGetReplyFromReader(redisContext *c, void **reply) {
     return REDIS_OK;
 }
 
+int redisGetReplies(redisContext *c, void **replies, size_t max, size_t *n) {
+    int wdone = 0;
+
+    /* Try to read pending replies */
+    if (redisReaderGetReplies(c->reader,replies,max,n) == REDIS_ERR) {
+        __redisSetError(c,c->reader->err,c->reader->errstr);
+        return REDIS_ERR;
+    }
+
+    /* For the blocking context, flush output buffer and read replies */
+    if (*n == 0 && max > 0 && c->flags & REDIS_BLOCK) {
+        /* Write until done */
+        do {
+            if (redisBufferWrite(c,&wdone) == REDIS_ERR)
+                return REDIS_ERR;
+        } while (!wdone);
+
+        /* Read until there is at least one reply */
+        do {
+            if (redisBufferRead(c) == REDIS_ERR)
+                return REDIS_ERR;
+            if (redisReaderGetReplies(c->reader,replies,max,n) == REDIS_ERR) {
+                __redisSetError(c,c->reader->err,c->reader->errstr);
+                return REDIS_ERR;
+            }
+        } while (*n == 0);
+    }
+    return REDIS_OK;
+}
+
 int redisGetReply(redisContext *c, void **reply) {
     int wdone = 0;
     void *aux = NULL;
@@ -1210,6 +3583,183 @@ int redisGetReply(redisContext *c, void **reply) {
     return REDIS_OK;
 }
 
+/* Write len bytes to fd, retrying on partial writes. */
+static int writeAll(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd,buf,len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return REDIS_ERR;
+        }
+        buf += n;
+        len -= n;
+    }
+    return REDIS_OK;
+}
+
+#ifdef HIREDIS_SPLICE
+/* Move up to len bytes of the socket to fd through a pipe, without copying
+ * them to user space. Returns the number of bytes moved, 0 when splice can't
+ * be used with these file descriptors, or -1 on errors. */
+static ssize_t spliceToFd(redisContext *c, int fd, int *pipefd, size_t len) {
+    char buf[4096];
+    ssize_t n, m, left;
+
+    if (pipefd[0] == -1 && pipe(pipefd) == -1)
+        return 0;
+
+    do {
+        n = redisSplice(c->fd,pipefd[1],len);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        if (errno == EINVAL || errno == ENOSYS)
+            return 0;
+        __redisSetError(c,REDIS_ERR_IO,NULL);
+        return -1;
+    } else if (n == 0) {
+        __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
+        return -1;
+    }
+
+    /* Drain the pipe, with read and write when fd doesn't support splice. */
+    for (left = n; left > 0; left -= m) {
+        m = redisSplice(pipefd[0],fd,left);
+        if (m == -1 && errno == EINVAL) {
+            m = read(pipefd[0],buf,(size_t)left < sizeof(buf) ? (size_t)left : sizeof(buf));
+            if (m > 0 && writeAll(fd,buf,m) != REDIS_OK)
+                m = -1;
+        }
+        if (m == -1) {
+            if (errno == EINTR) {
+                m = 0;
+                continue;
+            }
+            __redisSetError(c,REDIS_ERR_IO,NULL);
+            return -1;
+        }
+    }
+    return n;
+}
+#endif
+
+/* Write the rest of the bulk payload the reader is streaming to fd: first
+ * what is buffered, then straight from the socket when possible. */
+static int sinkBulk(redisContext *c, int fd) {
+    redisReader *r = c->reader;
+    redisReaderEvent ev;
+    int ret = REDIS_OK;
+#ifdef HIREDIS_SPLICE
+    int pipefd[2] = {-1,-1}, usesplice = 1;
+    ssize_t n;
+#endif
+
+    while (r->bulkleft > 0) {
+        if (r->pos < r->len) {
+            ev.type = REDIS_EVENT_NONE;
+            readBulkChunk(r,&ev);
+            if (ev.type == REDIS_EVENT_STRING_CHUNK &&
+                writeAll(fd,ev.str,ev.len) != REDIS_OK)
+            {
+                __redisSetError(c,REDIS_ERR_IO,NULL);
+                ret = REDIS_ERR;
+                break;
+            }
+            continue;
+        }
+
+#ifdef HIREDIS_SPLICE
+        if (usesplice && r->bulkleft > 2) {
+            if ((n = spliceToFd(c,fd,pipefd,r->bulkleft-2)) == -1) {
+                ret = REDIS_ERR;
+                break;
+            }
+            r->bulkleft -= n;
+            usesplice = (n > 0);
+            if (n > 0)
+                continue;
+        }
+#endif
+        if (redisBufferRead(c) != REDIS_OK) {
+            ret = REDIS_ERR;
+            break;
+        }
+    }
+
+#ifdef HIREDIS_SPLICE
+    if (pipefd[0] != -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+#endif
+    return ret;
+}
+
+int redisGetReplyToFd(redisContext *c, int fd, void **reply) {
+    redisReader *r = c->reader;
+    redisReaderEvent ev;
+    int wdone = 0;
+
+    if (!(c->flags & REDIS_BLOCK)) {
+        __redisSetError(c,REDIS_ERR_OTHER,
+            "redisGetReplyToFd needs a blocking context");
+        return REDIS_ERR;
+    }
+
+    /* Write until done */
+    do {
+        if (redisBufferWrite(c,&wdone) == REDIS_ERR)
+            return REDIS_ERR;
+    } while (!wdone);
+
+    /* Only a reply that starts with a bulk string is written to fd. */
+    while (r->ridx == -1 && r->lazy == NULL && r->pos == r->len) {
+        if (redisBufferRead(c) == REDIS_ERR)
+            return REDIS_ERR;
+    }
+    if (r->ridx != -1 || r->lazy != NULL || r->bulkleft > 0 ||
+        r->buf[r->pos] != '$')
+        return redisGetReply(c,reply);
+
+    /* Read until the length of the bulk is known */
+    for (;;) {
+        if (readEvent(r,&ev,REDIS_READ_STREAM) != REDIS_OK) {
+            __redisSetError(c,r->err,r->errstr);
+            return REDIS_ERR;
+        }
+        if (ev.type != REDIS_EVENT_NONE)
+            break;
+        if (redisBufferRead(c) == REDIS_ERR)
+            return REDIS_ERR;
+    }
+
+    if (ev.type == REDIS_EVENT_STRING) {
+        if (writeAll(fd,ev.str,ev.len) != REDIS_OK) {
+            __redisSetError(c,REDIS_ERR_IO,NULL);
+            return REDIS_ERR;
+        }
+        ev.integer = ev.len;
+    } else if (ev.type == REDIS_EVENT_STRING_BEGIN) {
+        if (sinkBulk(c,fd) != REDIS_OK)
+            return REDIS_ERR;
+    }
+
+    /* The reply is the number of bytes that were written. */
+    if (ev.type != REDIS_EVENT_NIL)
+        ev.type = REDIS_EVENT_INTEGER;
+    if (buildReply(r,&ev) != REDIS_OK) {
+        __redisSetError(c,r->err,r->errstr);
+        return REDIS_ERR;
+    }
+    if (reply != NULL)
+        *reply = r->reply;
+    else if (r->fn && r->fn->freeObject)
+        r->fn->freeObject(r->reply);
+    r->reply = NULL;
+    return REDIS_OK;
+}
+
 
 /* Helper function for the redisAppendCommand* family of functions.
  *
@@ -1218,64 +3768,225 @@ int redisGetReply(redisContext *c, void **reply) {
  * the reply (or replies in pub/sub).
  */
 int __redisAppendCommand(redisContext *c, char *cmd, size_t len) {
-    sds newbuf;
+    char *p;
 
-    newbuf = sdscatlen(c->obuf,cmd,len);
-    if (newbuf == NULL) {
+    if ((p = reserveCommand(c,len)) == NULL) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
 
-    c->obuf = newbuf;
+    memcpy(p,cmd,len);
+    commitCommand(c,len);
     return REDIS_OK;
 }
 
+/* The format is only parsed to find out where the arguments go: the command
+ * is written straight to the output buffer. */
 int redisvAppendCommand(redisContext *c, const char *format, va_list ap) {
-    char *cmd;
-    int len;
+    redisFormat *fmt;
+    int ret;
 
-    len = redisvFormatCommand(&cmd,format,ap);
-    if (len == -1) {
+    if ((fmt = redisPrepareFormat(format)) == NULL) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
 
-    if (__redisAppendCommand(c,cmd,len) != REDIS_OK) {
-        free(cmd);
+    ret = redisvAppendPrepared(c,fmt,ap);
+    redisFreeFormat(fmt);
+    return ret;
+}
+
+int redisAppendCommand(redisContext *c, const char *format, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap,format);
+    ret = redisvAppendCommand(c,format,ap);
+    va_end(ap);
+    return ret;
+}
+
+/* Append a command formatted with a prepared format. It is written straight
+ * to the output buffer. */
+int redisvAppendPrepared(redisContext *c, const redisFormat *fmt, va_list ap) {
+    redisFormatSlot stack[REDIS_FORMAT_STACK_SLOTS], *slots;
+    long long len;
+    size_t pos;
+    char *p;
+
+    if ((len = prepareFormatSlots(fmt,stack,&slots,ap)) == -1) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    if ((p = reserveCommand(c,len)) == NULL) {
+        freeFormatSlots(fmt,slots);
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
 
-    free(cmd);
+    pos = writePrepared(fmt,slots,p);
+    assert(pos == (size_t)len);
+    commitCommand(c,len);
+    freeFormatSlots(fmt,slots);
     return REDIS_OK;
 }
 
-int redisAppendCommand(redisContext *c, const char *format, ...) {
+int redisAppendPrepared(redisContext *c, const redisFormat *fmt, ...) {
     va_list ap;
     int ret;
 
-    va_start(ap,format);
-    ret = redisvAppendCommand(c,format,ap);
+    va_start(ap,fmt);
+    ret = redisvAppendPrepared(c,fmt,ap);
     va_end(ap);
     return ret;
 }
 
 int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen) {
-    char *cmd;
-    int len;
+    size_t len, pos;
+    char *p;
 
-    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    if (len == -1) {
+    len = argvCommandLength(argc,argv,argvlen);
+    if ((p = reserveCommand(c,len)) == NULL) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
 
-    if (__redisAppendCommand(c,cmd,len) != REDIS_OK) {
-        free(cmd);
-        return REDIS_ERR;
+    pos = writeArgvCommand(p,argc,argv,argvlen);
+    assert(pos == len);
+    commitCommand(c,len);
+    return REDIS_OK;
+}
+
+/* Arguments that are written from the caller's buffer or file, instead of
+ * being copied to the output buffer. */
+static int isReferencedArg(const redisArg *arg) {
+    return arg->len >= REDIS_IOV_COPY_MAX || (arg->buf == NULL && arg->len > 0);
+}
+
+int redisAppendCommandArgs(redisContext *c, int argc, const redisArg *argv,
+                           redisReleaseFn *release, void *privdata)
+{
+    redisOutputBlock *blocks = NULL, *last = NULL, *ref, *b;
+    size_t len, seglen, first = 0;
+    char *p;
+    int j;
+
+    /* The arguments that aren't copied split the command in segments that
+     * are copied. The first one goes to the output buffer, and every other
+     * segment gets a block of its own. Everything is allocated up front, so
+     * a command is never added partially. */
+    seglen = 1+countDigits(argc)+2;
+    for (j = 0; j <= argc; j++) {
+        len = (j < argc) ? argv[j].len : 0;
+        if (j < argc && !isReferencedArg(&argv[j])) {
+            seglen += 1+countDigits(len)+2+len+2;
+            continue;
+        }
+        if (j < argc)
+            seglen += 1+countDigits(len)+2;
+
+        /* Segment ends here */
+        if (last == NULL) {
+            first = seglen;
+        } else {
+            if ((b = getOutputBlock(c,seglen)) == NULL)
+                goto oom;
+            last->next = b;
+            last = b;
+        }
+        if (j == argc)
+            break;
+
+        if ((ref = calloc(1,sizeof(*ref))) == NULL)
+            goto oom;
+        ref->buf = argv[j].buf;
+        ref->len = len;
+        ref->fd = argv[j].fd;
+        ref->offset = argv[j].offset;
+        if (last == NULL)
+            blocks = ref;
+        else
+            last->next = ref;
+        last = ref;
+        seglen = 2;
+    }
+    if (reserveOutput(c,first) != REDIS_OK)
+        goto oom;
+
+    /* Write the segments, queueing the output buffer and a reference to
+     * the caller's buffer or file between them. */
+    p = c->obuf+sdslen(c->obuf);
+    *p++ = '*';
+    p += ull2str(p,argc);
+    *p++ = '\r';
+    *p++ = '\n';
+    for (j = 0; j < argc; j++) {
+        len = argv[j].len;
+        *p++ = '$';
+        p += ull2str(p,len);
+        *p++ = '\r';
+        *p++ = '\n';
+        if (!isReferencedArg(&argv[j])) {
+            if (len > 0)
+                memcpy(p,argv[j].buf,len);
+            p += len;
+        } else {
+            ref = blocks;
+            b = ref->next;
+            blocks = b->next;
+            sdsIncrLen(c->obuf,p-(c->obuf+sdslen(c->obuf)));
+            sealOutputBuffer(c,b);
+            if (blocks == NULL) {
+                ref->release = release;
+                ref->privdata = privdata;
+            }
+            queueOutputBlock(c,ref);
+            p = c->obuf+sdslen(c->obuf);
+        }
+        *p++ = '\r';
+        *p++ = '\n';
     }
+    sdsIncrLen(c->obuf,p-(c->obuf+sdslen(c->obuf)));
 
-    free(cmd);
+    if (last == NULL && release != NULL)
+        release(privdata);
     return REDIS_OK;
+
+oom:
+    while ((b = blocks) != NULL) {
+        blocks = b->next;
+        putOutputBlock(c,b);
+    }
+    __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+    return REDIS_ERR;
+}
+
+/* Number of arguments redisAppendCommandIov converts without allocating. */
+#define REDIS_IOV_STACK_ARGS 16
+
+int redisAppendCommandIov(redisContext *c, int argc, const struct iovec *argv,
+                          redisReleaseFn *release, void *privdata)
+{
+    redisArg stack[REDIS_IOV_STACK_ARGS] = {{0}}, *args = stack;
+    int j, ret;
+
+    if (argc > REDIS_IOV_STACK_ARGS &&
+        (args = malloc(argc*sizeof(*args))) == NULL)
+    {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    for (j = 0; j < argc; j++) {
+        args[j].buf = argv[j].iov_base;
+        args[j].len = argv[j].iov_len;
+        args[j].fd = -1;
+        args[j].offset = 0;
+    }
+
+    ret = redisAppendCommandArgs(c,argc,args,release,privdata);
+    if (args != stack)
+        free(args);
+    return ret;
 }
 
 /* Helper function for the redisCommand* family of functions.
@@ -33,7 +33,11 @@
 #define __HIREDIS_H
 #include <stdio.h> /* for size_t */
 #include <stdarg.h> /* for va_list */
+#include <stdint.h> /* for int64_t */
+#include <limits.h> /* for INT_MAX */
 #include <sys/time.h> /* for struct timeval */
+#include <sys/types.h> /* for off_t */
+#include <sys/uio.h> /* for struct iovec */
 
 #define HIREDIS_MAJOR 0
 #define HIREDIS_MINOR 11
@@ -50,6 +54,7 @@
 #define REDIS_ERR_EOF 3 /* End of file */
 #define REDIS_ERR_PROTOCOL 4 /* Protocol error */
 #define REDIS_ERR_OOM 5 /* Out of memory */
+#define REDIS_ERR_TIMEOUT 6 /* Command timed out */
 #define REDIS_ERR_OTHER 2 /* Everything else... */
 
 /* Connection type can be blocking or non-blocking and is set in the
@@ -79,6 +84,10 @@
 /* Flag that is set when monitor mode is active */
 #define REDIS_MONITORING 0x40
 
+/* Flag that is set when the async context received a push reply (RESP3),
+ * so replies to commands sent while subscribed are regular replies. */
+#define REDIS_PUSH_REPLIES 0x80
+
 #define REDIS_REPLY_STRING 1
 #define REDIS_REPLY_ARRAY 2
 #define REDIS_REPLY_INTEGER 3
@@ -86,22 +95,76 @@
 #define REDIS_REPLY_STATUS 5
 #define REDIS_REPLY_ERROR 6
 
+/* Types that are only used by RESP3. Maps hold their keys and values in
+ * turns in "element", so "elements" is twice the number of pairs. */
+#define REDIS_REPLY_DOUBLE 7
+#define REDIS_REPLY_BOOL 8
+#define REDIS_REPLY_MAP 9
+#define REDIS_REPLY_SET 10
+#define REDIS_REPLY_ATTR 11
+#define REDIS_REPLY_PUSH 12
+#define REDIS_REPLY_BIGNUM 13
+#define REDIS_REPLY_VERB 14
+
+/* Tokens returned by redisReaderNextEvent. Values match REDIS_REPLY_*. */
+#define REDIS_EVENT_NONE 0 /* No complete token is buffered yet */
+#define REDIS_EVENT_STRING 1
+#define REDIS_EVENT_ARRAY 2 /* Start of an array, element count in integer */
+#define REDIS_EVENT_INTEGER 3
+#define REDIS_EVENT_NIL 4
+#define REDIS_EVENT_STATUS 5
+#define REDIS_EVENT_ERROR 6
+#define REDIS_EVENT_DOUBLE 7 /* Value in dval, text in str */
+#define REDIS_EVENT_BOOL 8 /* 0 or 1 in integer */
+#define REDIS_EVENT_MAP 9 /* Start of a map, keys plus values in integer */
+#define REDIS_EVENT_SET 10
+#define REDIS_EVENT_ATTR 11 /* Start of an attribute, counted like a map */
+#define REDIS_EVENT_PUSH 12
+#define REDIS_EVENT_BIGNUM 13
+#define REDIS_EVENT_VERB 14 /* Type and ':' in the first 4 bytes of str */
+#define REDIS_EVENT_ARRAY_END 15 /* End of the aggregate whose type is in integer */
+
+/* Pub/sub messages decoded by redisReaderGetMessage. */
+#define REDIS_MESSAGE_NONE 0 /* The next reply is not a complete message */
+#define REDIS_MESSAGE 1
+#define REDIS_MESSAGE_PATTERN 2 /* A pmessage, with the pattern it matched */
+
 #define REDIS_READER_MAX_BUF (1024*16)  /* Default max unused reader buffer. */
 
+/* Flags for the reader, set using the redisReaderEnable* functions. */
+#define REDIS_READER_BORROW 0x1 /* String replies point into the buffer */
+#define REDIS_READER_LAZY 0x2 /* Array elements are decoded on access */
+
 #define REDIS_KEEPALIVE_INTERVAL 15 /* seconds */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* The length of a reply string is an int, which limits string replies to
+ * 2GB. Define HIREDIS_WIDE_REPLY when building both hiredis and the
+ * application to make it a size_t. Longer bulks are a protocol error with
+ * the default reply objects, before any memory is allocated for them. */
+#ifdef HIREDIS_WIDE_REPLY
+typedef size_t redisReplyLen;
+#define REDIS_REPLY_LEN_MAX SIZE_MAX
+#else
+typedef int redisReplyLen;
+#define REDIS_REPLY_LEN_MAX INT_MAX
+#endif
+
 /* This is the reply object returned by redisCommand() */
 typedef struct redisReply {
     int type; /* REDIS_REPLY_* */
     long long integer; /* The integer when type is REDIS_REPLY_INTEGER */
-    int len; /* Length of string */
-    char *str; /* Used for both REDIS_REPLY_ERROR and REDIS_REPLY_STRING */
+    redisReplyLen len; /* Length of string */
+    char *str; /* Used for REDIS_REPLY_ERROR, REDIS_REPLY_STRING and the
+                  string representation of REDIS_REPLY_DOUBLE */
     size_t elements; /* number of elements, for REDIS_REPLY_ARRAY */
     struct redisReply **element; /* elements vector for REDIS_REPLY_ARRAY */
+    void *owner; /* Private: owner of the reply memory, NULL when malloc'ed */
+    double dval; /* The double when type is REDIS_REPLY_DOUBLE */
+    char vtype[4]; /* Type of a REDIS_REPLY_VERB, like "txt" */
 } redisReply;
 
 typedef struct redisReadTask {
@@ -119,17 +182,64 @@ typedef struct redisReplyObjectFunctions {
     void *(*createInteger)(const redisReadTask*, long long);
     void *(*createNil)(const redisReadTask*);
     void (*freeObject)(void*);
+
+    /* Optional streaming of bulk payloads. When set, a bulk that is not
+     * completely buffered yet is created using beginString with its length,
+     * its payload is passed to appendString in chunks as it arrives and
+     * endString (which may be NULL) is called when it is complete. */
+    void *(*beginString)(const redisReadTask*, size_t);
+    int (*appendString)(const redisReadTask*, void*, const char*, size_t);
+    int (*endString)(const redisReadTask*, void*);
+
+    /* RESP3 values. When not set, doubles are created using createString
+     * and booleans using createInteger. Maps, sets and pushes are created
+     * using createArray, with the type in the read task. */
+    void *(*createDouble)(const redisReadTask*, double, char*, size_t);
+    void *(*createBool)(const redisReadTask*, int);
 } redisReplyObjectFunctions;
 
+/* Token read by redisReaderNextEvent */
+typedef struct redisReaderEvent {
+    int type; /* REDIS_EVENT_* */
+    int depth; /* Number of open arrays the token is nested in */
+    char *str; /* String, status or error, points into the reader buffer */
+    size_t len; /* Length of str */
+    long long integer; /* Integer value, or number of array elements */
+    double dval; /* Double value */
+} redisReaderEvent;
+
+/* Pub/sub message read by redisReaderGetMessage. The strings point into the
+ * reader buffer and are not NULL terminated. */
+typedef struct redisMessage {
+    int type; /* REDIS_MESSAGE_* */
+    const char *pattern; /* Only set for REDIS_MESSAGE_PATTERN */
+    size_t patternlen;
+    const char *channel;
+    size_t channellen;
+    const char *payload;
+    size_t payloadlen;
+} redisMessage;
+
 /* State for the protocol parser */
 typedef struct redisReader {
     int err; /* Error flags, 0 when there is no error */
     char errstr[128]; /* String representation of error when applicable */
 
-    char *buf; /* Read buffer */
+    char *buf; /* Read buffer, points into the current segment */
     size_t pos; /* Buffer cursor */
     size_t len; /* Buffer length */
     size_t maxbuf; /* Max length of unused buffer */
+    size_t scanpos; /* Offset up to which the current line has no \r\n */
+    struct redisReaderSegment *segment; /* Segment holding buf */
+    int flags; /* REDIS_READER_* */
+    size_t bulkleft; /* Bytes left of a streamed bulk, including \r\n */
+    size_t bulkend; /* Buffer offset where a large bulk that is not buffered yet ends */
+    size_t readsize; /* Space to reserve for the next read */
+    int depth; /* Number of open arrays */
+    long long pending[8]; /* Elements left to read in each open array */
+    int ptype[8]; /* REDIS_EVENT_* type of each open array */
+    unsigned int attrs; /* Bit set for each open array that is an attribute */
+    struct redisLazyArray *lazy; /* Lazy array reply that is being read */
 
     redisReadTask rstack[9];
     int ridx; /* Index of current read task */
@@ -145,6 +255,53 @@ void redisReaderFree(redisReader *r);
 int redisReaderFeed(redisReader *r, const char *buf, size_t len);
 int redisReaderGetReply(redisReader *r, void **reply);
 
+/* Read up to max buffered replies into replies in one pass, setting *n to
+ * the number that was read. On errors, these *n replies are still returned
+ * to the caller. */
+int redisReaderGetReplies(redisReader *r, void **replies, size_t max, size_t *n);
+
+/* Set *count to the number of complete replies that are buffered, without
+ * consuming them. */
+int redisReaderCountReplies(redisReader *r, size_t *count);
+
+/* Pull the next token from the buffer without creating reply objects. The
+ * string in an event is valid until the reader is fed again. The type is
+ * REDIS_EVENT_NONE when more data is needed. Don't mix with
+ * redisReaderGetReply in the middle of a reply. */
+int redisReaderNextEvent(redisReader *r, redisReaderEvent *ev);
+
+/* Decode the next reply in place when it is a complete "message" or
+ * "pmessage" frame (an array, or a RESP3 push), without creating reply
+ * objects. msg->type is REDIS_MESSAGE_NONE when the next reply is anything
+ * else or is not buffered completely: nothing is consumed then, and the
+ * reply can be read with redisReaderGetReply. The strings in msg are valid
+ * until the reader is fed again. */
+int redisReaderGetMessage(redisReader *r, redisMessage *msg);
+
+/* Read straight into the reader buffer: redisReaderReserve returns free space
+ * at the end of the buffer (its size in *len), and redisReaderCommit appends
+ * the first len bytes written there. The reserved size adapts to the amount
+ * of data that is committed. */
+char *redisReaderReserve(redisReader *r, size_t *len);
+int redisReaderCommit(redisReader *r, size_t len);
+
+/* Carve every reply tree out of an arena owned by its root reply, so
+ * freeReplyObject on the root is a single free. Only valid when the reader
+ * uses the default reply object functions. */
+int redisReaderEnableReplyArena(redisReader *r);
+
+/* Let string replies point into the reader buffer instead of copying them.
+ * The buffer is kept alive until the last reply that references it is free'd.
+ * Only valid when the reader uses the default or arena reply functions. */
+int redisReaderEnableBorrowedStrings(redisReader *r);
+
+/* Return array, map and set replies without decoding their elements: the
+ * reply holds on to the reader buffer, and an element is only decoded when
+ * it is accessed with redisReplyElement (until then, it is NULL in the
+ * element vector). Only valid when the reader uses the default reply
+ * functions. */
+int redisReaderEnableLazyArrays(redisReader *r);
+
 /* Backwards compatibility, can be removed on big version bump. */
 #define redisReplyReaderCreate redisReaderCreate
 #define redisReplyReaderFree redisReaderFree
@@ -157,11 +314,43 @@ int redisReaderGetReply(redisReader *r, void **reply);
 /* Function to free the reply objects hiredis returns by default. */
 void freeReplyObject(void *reply);
 
+/* Return an element of an aggregate reply, decoding it first when the reply
+ * is lazy. Returns NULL when idx is out of range or on OOM. */
+redisReply *redisReplyElement(redisReply *reply, size_t idx);
+
+/* Convert a numeric reply without going through strtod/strtoll: integers,
+ * doubles, and strings, status replies and big numbers that hold a number
+ * (like the replies of ZSCORE or INCRBYFLOAT). Doubles are parsed with the
+ * '.' decimal point regardless of the locale. Returns REDIS_ERR when the
+ * reply isn't a number, or for redisReplyAsInt64, not an integral one. */
+int redisReplyAsDouble(const redisReply *reply, double *value);
+int redisReplyAsInt64(const redisReply *reply, int64_t *value);
+
+/* Convert the elements first, first+step, ... of an aggregate reply into
+ * "values", which must have room for all of them, and set *n to the number
+ * of values. With first 1 and step 2 this returns the scores of a ZRANGE
+ * WITHSCORES reply. Returns REDIS_ERR when an element isn't a number. */
+int redisReplyArrayAsDoubles(redisReply *reply, size_t first, size_t step,
+                             double *values, size_t *n);
+int redisReplyArrayAsInt64s(redisReply *reply, size_t first, size_t step,
+                            int64_t *values, size_t *n);
+
 /* Functions to format a command according to the protocol. */
 int redisvFormatCommand(char **target, const char *format, va_list ap);
 int redisFormatCommand(char **target, const char *format, ...);
 int redisFormatCommandArgv(char **target, int argc, const char **argv, const size_t *argvlen);
 
+/* A format that was parsed once with redisPrepareFormat, so commands can be
+ * formatted with it without parsing it again. It accepts the same formats as
+ * redisFormatCommand. Plain %d, %i and %u conversions (with l and ll
+ * modifiers) are encoded without printf. */
+typedef struct redisFormat redisFormat;
+
+redisFormat *redisPrepareFormat(const char *format);
+void redisFreeFormat(redisFormat *fmt);
+int redisvFormatPrepared(char **target, const redisFormat *fmt, va_list ap);
+int redisFormatPrepared(char **target, const redisFormat *fmt, ...);
+
 /* Context for a connection to Redis */
 typedef struct redisContext {
     int err; /* Error flags, 0 when there is no error */
@@ -170,6 +359,11 @@ typedef struct redisContext {
     int flags;
     char *obuf; /* Write buffer */
     redisReader *reader; /* Protocol reader */
+    struct redisOutputBlock *oqueue; /* Output that is written before obuf */
+    struct redisOutputBlock *oqueuetail;
+    size_t oqueuelen; /* Bytes in oqueue */
+    struct redisOutputBlock *opool; /* Free blocks */
+    int opoolsize;
 } redisContext;
 
 redisContext *redisConnect(const char *ip, int port);
@@ -180,6 +374,9 @@ redisContext *redisConnectUnixWithTimeout(const char *path, const struct timeval
 redisContext *redisConnectUnixNonBlock(const char *path);
 int redisSetTimeout(redisContext *c, const struct timeval tv);
 int redisEnableKeepAlive(redisContext *c);
+int redisEnableReplyArena(redisContext *c);
+int redisEnableBorrowedStrings(redisContext *c);
+int redisEnableLazyArrays(redisContext *c);
 void redisFree(redisContext *c);
 int redisBufferRead(redisContext *c);
 int redisBufferWrite(redisContext *c, int *done);
@@ -191,11 +388,51 @@ int redisBufferWrite(redisContext *c, int *done);
 int redisGetReply(redisContext *c, void **reply);
 int redisGetReplyFromReader(redisContext *c, void **reply);
 
+/* Like redisGetReply, but returns up to max replies at once when they are
+ * buffered. In a blocking context, it reads until there is at least one. */
+int redisGetReplies(redisContext *c, void **replies, size_t max, size_t *n);
+
+/* Like redisGetReply for a blocking context, but when the reply is a bulk
+ * string, its payload is written to fd instead of being allocated, and the
+ * reply is an integer with the number of bytes that were written. */
+int redisGetReplyToFd(redisContext *c, int fd, void **reply);
+
 /* Write a command to the output buffer. Use these functions in blocking mode
  * to get a pipeline of commands. */
 int redisvAppendCommand(redisContext *c, const char *format, va_list ap);
 int redisAppendCommand(redisContext *c, const char *format, ...);
 int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen);
+int redisvAppendPrepared(redisContext *c, const redisFormat *fmt, va_list ap);
+int redisAppendPrepared(redisContext *c, const redisFormat *fmt, ...);
+
+/* Like redisAppendCommandArgv, but arguments of at least REDIS_IOV_COPY_MAX
+ * bytes are not copied to the output buffer: they are written to the socket
+ * straight from the caller's memory. The caller must keep these buffers
+ * alive until release is called with privdata, which happens once all of
+ * them were written or when the context is free'd. It is called right away
+ * when every argument was copied. On error, release is not called. */
+#define REDIS_IOV_COPY_MAX (16*1024)
+typedef void (redisReleaseFn)(void *privdata);
+int redisAppendCommandIov(redisContext *c, int argc, const struct iovec *argv,
+                          redisReleaseFn *release, void *privdata);
+
+/* Argument of redisAppendCommandArgs. When buf is NULL, the argument is the
+ * "len" bytes of file descriptor fd that start at "offset". */
+typedef struct redisArg {
+    const char *buf;
+    size_t len;
+    int fd;
+    off_t offset;
+} redisArg;
+
+/* Like redisAppendCommandIov, but arguments can also be read from files.
+ * These are sent with sendfile(2) where it is available, and the file
+ * descriptors must stay open until release is called. */
+int redisAppendCommandArgs(redisContext *c, int argc, const redisArg *argv,
+                           redisReleaseFn *release, void *privdata);
+
+/* Number of bytes in the output buffer that are not written yet. */
+size_t redisPendingBytes(redisContext *c);
 
 /* Issue a command to Redis. In a blocking context, it is identical to calling
  * redisAppendCommand, followed by redisGetReply. The function will return
@@ -60,6 +60,9 @@ sds sdsdup(const sds s);
 void sdsfree(sds s);
 size_t sdsavail(sds s);
 sds sdsgrowzero(sds s, size_t len);
+sds sdsMakeRoomFor(sds s, size_t addlen);
+sds sdsMakeRoomForNonGreedy(sds s, size_t addlen);
+void sdsIncrLen(sds s, int incr);
 sds sdscatlen(sds s, const void *t, size_t len);
 sds sdscat(sds s, const char *t);
 sds sdscpylen(sds s, char *t, size_t len);
@@ -4,13 +4,19 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <assert.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <locale.h>
 
 #include "hiredis.h"
+#include "async.h"
+#include "sds.h"
 
 enum connection_type {
     CONN_TCP,
@@ -42,6 +48,17 @@ static long long usec(void) {
     return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
 }
 
+/* Cycle counter for the parser benchmarks, 0 when not available. */
+static unsigned long long cycles(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
 static redisContext *select_database(redisContext *c) {
     redisReply *reply;
 
@@ -205,6 +222,315 @@ static void test_format_commands(void) {
     free(cmd);
 }
 
+/* Format a command with redisFormatCommand and a prepared format and check
+ * both produce the same bytes. */
+#define PREPARED_TEST(name, fmt, ...) do {                                \
+    redisFormat *_f = redisPrepareFormat(fmt);                            \
+    char *_c1 = NULL, *_c2 = NULL;                                        \
+    int _l1, _l2;                                                         \
+    test("Prepared format matches redisFormatCommand (" name "): ");      \
+    _l1 = redisFormatCommand(&_c1,fmt,__VA_ARGS__);                       \
+    _l2 = _f ? redisFormatPrepared(&_c2,_f,__VA_ARGS__) : -1;             \
+    test_cond(_l1 > 0 && _l1 == _l2 && memcmp(_c1,_c2,_l1) == 0);         \
+    free(_c1);                                                            \
+    free(_c2);                                                            \
+    redisFreeFormat(_f);                                                  \
+} while(0)
+
+static void test_prepared_formats(void) {
+    redisFormat *fmt;
+    redisContext *c;
+    redisAsyncContext *ac;
+    char *cmd;
+    int len, i;
+
+    test("Prepared format without conversions: ");
+    fmt = redisPrepareFormat("SET foo bar");
+    len = redisFormatPrepared(&cmd,fmt);
+    test_cond(len == 4+4+(3+2)+4+(3+2)+4+(3+2) &&
+        memcmp(cmd,"*3\r\n$3\r\nSET\r\n$3\r\nfoo\r\n$3\r\nbar\r\n",len) == 0);
+    free(cmd);
+    redisFreeFormat(fmt);
+
+    PREPARED_TEST("strings","HSET %s f%s:x %b","key","ield","b\0r",(size_t)3);
+    PREPARED_TEST("empty strings","SET %s %b","",(char*)NULL,(size_t)0);
+    PREPARED_TEST("integers","INCRBY c:%d %lld %u %lu %i",-7,LLONG_MIN,UINT_MAX,ULONG_MAX,0);
+    PREPARED_TEST("literal %%","SET %% a%%b%s","c");
+    PREPARED_TEST("printf","key:%08d %x %.3f %hhd %s",123,255,1.5,(char)-1,"end");
+    PREPARED_TEST("long printf","SET %f %s",1e40,"x");
+    PREPARED_TEST("many conversions",
+        "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d",
+        1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20);
+
+    test("Prepared format rejects an invalid format: ");
+    test_cond(redisPrepareFormat("key:%08p %b") == NULL);
+
+    test("Prepared commands are appended to the output buffer: ");
+    c = redisConnectUnix("/tmp/idontexist.sock");
+    fmt = redisPrepareFormat("HSET user:%d %s %b");
+    for (i = 0; i < 3; i++)
+        assert(redisAppendPrepared(c,fmt,i,"name","abc",(size_t)i) == REDIS_OK);
+    test_cond(strcmp(c->obuf,
+        "*4\r\n$4\r\nHSET\r\n$6\r\nuser:0\r\n$4\r\nname\r\n$0\r\n\r\n"
+        "*4\r\n$4\r\nHSET\r\n$6\r\nuser:1\r\n$4\r\nname\r\n$1\r\na\r\n"
+        "*4\r\n$4\r\nHSET\r\n$6\r\nuser:2\r\n$4\r\nname\r\n$2\r\nab\r\n") == 0);
+    redisFreeFormat(fmt);
+    redisFree(c);
+
+    test("Commands are appended to the output buffer: ");
+    c = redisConnectUnix("/tmp/idontexist.sock");
+    {
+        const char *argv[3] = {"SET","foo","bar"};
+        assert(redisAppendCommandArgv(c,3,argv,NULL) == REDIS_OK);
+        assert(redisAppendCommand(c,"GET %s","foo") == REDIS_OK);
+    }
+    test_cond(strcmp(c->obuf,"*3\r\n$3\r\nSET\r\n$3\r\nfoo\r\n$3\r\nbar\r\n"
+                             "*2\r\n$3\r\nGET\r\n$3\r\nfoo\r\n") == 0);
+    redisFree(c);
+
+    test("Async commands that aren't sent are dropped from the output buffer: ");
+    ac = redisAsyncConnectUnix("/tmp/idontexist.sock");
+    assert(redisAsyncCommand(ac,NULL,NULL,"PING") == REDIS_OK);
+    test_cond(redisAsyncCommand(ac,NULL,NULL,"UNSUBSCRIBE %s","foo") == REDIS_ERR &&
+        strcmp(ac->c.obuf,"*1\r\n$4\r\nPING\r\n") == 0);
+    redisAsyncFree(ac);
+}
+
+static void iov_release(void *privdata) {
+    (*(int*)privdata)++;
+}
+
+/* Flush a context that writes to the write end of a pipe, reading the
+ * other end into buf. Returns the number of bytes read. */
+static size_t flush_to_pipe(redisContext *c, int fd, char *buf, size_t size) {
+    size_t total = 0;
+    ssize_t nread;
+    int done = 0;
+
+    while (!done) {
+        assert(redisBufferWrite(c,&done) == REDIS_OK);
+        while ((nread = read(fd,buf+total,size-total)) > 0)
+            total += nread;
+    }
+    return total;
+}
+
+static void test_append_iov(void) {
+    redisContext *c;
+    struct iovec argv[4];
+    size_t biglen = 1024*1024, n, hlen;
+    char *big = malloc(biglen), *buf = malloc(2*biglen+1024), *expected;
+    int fds[2], released = 0, i;
+
+    for (i = 0; i < (int)biglen; i++)
+        big[i] = 'a'+(i%26);
+
+    test("Small iov arguments are copied and released right away: ");
+    c = redisConnectUnix("/tmp/idontexist.sock");
+    argv[0].iov_base = (void*)"SET";
+    argv[0].iov_len = 3;
+    argv[1].iov_base = (void*)"key";
+    argv[1].iov_len = 3;
+    argv[2].iov_base = (void*)"value";
+    argv[2].iov_len = 5;
+    assert(redisAppendCommandIov(c,3,argv,iov_release,&released) == REDIS_OK);
+    test_cond(released == 1 && c->oqueue == NULL &&
+        strcmp(c->obuf,"*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n") == 0);
+
+    test("Large iov arguments are referenced instead of copied: ");
+    released = 0;
+    sdsfree(c->obuf);
+    c->obuf = sdsempty();
+    argv[2].iov_base = big;
+    argv[2].iov_len = biglen;
+    argv[3].iov_base = big;
+    argv[3].iov_len = biglen;
+    assert(redisAppendCommandIov(c,4,argv,iov_release,&released) == REDIS_OK);
+    assert(redisAppendCommand(c,"PING") == REDIS_OK);
+    test_cond(released == 0 && sdslen(c->obuf) < 100);
+
+    test("Referenced buffers are written in order and then released: ");
+    assert(pipe(fds) == 0);
+    fcntl(fds[1],F_SETFL,O_NONBLOCK);
+    fcntl(fds[0],F_SETFL,O_NONBLOCK);
+    c->err = 0;
+    c->fd = fds[1];
+    c->flags &= ~REDIS_BLOCK;
+    n = flush_to_pipe(c,fds[0],buf,2*biglen+1024);
+    expected = malloc(2*biglen+1024);
+    hlen = sprintf(expected,"*4\r\n$3\r\nSET\r\n$3\r\nkey\r\n$%zu\r\n",biglen);
+    memcpy(expected+hlen,big,biglen);
+    hlen += biglen;
+    hlen += sprintf(expected+hlen,"\r\n$%zu\r\n",biglen);
+    memcpy(expected+hlen,big,biglen);
+    hlen += biglen;
+    hlen += sprintf(expected+hlen,"\r\n*1\r\n$4\r\nPING\r\n");
+    test_cond(n == hlen && memcmp(buf,expected,n) == 0 && released == 1 &&
+        c->oqueue == NULL && sdslen(c->obuf) == 0);
+
+    test("Referenced buffers are released when the context is free'd: ");
+    released = 0;
+    assert(redisAppendCommandIov(c,4,argv,iov_release,&released) == REDIS_OK);
+    redisFree(c);
+    close(fds[0]);
+    test_cond(released == 1);
+
+    free(expected);
+    free(buf);
+    free(big);
+}
+
+static void test_append_files(void) {
+    redisContext *c;
+    redisArg argv[4];
+    char path[] = "/tmp/hiredis-test-XXXXXX", *data, *buf, *expected;
+    size_t datalen = 100*1024, size = 2*datalen, len;
+    int fd, fds[2], released = 0, i;
+
+    data = malloc(datalen);
+    buf = malloc(size);
+    expected = malloc(size);
+    for (i = 0; i < (int)datalen; i++)
+        data[i] = 'a'+(i%26);
+    assert((fd = mkstemp(path)) != -1);
+    assert(write(fd,data,datalen) == (ssize_t)datalen);
+    unlink(path);
+
+    test("File arguments are written from the file: ");
+    c = redisConnectUnix("/tmp/idontexist.sock");
+    memset(argv,0,sizeof(argv));
+    argv[0].buf = "MSET";
+    argv[0].len = 4;
+    argv[1].buf = "a";
+    argv[1].len = 1;
+    argv[2].fd = fd;
+    argv[2].offset = 10;
+    argv[2].len = 5;
+    argv[3].fd = fd;
+    argv[3].offset = 1;
+    argv[3].len = datalen-1;
+    assert(redisAppendCommandArgs(c,4,argv,iov_release,&released) == REDIS_OK);
+    assert(pipe(fds) == 0);
+    fcntl(fds[1],F_SETFL,O_NONBLOCK);
+    fcntl(fds[0],F_SETFL,O_NONBLOCK);
+    c->err = 0;
+    c->fd = fds[1];
+    c->flags &= ~REDIS_BLOCK;
+    len = sprintf(expected,"*4\r\n$4\r\nMSET\r\n$1\r\na\r\n$5\r\nklmno\r\n$%zu\r\n",datalen-1);
+    memcpy(expected+len,data+1,datalen-1);
+    len += datalen-1;
+    len += sprintf(expected+len,"\r\n");
+    test_cond(flush_to_pipe(c,fds[0],buf,size) == len &&
+        memcmp(buf,expected,len) == 0 && released == 1);
+
+    test("A file that is shorter than its argument is an error: ");
+    argv[3].offset = 2;
+    assert(redisAppendCommandArgs(c,4,argv,NULL,NULL) == REDIS_OK);
+    while (redisBufferWrite(c,NULL) == REDIS_OK)
+        while (read(fds[0],buf,size) > 0);
+    test_cond(c->err == REDIS_ERR_IO);
+
+    redisFree(c);
+    close(fds[0]);
+    close(fd);
+    free(expected);
+    free(buf);
+    free(data);
+}
+
+static void test_reply_to_fd(void) {
+    redisContext *c;
+    redisReply *reply;
+    char path[] = "/tmp/hiredis-test-XXXXXX", *payload, *buf;
+    size_t len = 60000;
+    int fd, fds[2], i;
+
+    payload = malloc(len);
+    buf = malloc(len+1);
+    for (i = 0; i < (int)len; i++)
+        payload[i] = 'a'+(i%26);
+    assert((fd = mkstemp(path)) != -1);
+    unlink(path);
+
+    c = redisConnectUnix("/tmp/idontexist.sock");
+    assert(pipe(fds) == 0);
+    c->err = 0;
+    c->fd = fds[0];
+    c->flags |= REDIS_BLOCK;
+    i = sprintf(buf,"$%zu\r\n",len);
+    assert(write(fds[1],buf,i) == i);
+    assert(write(fds[1],payload,len) == (ssize_t)len);
+    assert(write(fds[1],"\r\n$-1\r\n:5\r\n+OK\r\n",16) == 16);
+
+    test("Bulk replies are written to a file descriptor: ");
+    assert(redisGetReplyToFd(c,fd,(void**)&reply) == REDIS_OK);
+    test_cond(reply->type == REDIS_REPLY_INTEGER && reply->integer == (long long)len &&
+        pread(fd,buf,len+1,0) == (ssize_t)len && memcmp(buf,payload,len) == 0);
+    freeReplyObject(reply);
+
+    test("Replies that are not bulk strings are returned as usual: ");
+    assert(redisGetReplyToFd(c,fd,(void**)&reply) == REDIS_OK);
+    i = (reply->type == REDIS_REPLY_NIL);
+    freeReplyObject(reply);
+    assert(redisGetReplyToFd(c,fd,(void**)&reply) == REDIS_OK);
+    i = i && reply->type == REDIS_REPLY_INTEGER && reply->integer == 5;
+    freeReplyObject(reply);
+    assert(redisGetReply(c,(void**)&reply) == REDIS_OK);
+    test_cond(i && reply->type == REDIS_REPLY_STATUS && strcmp(reply->str,"OK") == 0);
+    freeReplyObject(reply);
+
+    redisFree(c);
+    close(fds[1]);
+    close(fd);
+    free(buf);
+    free(payload);
+}
+
+static void test_output_blocks(void) {
+    redisContext *c;
+    size_t size = 1024*1024, len = 0, maxalloc = 0, bulklen = 100*1024;
+    char *buf = malloc(size), *expected = malloc(size), *bulk = malloc(bulklen), *cmd;
+    int fds[2], i, n;
+
+    memset(bulk,'x',bulklen);
+
+    test("Pipelined commands are queued in fixed size blocks: ");
+    c = redisConnectUnix("/tmp/idontexist.sock");
+    for (i = 0; i < 10000; i++) {
+        if (i == 5000) {
+            assert(redisAppendCommand(c,"SET big %b",bulk,bulklen) == REDIS_OK);
+            n = redisFormatCommand(&cmd,"SET big %b",bulk,bulklen);
+        } else {
+            assert(redisAppendCommand(c,"SET key:%d %d",i,i) == REDIS_OK);
+            n = redisFormatCommand(&cmd,"SET key:%d %d",i,i);
+            if (sdslen(c->obuf)+sdsavail(c->obuf) > maxalloc)
+                maxalloc = sdslen(c->obuf)+sdsavail(c->obuf);
+        }
+        memcpy(expected+len,cmd,n);
+        len += n;
+        free(cmd);
+    }
+    test_cond(redisPendingBytes(c) == len && c->oqueue != NULL &&
+        maxalloc == 16*1024);
+
+    test("Queued blocks are written in order: ");
+    assert(pipe(fds) == 0);
+    fcntl(fds[1],F_SETFL,O_NONBLOCK);
+    fcntl(fds[0],F_SETFL,O_NONBLOCK);
+    c->err = 0;
+    c->fd = fds[1];
+    c->flags &= ~REDIS_BLOCK;
+    test_cond(flush_to_pipe(c,fds[0],buf,size) == len &&
+        memcmp(buf,expected,len) == 0 && redisPendingBytes(c) == 0 &&
+        c->oqueue == NULL);
+
+    redisFree(c);
+    close(fds[0]);
+    free(bulk);
+    free(expected);
+    free(buf);
+}
+
 static void test_reply_reader(void) {
     redisReader *reader;
     void *reply;
@@ -243,6 +569,51 @@ static void test_reply_reader(void) {
               strncasecmp(reader->errstr,"No support for",14) == 0);
     redisReaderFree(reader);
 
+    test("Parses integers at the bounds of a long long: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)":-9223372036854775808\r\n:9223372036854775807\r\n:-1\r\n:000000000000000000000042\r\n",77);
+    ret = redisReaderGetReply(reader,&reply);
+    i = ret == REDIS_OK && ((redisReply*)reply)->integer == LLONG_MIN;
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,&reply);
+    i = i && ret == REDIS_OK && ((redisReply*)reply)->integer == LLONG_MAX;
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,&reply);
+    i = i && ret == REDIS_OK && ((redisReply*)reply)->integer == -1;
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(i && ret == REDIS_OK && ((redisReply*)reply)->integer == 42);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Set error on integer overflow: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)":9223372036854775808\r\n",22);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_ERR && strcmp(reader->errstr,"Bad integer value") == 0);
+    redisReaderFree(reader);
+
+    test("Set error on an invalid digit: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)":12345678x\r\n",12);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_ERR && strcmp(reader->errstr,"Bad integer value") == 0);
+    redisReaderFree(reader);
+
+    test("Set error on an invalid bulk length: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"$-2\r\n",5);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_ERR && strcmp(reader->errstr,"Bad bulk string length") == 0);
+    redisReaderFree(reader);
+
+    test("Set error on an invalid multi bulk length: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"*\r\n",3);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_ERR && strcmp(reader->errstr,"Bad multi-bulk length") == 0);
+    redisReaderFree(reader);
+
     test("Works with NULL functions for reply: ");
     reader = redisReaderCreate();
     reader->fn = NULL;
@@ -262,6 +633,23 @@ static void test_reply_reader(void) {
     test_cond(ret == REDIS_OK && reply == (void*)REDIS_REPLY_STATUS);
     redisReaderFree(reader);
 
+    test("Finds the end of a long line that is fed one byte at a time: ");
+    reader = redisReaderCreate();
+    {
+        const char *line = "+0123456789abcdef\r0123456789abcdef0123456789abcdef\r\r\n";
+        for (i = 0; line[i] != '\0'; i++) {
+            redisReaderFeed(reader,line+i,1);
+            ret = redisReaderGetReply(reader,&reply);
+            if (ret != REDIS_OK || reply != NULL) break;
+        }
+        test_cond(ret == REDIS_OK && reply != NULL &&
+            ((redisReply*)reply)->type == REDIS_REPLY_STATUS &&
+            (size_t)((redisReply*)reply)->len == strlen(line)-3 &&
+            memcmp(((redisReply*)reply)->str,line+1,strlen(line)-3) == 0);
+    }
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
     test("Don't reset state after protocol error: ");
     reader = redisReaderCreate();
     reader->fn = NULL;
@@ -284,6 +672,1657 @@ static void test_reply_reader(void) {
     redisReaderFree(reader);
 }
 
+/* Reader options for reader_throughput. */
+#define READER_ARENA 1
+#define READER_BORROW 2
+#define READER_EVENTS 4 /* Pull events instead of building replies */
+#define READER_BATCH 8 /* Use redisReaderGetReplies */
+#define READER_LAZY 16 /* Lazy arrays, only the first element is accessed */
+
+/* Feed "proto" to a reader "num" times in reads of "feed" bytes and parse
+ * every reply after each read, then print the parser speed in MB/s and, when
+ * a cycle counter is available, bytes/cycle. */
+static void reader_throughput(const char *name, const char *proto, int num, size_t feed, int opts) {
+    redisReader *reader;
+    size_t len = strlen(proto), total = len*num;
+    char *buf = malloc(total);
+    unsigned long long c1, c2;
+    long long t1, t2;
+    redisReaderEvent ev;
+    void *reply, *batch[64];
+    size_t n;
+    int i, count = 0;
+
+    for (i = 0; i < num; i++)
+        memcpy(buf+len*i,proto,len);
+
+    reader = redisReaderCreate();
+    if (opts & READER_ARENA) redisReaderEnableReplyArena(reader);
+    if (opts & READER_BORROW) redisReaderEnableBorrowedStrings(reader);
+    if (opts & READER_LAZY) redisReaderEnableLazyArrays(reader);
+    t1 = usec();
+    c1 = cycles();
+    for (i = 0; i < (int)total; i += feed) {
+        redisReaderFeed(reader,buf+i,total-i < feed ? total-i : feed);
+        if (opts & READER_EVENTS) {
+            while (redisReaderNextEvent(reader,&ev) == REDIS_OK &&
+                   ev.type != REDIS_EVENT_NONE)
+            {
+                if (ev.depth == 0 && ev.type != REDIS_EVENT_ARRAY) count++;
+            }
+            continue;
+        }
+        if (opts & READER_BATCH) {
+            while (redisReaderGetReplies(reader,batch,64,&n) == REDIS_OK && n > 0) {
+                count += n;
+                while (n > 0) freeReplyObject(batch[--n]);
+            }
+            continue;
+        }
+        while (redisReaderGetReply(reader,&reply) == REDIS_OK && reply != NULL) {
+            if (opts & READER_LAZY) assert(redisReplyElement(reply,0) != NULL);
+            freeReplyObject(reply);
+            count++;
+        }
+    }
+    c2 = cycles();
+    t2 = usec();
+    assert(count == num);
+    redisReaderFree(reader);
+    free(buf);
+
+    printf("\t(%dx %s: %.3fs, %.1f MB/s", num, name, (t2-t1)/1000000.0,
+        t2 > t1 ? (double)total/(t2-t1) : 0.0);
+    if (c2 > c1)
+        printf(", %.3f bytes/cycle", (double)total/(c2-c1));
+    printf(")\n");
+}
+
+/* Read a 500 member ZRANGE WITHSCORES reply "num" times and convert its
+ * scores with strtod or with redisReplyArrayAsDoubles, then print the time
+ * per score, reading the reply included. */
+static void score_throughput(const char *name, int num, int opts) {
+    redisReader *reader;
+    redisReply *reply;
+    char *proto, score[32];
+    double scores[500], sum = 0;
+    size_t j, n;
+    long long t1, t2;
+    int i, len;
+
+    proto = malloc(16+500*40);
+    len = sprintf(proto,"*1000\r\n");
+    for (i = 0; i < 500; i++) {
+        snprintf(score,sizeof(score),"%.17g",i*1.37+0.1);
+        len += sprintf(proto+len,"$7\r\nuser%03d\r\n$%d\r\n%s\r\n",i,(int)strlen(score),score);
+    }
+
+    reader = redisReaderCreate();
+    if (opts & READER_LAZY) redisReaderEnableLazyArrays(reader);
+    t1 = usec();
+    for (i = 0; i < num; i++) {
+        redisReaderFeed(reader,proto,len);
+        assert(redisReaderGetReply(reader,(void**)&reply) == REDIS_OK);
+        if (opts & READER_EVENTS) {
+            for (j = 0; j < 500; j++)
+                scores[j] = strtod(reply->element[j*2+1]->str,NULL);
+        } else {
+            assert(redisReplyArrayAsDoubles(reply,1,2,scores,&n) == REDIS_OK && n == 500);
+        }
+        sum += scores[499];
+        freeReplyObject(reply);
+    }
+    t2 = usec();
+    assert(sum > 0);
+    redisReaderFree(reader);
+    free(proto);
+
+    printf("\t(%dx 500 scores %s: %.3fs, %.1f ns/score)\n", num, name,
+        (t2-t1)/1000000.0, (t2-t1)*1000.0/(num*500.0));
+}
+
+/* Read "num" bulks of "size" bytes, fed in pieces of at most "feed" bytes
+ * that don't cross the end of a reply, like reads from a socket do. */
+static void bulk_throughput(size_t size, int num, size_t feed) {
+    redisReader *reader = redisReaderCreate();
+    char *buf = malloc(size+32);
+    size_t len, i, n;
+    long long t1, t2;
+    void *reply;
+    int j;
+
+    len = sprintf(buf,"$%zu\r\n",size);
+    memset(buf+len,'x',size);
+    memcpy(buf+len+size,"\r\n",2);
+    len += size+2;
+
+    t1 = usec();
+    for (j = 0; j < num; j++) {
+        for (i = 0; i < len; i += n) {
+            n = len-i < feed ? len-i : feed;
+            redisReaderFeed(reader,buf+i,n);
+            assert(redisReaderGetReply(reader,&reply) == REDIS_OK);
+        }
+        assert(reply != NULL);
+        freeReplyObject(reply);
+    }
+    t2 = usec();
+    redisReaderFree(reader);
+    free(buf);
+
+    printf("\t(%dx %zuMB bulk: %.3fs, %.1f MB/s)\n", num, size/(1024*1024),
+        (t2-t1)/1000000.0, (double)len*num/((t2-t1)/1000000.0)/(1024*1024));
+}
+
+static void test_reader_throughput(void) {
+    char line[1024], *lrange;
+    int i, len;
+
+    test("Reply parser throughput:\n");
+    reader_throughput("+PONG","+PONG\r\n",1000000,16*1024,0);
+    reader_throughput("+PONG (1MB reads)","+PONG\r\n",1000000,1024*1024,0);
+    reader_throughput("+PONG (1MB reads, batched)","+PONG\r\n",1000000,1024*1024,READER_BATCH);
+    reader_throughput(":12345 (INCR)",":12345\r\n",1000000,16*1024,0);
+    reader_throughput(":12345 (INCR, events)",":12345\r\n",1000000,16*1024,READER_EVENTS);
+    reader_throughput(":1234567890123 (events)",":1234567890123\r\n",1000000,16*1024,READER_EVENTS);
+    reader_throughput("3 element multi bulk",
+        "*3\r\n$3\r\nfoo\r\n$3\r\nbar\r\n:12345\r\n",200000,16*1024,0);
+
+    memset(line,'x',sizeof(line));
+    line[0] = '+';
+    memcpy(line+sizeof(line)-3,"\r\n",3);
+    reader_throughput("1k status line",line,100000,16*1024,0);
+
+    lrange = malloc(16+500*11);
+    len = sprintf(lrange,"*500\r\n");
+    for (i = 0; i < 500; i++)
+        len += sprintf(lrange+len,"$4\r\n%04d\r\n",i);
+    reader_throughput("500 element multi bulk",lrange,1000,16*1024,0);
+    reader_throughput("500 element multi bulk (arena)",lrange,1000,16*1024,READER_ARENA);
+    reader_throughput("500 element multi bulk (events)",lrange,1000,16*1024,READER_EVENTS);
+    reader_throughput("500 element multi bulk (lazy)",lrange,1000,16*1024,READER_LAZY);
+    free(lrange);
+
+    score_throughput("(strtod)",1000,READER_EVENTS);
+    score_throughput("(redisReplyArrayAsDoubles)",1000,0);
+    score_throughput("(redisReplyArrayAsDoubles, lazy)",1000,READER_LAZY);
+
+    lrange = malloc(16+1024*8);
+    len = sprintf(lrange,"$%d\r\n",1024*8);
+    memset(lrange+len,'x',1024*8);
+    memcpy(lrange+len+1024*8,"\r\n",3);
+    reader_throughput("8k bulk",lrange,20000,16*1024,0);
+    reader_throughput("8k bulk (borrowed)",lrange,20000,16*1024,READER_BORROW);
+    free(lrange);
+
+    bulk_throughput(4*1024*1024,50,64*1024);
+}
+
+/* Format "num" HSET commands in different ways and print the time per
+ * command. Commands that are appended to the output buffer are written to
+ * /dev/null every 1000 commands. */
+#define FORMAT_COMMAND 0
+#define FORMAT_PREPARED 1
+#define FORMAT_APPEND 2
+#define FORMAT_APPEND_PREPARED 3
+#define FORMAT_APPEND_ARGV 4
+
+static void format_throughput(const char *name, int num, int how) {
+    const char *format = "HSET user:%d %s %b";
+    const char *argv[4] = {"HSET","user:1234","name","value"};
+    redisFormat *fmt = redisPrepareFormat(format);
+    redisContext *c = redisConnectUnix("/tmp/idontexist.sock");
+    long long t1, t2;
+    char *cmd;
+    int i;
+
+    c->err = 0;
+    c->fd = open("/dev/null",O_WRONLY);
+    t1 = usec();
+    for (i = 0; i < num; i++) {
+        switch(how) {
+        case FORMAT_COMMAND:
+            assert(redisFormatCommand(&cmd,format,i,"name","value",(size_t)5) > 0);
+            free(cmd);
+            break;
+        case FORMAT_PREPARED:
+            assert(redisFormatPrepared(&cmd,fmt,i,"name","value",(size_t)5) > 0);
+            free(cmd);
+            break;
+        case FORMAT_APPEND:
+            assert(redisAppendCommand(c,format,i,"name","value",(size_t)5) == REDIS_OK);
+            break;
+        case FORMAT_APPEND_PREPARED:
+            assert(redisAppendPrepared(c,fmt,i,"name","value",(size_t)5) == REDIS_OK);
+            break;
+        case FORMAT_APPEND_ARGV:
+            assert(redisAppendCommandArgv(c,4,argv,NULL) == REDIS_OK);
+            break;
+        }
+        if (i % 1000 == 999)
+            assert(redisBufferWrite(c,NULL) == REDIS_OK);
+    }
+    t2 = usec();
+    redisFreeFormat(fmt);
+    redisFree(c);
+
+    printf("\t(%dx HSET (%s): %.3fs, %.1f ns/command)\n", num, name,
+        (t2-t1)/1000000.0, (t2-t1)*1000.0/num);
+}
+
+/* Async context that reads its replies from a pipe. Replies are written to
+ * *fd, commands are never written. */
+static redisAsyncContext *async_pipe(int *fd) {
+    redisAsyncContext *ac = redisAsyncConnectUnix("/tmp/idontexist.sock");
+    int fds[2];
+
+    assert(ac != NULL && pipe(fds) == 0);
+    fcntl(fds[0],F_SETFL,O_NONBLOCK);
+    ac->c.err = 0;
+    ac->err = 0;
+    ac->c.fd = fds[0];
+    ac->c.flags |= REDIS_CONNECTED;
+    *fd = fds[1];
+    return ac;
+}
+
+/* Write num "+PONG" replies to the pipe of an async_pipe context. */
+static void async_pong(redisAsyncContext *ac, int fd, int num) {
+    static const char pong[] = "+PONG\r\n+PONG\r\n+PONG\r\n+PONG\r\n";
+    int n;
+
+    while (num > 0) {
+        n = num < 4 ? num : 4;
+        assert(write(fd,pong,n*7) == n*7);
+        num -= n;
+        if (num % 4096 == 0 || num == 0)
+            redisAsyncHandleRead(ac);
+    }
+}
+
+static void async_count(redisAsyncContext *ac, void *reply, void *privdata) {
+    (void)ac;
+    if (reply != NULL)
+        (*(int*)privdata)++;
+}
+
+/* Counts pub/sub messages per channel: privdata points at the counter. */
+static void async_message(redisAsyncContext *ac, void *reply, void *privdata) {
+    redisReply *r = reply;
+    (void)ac;
+    if (r != NULL && r->elements >= 3 &&
+        strcmp(r->element[0]->str,"message") == 0)
+        (*(int*)privdata)++;
+}
+
+static void async_throughput(int num) {
+    redisAsyncContext *ac;
+    long long t1, t2, t3;
+    int fd, i, n = 0;
+
+    ac = async_pipe(&fd);
+    t1 = usec();
+    for (i = 0; i < num; i++)
+        redisAsyncCommand(ac,async_count,&n,"PING");
+    t2 = usec();
+    async_pong(ac,fd,num);
+    t3 = usec();
+    assert(n == num);
+    redisAsyncFree(ac);
+    close(fd);
+
+    printf("\t(%dx PING (async): %.1f ns/command to submit, %.1f ns/reply to dispatch)\n",
+        num, (t2-t1)*1000.0/num, (t3-t2)*1000.0/num);
+}
+
+/* Counts pub/sub messages of the message callback. */
+static void async_typed_message(redisAsyncContext *ac, const redisMessage *msg, void *privdata) {
+    (void)ac;
+    (void)msg;
+    (*(int*)privdata)++;
+}
+
+/* Deliver num pub/sub messages on 64 of "channels" subscribed channels, in
+ * runs of 16 messages on the same channel. */
+static void async_pubsub_throughput(int num, int channels, int typed) {
+    redisAsyncContext *ac;
+    static char buf[64*16*64];
+    char name[16];
+    long long t1, t2;
+    int fd, i, j, len = 0, n = 0;
+
+    ac = async_pipe(&fd);
+    if (typed)
+        redisAsyncSetMessageCallback(ac,async_typed_message);
+    for (i = 0; i < channels; i++) {
+        snprintf(name,sizeof(name),"chan:%05d",i);
+        redisAsyncCommand(ac,async_message,&n,"SUBSCRIBE %s",name);
+    }
+    for (i = 0; i < 64; i++)
+        for (j = 0; j < 16; j++)
+            len += sprintf(buf+len,"*3\r\n$7\r\nmessage\r\n$10\r\nchan:%05d\r\n$1\r\nx\r\n",
+                (i*7919) % channels);
+
+    /* Every write is half the buffer: 512 messages. */
+    t1 = usec();
+    for (i = 0; i < num; i += 512) {
+        assert(write(fd,buf+(i/512%2)*(len/2),len/2) == len/2);
+        redisAsyncHandleRead(ac);
+    }
+    t2 = usec();
+    assert(n == (num+511)/512*512);
+    redisAsyncFree(ac);
+    close(fd);
+
+    printf("\t(%dx message over %d channels (async%s): %.1f ns/message to dispatch)\n",
+        num, channels, typed ? ", message callback" : "", (t2-t1)*1000.0/num);
+}
+
+/* Subscribe to num channels, "bulk" channels per command, like the
+ * resubscribe after a reconnect. */
+static void async_subscribe_throughput(int num, int bulk) {
+    redisAsyncContext *ac;
+    static char names[1000][16];
+    const char *argv[1001];
+    long long t1, t2;
+    int fd, i, j, n = 0;
+
+    assert(bulk <= 1000);
+    ac = async_pipe(&fd);
+    argv[0] = "SUBSCRIBE";
+    t1 = usec();
+    for (i = 0; i < num; i += bulk) {
+        for (j = 0; j < bulk; j++) {
+            snprintf(names[j],sizeof(names[j]),"chan:%d",i+j);
+            argv[j+1] = names[j];
+        }
+        redisAsyncCommandArgv(ac,async_message,&n,bulk+1,argv,NULL);
+    }
+    t2 = usec();
+    redisAsyncFree(ac);
+    close(fd);
+
+    printf("\t(%dx channel, %d per SUBSCRIBE (async): %.1f ns/channel)\n",
+        num, bulk, (t2-t1)*1000.0/num);
+}
+
+/* Flush a pipeline of "size" bytes through a pipe. Every write is partial,
+ * so this shows what is done with the output that is left. */
+static void flush_throughput(size_t size) {
+    redisContext *c = redisConnectUnix("/tmp/idontexist.sock");
+    char buf[64*1024];
+    long long t1, t2;
+    int fds[2], done = 0;
+
+    while (redisPendingBytes(c) < size)
+        assert(redisAppendCommand(c,"SET key:%d %s",12345,"value") == REDIS_OK);
+    size = redisPendingBytes(c);
+
+    assert(pipe(fds) == 0);
+    fcntl(fds[0],F_SETFL,O_NONBLOCK);
+    fcntl(fds[1],F_SETFL,O_NONBLOCK);
+    c->err = 0;
+    c->fd = fds[1];
+    c->flags &= ~REDIS_BLOCK;
+
+    t1 = usec();
+    while (!done) {
+        assert(redisBufferWrite(c,&done) == REDIS_OK);
+        while (read(fds[0],buf,sizeof(buf)) > 0);
+    }
+    t2 = usec();
+    redisFree(c);
+    close(fds[0]);
+
+    printf("\t(%zuMB pipeline through a pipe: %.3fs, %.1f MB/s)\n", size/(1024*1024),
+        (t2-t1)/1000000.0, size/((t2-t1)/1000000.0)/(1024*1024));
+}
+
+static void test_format_throughput(void) {
+    test("Command formatting throughput:\n");
+    format_throughput("redisFormatCommand",1000000,FORMAT_COMMAND);
+    format_throughput("redisFormatPrepared",1000000,FORMAT_PREPARED);
+    format_throughput("redisAppendCommand",1000000,FORMAT_APPEND);
+    format_throughput("redisAppendPrepared",1000000,FORMAT_APPEND_PREPARED);
+    format_throughput("redisAppendCommandArgv",1000000,FORMAT_APPEND_ARGV);
+    flush_throughput(64*1024*1024);
+    async_throughput(1000000);
+    async_pubsub_throughput(1000000,4096,0);
+    async_pubsub_throughput(1000000,4096,1);
+    async_subscribe_throughput(200000,1);
+    async_subscribe_throughput(200000,1000);
+}
+
+static void test_reader_events(void) {
+    redisReader *reader;
+    redisReaderEvent ev;
+    redisMessage msg;
+    int ret, i;
+    static const struct {
+        int type, depth;
+        const char *str;
+        long long integer;
+    } expected[] = {
+        { REDIS_EVENT_ARRAY, 0, NULL, 4 },
+        { REDIS_EVENT_STRING, 1, "foo", 0 },
+        { REDIS_EVENT_ARRAY, 1, NULL, 2 },
+        { REDIS_EVENT_INTEGER, 2, NULL, -42 },
+        { REDIS_EVENT_NIL, 2, NULL, 0 },
+        { REDIS_EVENT_ARRAY_END, 1, NULL, 0 },
+        { REDIS_EVENT_ARRAY, 1, NULL, 0 },
+        { REDIS_EVENT_ARRAY_END, 1, NULL, 0 },
+        { REDIS_EVENT_ERROR, 1, "ERR bad", 0 },
+        { REDIS_EVENT_ARRAY_END, 0, NULL, 0 },
+        { REDIS_EVENT_STATUS, 0, "OK", 0 }
+    };
+
+    test("Reads nested replies as a sequence of events: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"*4\r\n$3\r\nfoo\r\n*2\r\n:-42\r\n$-1\r\n*0\r\n-ERR bad\r\n+OK\r\n",47);
+    for (i = 0; i < (int)(sizeof(expected)/sizeof(expected[0])); i++) {
+        ret = redisReaderNextEvent(reader,&ev);
+        if (ret != REDIS_OK || ev.type != expected[i].type ||
+            ev.depth != expected[i].depth) break;
+        if (expected[i].str != NULL &&
+            (ev.len != strlen(expected[i].str) ||
+             memcmp(ev.str,expected[i].str,ev.len) != 0)) break;
+        if ((ev.type == REDIS_EVENT_ARRAY || ev.type == REDIS_EVENT_INTEGER) &&
+            ev.integer != expected[i].integer) break;
+    }
+    ret = redisReaderNextEvent(reader,&ev);
+    test_cond(i == (int)(sizeof(expected)/sizeof(expected[0])) &&
+        ret == REDIS_OK && ev.type == REDIS_EVENT_NONE);
+    redisReaderFree(reader);
+
+    test("Waits for a bulk to be completely buffered: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"$5\r\nhel",7);
+    ret = redisReaderNextEvent(reader,&ev);
+    assert(ret == REDIS_OK && ev.type == REDIS_EVENT_NONE);
+    redisReaderFeed(reader,(char*)"lo\r\n",4);
+    ret = redisReaderNextEvent(reader,&ev);
+    test_cond(ret == REDIS_OK && ev.type == REDIS_EVENT_STRING &&
+        ev.len == 5 && memcmp(ev.str,"hello",5) == 0);
+    redisReaderFree(reader);
+
+    test("Sets an error on an invalid type byte: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"@foo\r\n",6);
+    ret = redisReaderNextEvent(reader,&ev);
+    test_cond(ret == REDIS_ERR && ev.type == REDIS_EVENT_NONE &&
+        strcasecmp(reader->errstr,"Protocol error, got \"@\" as reply type byte") == 0);
+    redisReaderFree(reader);
+
+    test("Decodes pub/sub messages in place: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"*4\r\n$8\r\npmessage\r\n$2\r\nb*\r\n"
+        "$3\r\nbar\r\n$2\r\nhi\r\n*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n",69);
+    ret = redisReaderGetMessage(reader,&msg);
+    test_cond(ret == REDIS_OK && msg.type == REDIS_MESSAGE_PATTERN &&
+        msg.patternlen == 2 && memcmp(msg.pattern,"b*",2) == 0 &&
+        msg.channellen == 3 && memcmp(msg.channel,"bar",3) == 0 &&
+        msg.payloadlen == 2 && memcmp(msg.payload,"hi",2) == 0);
+
+    test("Leaves incomplete messages and other replies to the parser: ");
+    ret = redisReaderGetMessage(reader,&msg);
+    assert(ret == REDIS_OK && msg.type == REDIS_MESSAGE_NONE);
+    redisReaderFeed(reader,(char*)"$1\r\nx\r\n*3\r\n$4\r\npong\r\n$0\r\n\r\n:1\r\n",31);
+    ret = redisReaderGetMessage(reader,&msg);
+    assert(ret == REDIS_OK && msg.type == REDIS_MESSAGE &&
+        msg.channellen == 3 && msg.payloadlen == 1 && msg.payload[0] == 'x');
+    ret = redisReaderGetMessage(reader,&msg);
+    assert(ret == REDIS_OK && msg.type == REDIS_MESSAGE_NONE);
+    ret = redisReaderNextEvent(reader,&ev);
+    test_cond(ret == REDIS_OK && ev.type == REDIS_EVENT_ARRAY && ev.integer == 3);
+    redisReaderFree(reader);
+}
+
+static void test_reader_batches(void) {
+    redisReader *reader;
+    void *replies[4];
+    size_t n, count;
+    int ret;
+
+    test("Counts the complete replies that are buffered: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"+OK\r\n*2\r\n:1\r\n:2\r\n$3\r\nfoo\r\n:3\r\n*2\r\n$1",36);
+    ret = redisReaderCountReplies(reader,&count);
+    test_cond(ret == REDIS_OK && count == 4);
+
+    test("Reads buffered replies in batches: ");
+    ret = redisReaderGetReplies(reader,replies,3,&n);
+    test_cond(ret == REDIS_OK && n == 3 &&
+        ((redisReply*)replies[0])->type == REDIS_REPLY_STATUS &&
+        ((redisReply*)replies[1])->elements == 2 &&
+        ((redisReply*)replies[1])->element[1]->integer == 2 &&
+        strcmp(((redisReply*)replies[2])->str,"foo") == 0);
+    while (n > 0) freeReplyObject(replies[--n]);
+
+    test("Returns the rest of the batch: ");
+    ret = redisReaderGetReplies(reader,replies,4,&n);
+    test_cond(ret == REDIS_OK && n == 1 && ((redisReply*)replies[0])->integer == 3);
+    freeReplyObject(replies[0]);
+
+    test("Counts a reply that was partially read: ");
+    redisReaderGetReplies(reader,replies,4,&n);
+    assert(n == 0);
+    redisReaderFeed(reader,(char*)"\r\nx\r\n",5);
+    ret = redisReaderCountReplies(reader,&count);
+    test_cond(ret == REDIS_OK && count == 0);
+    redisReaderFeed(reader,(char*)"$1\r\ny\r\n+OK\r\n",12);
+    ret = redisReaderCountReplies(reader,&count);
+    assert(ret == REDIS_OK && count == 2);
+    ret = redisReaderGetReplies(reader,replies,4,&n);
+    test_cond(ret == REDIS_OK && n == 2 &&
+        ((redisReply*)replies[0])->elements == 2 &&
+        strcmp(((redisReply*)replies[0])->element[1]->str,"y") == 0);
+    while (n > 0) freeReplyObject(replies[--n]);
+    redisReaderFree(reader);
+
+    test("Returns the replies before a protocol error: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)":1\r\n@foo\r\n",10);
+    ret = redisReaderGetReplies(reader,replies,4,&n);
+    test_cond(ret == REDIS_ERR && n == 1 && ((redisReply*)replies[0])->integer == 1);
+    freeReplyObject(replies[0]);
+    redisReaderFree(reader);
+
+    test("Counting stops at a protocol error without setting it: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"+OK\r\n+OK\r\n@bad\r\n",16);
+    ret = redisReaderCountReplies(reader,&count);
+    assert(ret == REDIS_OK && count == 2 && reader->err == 0);
+    ret = redisReaderGetReplies(reader,replies,2,&n);
+    test_cond(ret == REDIS_OK && n == 2 &&
+        strcmp(((redisReply*)replies[1])->str,"OK") == 0);
+    while (n > 0) freeReplyObject(replies[--n]);
+    redisReaderFree(reader);
+}
+
+static void test_resp3(void) {
+    redisReader *reader;
+    redisReply *reply;
+    size_t count;
+    int ret;
+
+    test("Parses RESP3 doubles: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)",3.25\r\n,-inf\r\n",14);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_DOUBLE &&
+        reply->dval == 3.25 && strcmp(reply->str,"3.25") == 0);
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_DOUBLE &&
+        reply->dval < 0 && reply->dval*0 != 0);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Parses RESP3 booleans, nulls and big numbers: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"*4\r\n#t\r\n#f\r\n_\r\n(3492890328409238509324850943850943825024385\r\n",61);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_ARRAY &&
+        reply->element[0]->type == REDIS_REPLY_BOOL && reply->element[0]->integer == 1 &&
+        reply->element[1]->type == REDIS_REPLY_BOOL && reply->element[1]->integer == 0 &&
+        reply->element[2]->type == REDIS_REPLY_NIL &&
+        reply->element[3]->type == REDIS_REPLY_BIGNUM &&
+        strcmp(reply->element[3]->str,"3492890328409238509324850943850943825024385") == 0);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Parses RESP3 maps, sets and pushes: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"%2\r\n+a\r\n:1\r\n+b\r\n~2\r\n:2\r\n:3\r\n>2\r\n$10\r\ninvalidate\r\n*0\r\n",53);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_MAP &&
+        reply->elements == 4 && strcmp(reply->element[0]->str,"a") == 0 &&
+        reply->element[1]->integer == 1 &&
+        reply->element[3]->type == REDIS_REPLY_SET &&
+        reply->element[3]->elements == 2 &&
+        reply->element[3]->element[1]->integer == 3);
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_PUSH &&
+        reply->elements == 2 && strcmp(reply->element[0]->str,"invalidate") == 0);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Parses RESP3 verbatim strings and blob errors: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"=15\r\ntxt:Some string\r\n!21\r\nSYNTAX invalid syntax\r\n",50);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_VERB &&
+        strcmp(reply->vtype,"txt") == 0 && reply->len == 11 &&
+        strcmp(reply->str,"Some string") == 0);
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_ERROR &&
+        strcmp(reply->str,"SYNTAX invalid syntax") == 0);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Verbatim strings work with arenas and borrowed strings: ");
+    reader = redisReaderCreate();
+    redisReaderEnableReplyArena(reader);
+    redisReaderFeed(reader,(char*)"*1\r\n=7\r\nmkd:abc\r\n",17);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK);
+    test_cond(strcmp(reply->element[0]->vtype,"mkd") == 0 &&
+        strcmp(reply->element[0]->str,"abc") == 0);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+    reader = redisReaderCreate();
+    redisReaderEnableBorrowedStrings(reader);
+    redisReaderFeed(reader,(char*)"=7\r\nmkd:abc\r\n",13);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && strcmp(reply->vtype,"mkd") == 0 &&
+        strcmp(reply->str,"abc") == 0 && reply->len == 3);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Skips RESP3 attributes: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"|1\r\n+ttl\r\n:3\r\n*2\r\n|1\r\n+a\r\n*1\r\n:1\r\n:4\r\n:5\r\n",42);
+    ret = redisReaderCountReplies(reader,&count);
+    assert(ret == REDIS_OK && count == 1);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_ARRAY &&
+        reply->elements == 2 && reply->element[0]->integer == 4 &&
+        reply->element[1]->integer == 5);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Set error on a bad RESP3 double: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)",1.5x\r\n",7);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_ERR && strcmp(reader->errstr,"Bad double value") == 0);
+    redisReaderFree(reader);
+}
+
+static void test_lazy_arrays(void) {
+    redisReader *reader;
+    redisReply *reply, *elem;
+    const char *proto = "*4\r\n$3\r\nfoo\r\n*2\r\n:1\r\n|1\r\n+a\r\n+b\r\n:2\r\n$-1\r\n%1\r\n+k\r\n#t\r\n";
+    int ret, i;
+
+    test("Lazy arrays can't be enabled with custom reply functions: ");
+    reader = redisReaderCreate();
+    reader->fn = NULL;
+    test_cond(redisReaderEnableLazyArrays(reader) == REDIS_ERR);
+    redisReaderFree(reader);
+
+    test("Lazy arrays don't decode elements up front: ");
+    reader = redisReaderCreate();
+    assert(redisReaderEnableLazyArrays(reader) == REDIS_OK);
+    for (i = 0; proto[i] != '\0'; i++) {
+        redisReaderFeed(reader,proto+i,1);
+        ret = redisReaderGetReply(reader,(void**)&reply);
+        assert(ret == REDIS_OK);
+        if (reply != NULL) break;
+    }
+    test_cond(reply != NULL && proto[i+1] == '\0' &&
+        reply->type == REDIS_REPLY_ARRAY && reply->elements == 4 &&
+        reply->element[0] == NULL && reply->element[3] == NULL);
+
+    test("Lazy arrays decode elements on access: ");
+    elem = redisReplyElement(reply,1);
+    test_cond(elem != NULL && elem->type == REDIS_REPLY_ARRAY &&
+        elem->elements == 2 && elem->element[1]->integer == 2 &&
+        reply->element[1] == elem && reply->element[0] == NULL &&
+        redisReplyElement(reply,1) == elem);
+
+    test("Lazy arrays decode every type of element: ");
+    test_cond(strcmp(redisReplyElement(reply,0)->str,"foo") == 0 &&
+        redisReplyElement(reply,2)->type == REDIS_REPLY_NIL &&
+        redisReplyElement(reply,3)->type == REDIS_REPLY_MAP &&
+        redisReplyElement(reply,3)->element[1]->integer == 1 &&
+        redisReplyElement(reply,4) == NULL);
+
+    /* The buffer is kept alive by the reply, valgrind will bark when this
+     * doesn't hold. */
+    test("Lazy arrays can be decoded after the reader is free'd: ");
+    redisReaderFeed(reader,(char*)"*1\r\n$3\r\nbar\r\n",13);
+    ret = redisReaderGetReply(reader,(void**)&elem);
+    assert(ret == REDIS_OK && elem != NULL);
+    redisReaderFree(reader);
+    test_cond(strcmp(redisReplyElement(elem,0)->str,"bar") == 0);
+    freeReplyObject(elem);
+    freeReplyObject(reply);
+
+    test("Lazy arrays still return nil and scalar replies: ");
+    reader = redisReaderCreate();
+    redisReaderEnableLazyArrays(reader);
+    redisReaderFeed(reader,(char*)"*-1\r\n:5\r\n*0\r\n",13);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK && reply->type == REDIS_REPLY_NIL);
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK && reply->integer == 5);
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_ARRAY &&
+        reply->elements == 0);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+}
+
+/* Wrap a string in a reply on the stack for the numeric accessors. */
+static redisReply *string_reply(redisReply *r, int type, const char *str) {
+    memset(r,0,sizeof(*r));
+    r->type = type;
+    r->str = (char*)str;
+    r->len = strlen(str);
+    return r;
+}
+
+static void test_numeric_replies(void) {
+    redisReader *reader;
+    redisReply *reply, r;
+    double d, values[4];
+    int64_t ll, lls[4];
+    size_t n;
+    char buf[64];
+    const char *bad[] = {"", "-", ".", "1.2.3", "1e", "1e+", "abc", "1,5",
+                         " 1", "1 ", "infx", "0x10", NULL};
+    const char *exact[] = {"0.1", "1e23", "2.2250738585072011e-308", "1e-400",
+                           "123456789012345678901234", "0.30000000000000004",
+                           "9007199254740993", "4.9e-324", "1.7976931348623157e308",
+                           "00000000000000000000000000012.5", NULL};
+    int ret, i, ok;
+
+    test("Doubles are parsed from strings: ");
+    test_cond(redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,"3.14"),&d) == REDIS_OK &&
+        d == 3.14 &&
+        redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,"-2e3"),&d) == REDIS_OK &&
+        d == -2000 &&
+        redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STATUS,"+.5"),&d) == REDIS_OK &&
+        d == 0.5);
+
+    test("Doubles are parsed like strtod in the C locale: ");
+    for (i = 0, ok = 1; exact[i] != NULL; i++)
+        ok &= redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,exact[i]),&d) == REDIS_OK &&
+              d == strtod(exact[i],NULL);
+    srand(1234);
+    for (i = 0; i < 100000 && ok; i++) {
+        double v = (double)rand()/RAND_MAX*(rand()%2 ? 1e6 : 1e-3);
+        snprintf(buf,sizeof(buf),i%3 ? "%.17g" : "%.6f",v);
+        ok &= redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,buf),&d) == REDIS_OK &&
+              d == strtod(buf,NULL);
+    }
+    test_cond(ok);
+
+    if (setlocale(LC_NUMERIC,"de_DE.UTF-8") != NULL) {
+        test("Doubles don't depend on the locale: ");
+        test_cond(redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,"1.5"),&d) == REDIS_OK &&
+            d == 1.5 &&
+            redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,"12345678901234567890.5"),&d) == REDIS_OK &&
+            d == 12345678901234567890.5);
+        setlocale(LC_NUMERIC,"C");
+    }
+
+    test("Doubles accept inf and nan: ");
+    test_cond(redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,"-inf"),&d) == REDIS_OK &&
+        d < 0 && d*0 != 0 &&
+        redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,"nan"),&d) == REDIS_OK &&
+        d != d);
+
+    test("Malformed doubles are rejected: ");
+    for (i = 0, ok = 1; bad[i] != NULL; i++)
+        ok &= redisReplyAsDouble(string_reply(&r,REDIS_REPLY_STRING,bad[i]),&d) == REDIS_ERR;
+    test_cond(ok && redisReplyAsDouble(string_reply(&r,REDIS_REPLY_NIL,"1"),&d) == REDIS_ERR);
+
+    test("Integers are parsed from strings and integral doubles: ");
+    memset(&r,0,sizeof(r));
+    r.type = REDIS_REPLY_DOUBLE;
+    r.dval = 3;
+    ret = redisReplyAsInt64(&r,&ll) == REDIS_OK && ll == 3;
+    r.dval = 3.5;
+    ret &= redisReplyAsInt64(&r,&ll) == REDIS_ERR;
+    test_cond(ret &&
+        redisReplyAsInt64(string_reply(&r,REDIS_REPLY_STRING,"-42"),&ll) == REDIS_OK && ll == -42 &&
+        redisReplyAsInt64(string_reply(&r,REDIS_REPLY_STRING,"1.0"),&ll) == REDIS_ERR &&
+        redisReplyAsInt64(string_reply(&r,REDIS_REPLY_STRING,"9223372036854775808"),&ll) == REDIS_ERR);
+
+    test("Scores of a WITHSCORES reply are converted in bulk: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"*4\r\n$1\r\na\r\n$3\r\n1.5\r\n$1\r\nb\r\n$4\r\n-2e3\r\n",37);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK);
+    test_cond(redisReplyArrayAsDoubles(reply,1,2,values,&n) == REDIS_OK &&
+        n == 2 && values[0] == 1.5 && values[1] == -2000 &&
+        redisReplyArrayAsDoubles(reply,0,2,values,&n) == REDIS_ERR);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Lazy arrays are converted without decoding elements: ");
+    reader = redisReaderCreate();
+    redisReaderEnableLazyArrays(reader);
+    redisReaderFeed(reader,(char*)"*4\r\n:7\r\n$2\r\n-8\r\n,9\r\n+10\r\n",25);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK);
+    test_cond(redisReplyArrayAsInt64s(reply,0,1,lls,&n) == REDIS_OK &&
+        n == 4 && lls[0] == 7 && lls[1] == -8 && lls[2] == 9 && lls[3] == 10 &&
+        reply->element[1] == NULL && reply->element[2] != NULL &&
+        redisReplyArrayAsDoubles(reply,0,1,values,&n) == REDIS_OK &&
+        n == 4 && values[1] == -8 && values[2] == 9);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+}
+
+static void test_reply_arena(void) {
+    redisReader *reader;
+    redisReply *reply;
+    char *buf;
+    int ret, i;
+
+    test("Arena mode can't be enabled with custom reply functions: ");
+    reader = redisReaderCreate();
+    reader->fn = NULL;
+    test_cond(redisReaderEnableReplyArena(reader) == REDIS_ERR);
+    redisReaderFree(reader);
+
+    test("Arena mode builds nested multi bulk replies: ");
+    reader = redisReaderCreate();
+    assert(redisReaderEnableReplyArena(reader) == REDIS_OK);
+    redisReaderFeed(reader,(char*)"*3\r\n$3\r\nfoo\r\n*2\r\n:42\r\n$-1\r\n+OK\r\n",32);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK &&
+        reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 &&
+        reply->element[0]->type == REDIS_REPLY_STRING &&
+        strcmp(reply->element[0]->str,"foo") == 0 &&
+        reply->element[1]->type == REDIS_REPLY_ARRAY &&
+        reply->element[1]->elements == 2 &&
+        reply->element[1]->element[0]->integer == 42 &&
+        reply->element[1]->element[1]->type == REDIS_REPLY_NIL &&
+        reply->element[2]->type == REDIS_REPLY_STATUS &&
+        strcmp(reply->element[2]->str,"OK") == 0);
+    freeReplyObject(reply);
+
+    /* Larger than the first chunk, valgrind will bark on leaks. */
+    test("Arena mode grows for large multi bulk replies: ");
+    buf = malloc(16+10000*11);
+    ret = sprintf(buf,"*10000\r\n");
+    for (i = 0; i < 10000; i++)
+        ret += sprintf(buf+ret,"$4\r\n%04d\r\n",i);
+    redisReaderFeed(reader,buf,ret);
+    free(buf);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->elements == 10000 &&
+        strcmp(reply->element[0]->str,"0000") == 0 &&
+        strcmp(reply->element[9999]->str,"9999") == 0);
+    freeReplyObject(reply);
+
+    test("Arena mode frees partial replies on protocol errors: ");
+    redisReaderFeed(reader,(char*)"*2\r\n$3\r\nfoo\r\n@\r\n",16);
+    ret = redisReaderGetReply(reader,NULL);
+    test_cond(ret == REDIS_ERR);
+    redisReaderFree(reader);
+}
+
+static void test_large_bulks(void) {
+    redisReader *reader;
+    redisReply *reply;
+    size_t len = 200000, i;
+    char *big = malloc(len);
+    int ret;
+
+    memset(big,'x',len);
+
+    test("Large bulks become their reply without a copy: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"$200000\r\n",9);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    for (i = 0; i < len; i += 1000)
+        redisReaderFeed(reader,big+i,1000);
+    redisReaderFeed(reader,(char*)"\r\n",2);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply->type == REDIS_REPLY_STRING &&
+        (size_t)reply->len == len && memcmp(reply->str,big,len) == 0 &&
+        reply->owner != NULL && reader->len == 0);
+    freeReplyObject(reply);
+
+    test("Large bulks in arrays become their reply without a copy: ");
+    redisReaderFeed(reader,(char*)"*2\r\n$200000\r\n",13);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    for (i = 0; i < len; i += 1000)
+        redisReaderFeed(reader,big+i,1000);
+    redisReaderFeed(reader,(char*)"\r\n",2);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    redisReaderFeed(reader,(char*)"$3\r\nfoo\r\n",9);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    redisReaderFree(reader);
+    test_cond(ret == REDIS_OK && reply->elements == 2 &&
+        (size_t)reply->element[0]->len == len && reply->element[0]->owner != NULL &&
+        memcmp(reply->element[0]->str,big,len) == 0 &&
+        strcmp(reply->element[1]->str,"foo") == 0);
+    freeReplyObject(reply);
+
+    test("Large bulks in lazy arrays are decoded with a copy: ");
+    reader = redisReaderCreate();
+    redisReaderEnableLazyArrays(reader);
+    redisReaderFeed(reader,(char*)"*1\r\n$200000\r\n",13);
+    redisReaderFeed(reader,big,len);
+    redisReaderFeed(reader,(char*)"\r\n",2);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    redisReaderFree(reader);
+    assert(ret == REDIS_OK && reply->elements == 1);
+    test_cond(redisReplyElement(reply,0) != NULL &&
+        (size_t)reply->element[0]->len == len &&
+        memcmp(reply->element[0]->str,big,len) == 0);
+    freeReplyObject(reply);
+    free(big);
+}
+
+static void test_borrowed_strings(void) {
+    redisReader *reader;
+    redisReply *reply, *reply2;
+    char big[4096];
+    int ret;
+
+    test("Borrowed strings can't be enabled with custom reply functions: ");
+    reader = redisReaderCreate();
+    reader->fn = NULL;
+    test_cond(redisReaderEnableBorrowedStrings(reader) == REDIS_ERR);
+    redisReaderFree(reader);
+
+    test("Borrowed strings point into the reader buffer: ");
+    reader = redisReaderCreate();
+    assert(redisReaderEnableBorrowedStrings(reader) == REDIS_OK);
+    redisReaderFeed(reader,(char*)"$5\r\nhello\r\n+OK\r\n",16);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK);
+    assert(reply->str >= reader->buf && reply->str < reader->buf+reader->len);
+    ret = redisReaderGetReply(reader,(void**)&reply2);
+    test_cond(ret == REDIS_OK &&
+        reply->type == REDIS_REPLY_STRING && reply->len == 5 &&
+        strcmp(reply->str,"hello") == 0 &&
+        reply2->type == REDIS_REPLY_STATUS && strcmp(reply2->str,"OK") == 0);
+    freeReplyObject(reply2);
+
+    /* Growing the buffer must not move the bytes of the held reply. */
+    test("Borrowed strings survive reader buffer growth and free: ");
+    memset(big,'x',sizeof(big));
+    redisReaderFeed(reader,(char*)"$4096\r\n",7);
+    redisReaderFeed(reader,big,sizeof(big));
+    redisReaderFeed(reader,(char*)"\r\n",2);
+    ret = redisReaderGetReply(reader,(void**)&reply2);
+    assert(ret == REDIS_OK && reply2->len == 4096);
+    redisReaderFree(reader);
+    test_cond(strcmp(reply->str,"hello") == 0 &&
+        memcmp(reply2->str,big,sizeof(big)) == 0);
+    freeReplyObject(reply);
+    freeReplyObject(reply2);
+
+    test("Borrowed strings in arena mode are released on protocol errors: ");
+    reader = redisReaderCreate();
+    assert(redisReaderEnableReplyArena(reader) == REDIS_OK);
+    assert(redisReaderEnableBorrowedStrings(reader) == REDIS_OK);
+    redisReaderFeed(reader,(char*)"*2\r\n$3\r\nfoo\r\n",13);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    redisReaderFeed(reader,big,sizeof(big)); /* Moves the unparsed tail */
+    redisReaderFeed(reader,(char*)"$3\r\nbar\r\n",9);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_ERR);
+    redisReaderFree(reader);
+
+    test("Borrowed strings work in arena mode: ");
+    reader = redisReaderCreate();
+    assert(redisReaderEnableReplyArena(reader) == REDIS_OK);
+    assert(redisReaderEnableBorrowedStrings(reader) == REDIS_OK);
+    redisReaderFeed(reader,(char*)"*2\r\n$3\r\nfoo\r\n",13);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    redisReaderFeed(reader,(char*)"$4096\r\n",7);
+    redisReaderFeed(reader,big,sizeof(big));
+    redisReaderFeed(reader,(char*)"\r\n",2);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    redisReaderFree(reader);
+    test_cond(ret == REDIS_OK && reply->elements == 2 &&
+        strcmp(reply->element[0]->str,"foo") == 0 &&
+        reply->element[1]->len == 4096 &&
+        memcmp(reply->element[1]->str,big,sizeof(big)) == 0);
+    freeReplyObject(reply);
+}
+
+static void test_reader_segments(void) {
+    redisReader *reader;
+    redisReply *reply;
+    char *buf;
+    size_t i2;
+    int ret, i, len;
+
+    /* A bulk larger than a segment that arrives in small reads, followed by
+     * a reply in the same read, must end up contiguous and intact. */
+    test("Parses a bulk larger than the reader segment in small reads: ");
+    reader = redisReaderCreate();
+    buf = malloc(100000+64);
+    len = sprintf(buf,"$100000\r\n");
+    for (i = 0; i < 100000; i++)
+        buf[len++] = 'a'+(i%26);
+    len += sprintf(buf+len,"\r\n:1\r\n");
+    for (i = 0; i < len; i += 1000) {
+        redisReaderFeed(reader,buf+i,len-i < 1000 ? len-i : 1000);
+        ret = redisReaderGetReply(reader,(void**)&reply);
+        assert(ret == REDIS_OK);
+        if (reply != NULL) break;
+    }
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STRING &&
+        reply->len == 100000 && memcmp(reply->str,buf+9,100000) == 0);
+    freeReplyObject(reply);
+    free(buf);
+
+    test("Parses the reply that followed it: ");
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply != NULL &&
+        reply->type == REDIS_REPLY_INTEGER && reply->integer == 1);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Parses replies written straight into reserved space: ");
+    reader = redisReaderCreate();
+    buf = redisReaderReserve(reader,&i2);
+    assert(buf != NULL && i2 >= 10);
+    memcpy(buf,"+OK\r\n:42",8);
+    redisReaderCommit(reader,8);
+    buf = redisReaderReserve(reader,&i2);
+    memcpy(buf,"\r\n",2);
+    redisReaderCommit(reader,2);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    assert(ret == REDIS_OK && reply != NULL);
+    test_cond(reply->type == REDIS_REPLY_STATUS && strcmp(reply->str,"OK") == 0);
+    freeReplyObject(reply);
+    ret = redisReaderGetReply(reader,(void**)&reply);
+    test_cond(ret == REDIS_OK && reply != NULL &&
+        reply->type == REDIS_REPLY_INTEGER && reply->integer == 42);
+    freeReplyObject(reply);
+
+    redisReaderFree(reader);
+
+    test("Grows the reserved space when reads fill it: ");
+    reader = redisReaderCreate();
+    buf = redisReaderReserve(reader,&i2);
+    len = (int)i2;
+    memset(buf,'+',i2);
+    redisReaderCommit(reader,i2);
+    test_cond(reader->readsize == (size_t)len*2);
+
+    test("Shrinks it again when reads are small: ");
+    for (i = 0; i < 8; i++) {
+        buf = redisReaderReserve(reader,&i2);
+        redisReaderCommit(reader,1);
+    }
+    test_cond(reader->readsize == (size_t)len);
+    redisReaderFree(reader);
+}
+
+/* Reply functions that collect streamed bulk payloads in "streamed". */
+static char streamed[200000];
+static size_t streamedlen = 0;
+static int streamedchunks = 0, streamedend = 0;
+
+static void *stream_create_string(const redisReadTask *task, char *str, size_t len) {
+    (void)task; (void)str; (void)len;
+    return (void*)REDIS_REPLY_STRING;
+}
+
+static void *stream_create_array(const redisReadTask *task, int elements) {
+    (void)task; (void)elements;
+    return (void*)REDIS_REPLY_ARRAY;
+}
+
+static void *stream_create_integer(const redisReadTask *task, long long value) {
+    (void)task; (void)value;
+    return (void*)REDIS_REPLY_INTEGER;
+}
+
+static void *stream_create_nil(const redisReadTask *task) {
+    (void)task;
+    return (void*)REDIS_REPLY_NIL;
+}
+
+static void stream_free(void *obj) {
+    (void)obj;
+}
+
+static void *stream_begin(const redisReadTask *task, size_t len) {
+    (void)task;
+    assert(len <= sizeof(streamed));
+    streamedlen = 0;
+    streamedchunks = 0;
+    return streamed;
+}
+
+static int stream_append(const redisReadTask *task, void *obj, const char *buf, size_t len) {
+    (void)task;
+    assert(obj == streamed && streamedlen+len <= sizeof(streamed));
+    memcpy(streamed+streamedlen,buf,len);
+    streamedlen += len;
+    streamedchunks++;
+    return REDIS_OK;
+}
+
+static int stream_end(const redisReadTask *task, void *obj) {
+    (void)task; (void)obj;
+    streamedend++;
+    return REDIS_OK;
+}
+
+static redisReplyObjectFunctions streamFunctions = {
+    stream_create_string,
+    stream_create_array,
+    stream_create_integer,
+    stream_create_nil,
+    stream_free,
+    stream_begin,
+    stream_append,
+    stream_end,
+    NULL,
+    NULL
+};
+
+static void test_streamed_bulk(void) {
+    redisReader *reader;
+    void *reply = NULL;
+    char *buf;
+    int ret, i, len, maxlen = 0;
+
+    test("Streams a bulk payload that arrives in small reads: ");
+    reader = redisReaderCreate();
+    reader->fn = &streamFunctions;
+    buf = malloc(100000+64);
+    len = sprintf(buf,"*2\r\n$100000\r\n");
+    for (i = 0; i < 100000; i++)
+        buf[len++] = 'a'+(i%26);
+    len += sprintf(buf+len,"\r\n$3\r\nfoo\r\n");
+    for (i = 0; i < len; i += 1000) {
+        redisReaderFeed(reader,buf+i,len-i < 1000 ? len-i : 1000);
+        if ((int)reader->len > maxlen) maxlen = reader->len;
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_OK);
+        if (reply != NULL) break;
+    }
+    test_cond(reply == (void*)REDIS_REPLY_ARRAY &&
+        streamedlen == 100000 && memcmp(streamed,buf+13,100000) == 0 &&
+        streamedchunks > 1 && streamedend == 1);
+    free(buf);
+
+    test("Doesn't buffer the streamed payload: ");
+    test_cond(maxlen <= 1000+15);
+
+    test("Streams a payload whose \\r\\n arrives separately: ");
+    streamedend = 0;
+    redisReaderFeed(reader,(char*)"$5\r\nhel",7);
+    ret = redisReaderGetReply(reader,&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    redisReaderFeed(reader,(char*)"lo\r",3);
+    ret = redisReaderGetReply(reader,&reply);
+    assert(ret == REDIS_OK && reply == NULL && streamedend == 0);
+    redisReaderFeed(reader,(char*)"\n",1);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_OK && reply == streamed && streamedend == 1 &&
+        streamedlen == 5 && memcmp(streamed,"hello",5) == 0);
+    redisReaderFree(reader);
+}
+
+/* Reply functions that only count streamed bytes, for bulks that don't fit
+ * in memory. */
+static unsigned long long hugelen = 0, hugecount = 0;
+
+static void *huge_begin(const redisReadTask *task, size_t len) {
+    (void)task;
+    hugelen = len;
+    hugecount = 0;
+    return (void*)REDIS_REPLY_STRING;
+}
+
+static int huge_append(const redisReadTask *task, void *obj, const char *buf, size_t len) {
+    (void)task; (void)obj; (void)buf;
+    hugecount += len;
+    return REDIS_OK;
+}
+
+static redisReplyObjectFunctions hugeFunctions = {
+    stream_create_string,
+    stream_create_array,
+    stream_create_integer,
+    stream_create_nil,
+    stream_free,
+    huge_begin,
+    huge_append,
+    stream_end,
+    NULL,
+    NULL
+};
+
+static void test_huge_lengths(void) {
+    redisReader *reader;
+    redisContext *c;
+    redisArg argv[3];
+    unsigned long long huge = 4500000000ULL, fed;
+    size_t chunk = 1024*1024, len;
+    char *buf = malloc(chunk), *cmd, *big, *out;
+    void *obj = NULL;
+    int ret, fds[2];
+
+    test("Streams a bulk of more than 4GB: ");
+    memset(buf,'x',chunk);
+    reader = redisReaderCreate();
+    reader->fn = &hugeFunctions;
+    streamedend = 0;
+    redisReaderFeed(reader,(char*)"$4500000000\r\n",13);
+    for (fed = 0; fed < huge; fed += len) {
+        len = huge-fed < chunk ? huge-fed : chunk;
+        redisReaderFeed(reader,buf,len);
+        ret = redisReaderGetReply(reader,&obj);
+        assert(ret == REDIS_OK && obj == NULL);
+    }
+    redisReaderFeed(reader,(char*)"\r\n",2);
+    ret = redisReaderGetReply(reader,&obj);
+    test_cond(ret == REDIS_OK && obj == (void*)REDIS_REPLY_STRING &&
+        hugelen == huge && hugecount == huge && streamedend == 1);
+    redisReaderFree(reader);
+
+#ifndef HIREDIS_WIDE_REPLY
+    test("Bulks that don't fit a reply are refused before buffering them: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"$3000000000\r\n",13);
+    ret = redisReaderGetReply(reader,NULL);
+    test_cond(ret == REDIS_ERR && reader->bulkend == 0 &&
+        strcasecmp(reader->errstr,"Bulk length out of range") == 0);
+    redisReaderFree(reader);
+
+    test("Also in lazy arrays: ");
+    reader = redisReaderCreate();
+    redisReaderEnableLazyArrays(reader);
+    redisReaderFeed(reader,(char*)"*1\r\n$3000000000\r\n",17);
+    ret = redisReaderGetReply(reader,NULL);
+    test_cond(ret == REDIS_ERR &&
+        strcasecmp(reader->errstr,"Bulk length out of range") == 0);
+    redisReaderFree(reader);
+#else
+    test("Wide replies accept bulks of more than 2GB: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"$3000000000\r\n",13);
+    ret = redisReaderGetReply(reader,&obj);
+    test_cond(ret == REDIS_OK && obj == NULL && reader->bulkend != 0);
+    redisReaderFree(reader);
+#endif
+
+    test("Formatting a command of more than 2GB fails: ");
+    test_cond(redisFormatCommand(&cmd,"SET %s %b","key",buf,(size_t)3000000000ULL) == -1);
+
+    /* Writes to /dev/null don't read the pages of an anonymous mapping, so
+     * it can stand in for a huge argument without using memory. */
+    test("Sends a command with an argument of more than 4GB: ");
+    big = mmap(NULL,huge,PROT_READ,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    assert(big != MAP_FAILED);
+    c = redisConnectUnix("/tmp/idontexist.sock");
+    memset(argv,0,sizeof(argv));
+    argv[0].buf = "SET";
+    argv[0].len = 3;
+    argv[1].buf = "key";
+    argv[1].len = 3;
+    argv[2].buf = big;
+    argv[2].len = huge;
+    assert(redisAppendCommandArgs(c,3,argv,NULL,NULL) == REDIS_OK);
+    len = redisPendingBytes(c);
+    c->err = 0;
+    c->fd = open("/dev/null",O_WRONLY);
+    assert(c->fd != -1);
+    do {
+        assert(redisBufferWrite(c,&ret) == REDIS_OK);
+    } while (!ret);
+    test_cond(len == 4+9+9+13+huge+2 && redisPendingBytes(c) == 0);
+    munmap(big,huge);
+    redisFree(c);
+
+    test("Commands of more than 1MB get a buffer of their own: ");
+    big = malloc(3*chunk);
+    memset(big,'y',3*chunk);
+    c = redisConnectUnix("/tmp/idontexist.sock");
+    assert(redisAppendCommand(c,"SET a %b",big,3*chunk) == REDIS_OK);
+    assert(redisAppendCommand(c,"GET a") == REDIS_OK);
+    cmd = malloc(3*chunk+64);
+    out = malloc(3*chunk+64);
+    len = sprintf(cmd,"*3\r\n$3\r\nSET\r\n$1\r\na\r\n$%zu\r\n",3*chunk);
+    memcpy(cmd+len,big,3*chunk);
+    len += 3*chunk;
+    len += sprintf(cmd+len,"\r\n*2\r\n$3\r\nGET\r\n$1\r\na\r\n");
+    assert(pipe(fds) == 0);
+    fcntl(fds[1],F_SETFL,O_NONBLOCK);
+    fcntl(fds[0],F_SETFL,O_NONBLOCK);
+    c->err = 0;
+    c->fd = fds[1];
+    c->flags &= ~REDIS_BLOCK;
+    test_cond(sdslen(c->obuf) < chunk && c->oqueue != NULL &&
+        flush_to_pipe(c,fds[0],out,3*chunk+64) == len &&
+        memcmp(out,cmd,len) == 0);
+    redisFree(c);
+    close(fds[0]);
+    free(out);
+    free(cmd);
+    free(big);
+    free(buf);
+}
+
+static int asynccalls = 0;
+
+static void async_order(redisAsyncContext *ac, void *reply, void *privdata) {
+    (void)ac;
+    if (reply != NULL)
+        *(int*)privdata = asynccalls++;
+}
+
+static void test_async_callbacks(void) {
+    redisAsyncContext *ac;
+    int order[140], fd, i;
+
+    test("Async callbacks run in order while the queue grows: ");
+    ac = async_pipe(&fd);
+    asynccalls = 0;
+    for (i = 0; i < 140; i++)
+        order[i] = -1;
+    for (i = 0; i < 60; i++)
+        redisAsyncCommand(ac,async_order,&order[i],"PING");
+    async_pong(ac,fd,60);
+    for (i = 0; i < 60 && order[i] == i; i++);
+    test_cond(i == 60 && ac->replies.count == 0);
+
+    /* The ring has 64 slots now and starts at slot 60. */
+    test("Async callbacks run in order when a wrapped queue grows: ");
+    for (i = 60; i < 70; i++)
+        redisAsyncCommand(ac,async_order,&order[i],"PING");
+    async_pong(ac,fd,6);
+    for (i = 70; i < 140; i++)
+        redisAsyncCommand(ac,async_order,&order[i],"PING");
+    async_pong(ac,fd,74);
+    for (i = 0; i < 140 && order[i] == i; i++);
+    test_cond(i == 140 && ac->replies.count == 0 && ac->replies.size == 128);
+    redisAsyncFree(ac);
+    close(fd);
+}
+
+/* What the message callback saw, for the pub/sub tests. */
+static struct {
+    int calls, foo, pattern;
+    void *privdata; /* Of the last message */
+    char last[64]; /* "channel:payload" of the last message */
+} asyncmsg;
+
+static void async_record_message(redisAsyncContext *ac, const redisMessage *msg, void *privdata) {
+    (void)ac;
+    asyncmsg.calls++;
+    asyncmsg.privdata = privdata;
+    if (msg->channellen == 3 && memcmp(msg->channel,"foo",3) == 0)
+        asyncmsg.foo++;
+    if (msg->type == REDIS_MESSAGE_PATTERN && msg->patternlen == 2 &&
+        memcmp(msg->pattern,"b*",2) == 0)
+        asyncmsg.pattern++;
+    snprintf(asyncmsg.last,sizeof(asyncmsg.last),"%.*s:%.*s",
+        (int)msg->channellen,msg->channel,(int)msg->payloadlen,msg->payload);
+}
+
+static void test_async_pubsub(void) {
+    redisAsyncContext *ac;
+    int foo = 0, bar = 0, fd, i, len;
+    static char names[5000][16];
+    const char **argv;
+    char buf[128], *big;
+    static const char sub[] =
+        "*3\r\n$9\r\nsubscribe\r\n$3\r\nfoo\r\n:1\r\n"
+        "*3\r\n$9\r\nsubscribe\r\n$3\r\nbar\r\n:2\r\n";
+    static const char msg[] =
+        "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$1\r\na\r\n"
+        "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$1\r\nb\r\n"
+        ">3\r\n$7\r\nmessage\r\n$3\r\nbar\r\n$1\r\nc\r\n"
+        "*3\r\n$7\r\nmessage\r\n$3\r\nbaz\r\n$1\r\nd\r\n"
+        "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$1\r\ne\r\n";
+    static const char unsub[] =
+        "*3\r\n$11\r\nunsubscribe\r\n$3\r\nfoo\r\n:1\r\n"
+        "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$1\r\nf\r\n"
+        "*3\r\n$11\r\nUNSUBSCRIBE\r\n$3\r\nbar\r\n:0\r\n";
+
+    static const char psub[] =
+        "*3\r\n$9\r\nsubscribe\r\n$3\r\nfoo\r\n:1\r\n"
+        "*3\r\n$10\r\npsubscribe\r\n$2\r\nb*\r\n:2\r\n";
+    static const char msgs[] =
+        "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$1\r\na\r\n"
+        "*3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$0\r\n\r\n"
+        "*4\r\n$8\r\npmessage\r\n$2\r\nb*\r\n$3\r\nbar\r\n$5\r\nhello\r\n";
+    static const char push[] =
+        ">3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$6\r\npushed\r\n";
+    static const char resp3sub[] =
+        ">3\r\n$9\r\nsubscribe\r\n$3\r\nfoo\r\n:1\r\n"
+        "*2\r\n$1\r\na\r\n$1\r\nb\r\n";
+    static const char resp3msg[] =
+        ">3\r\n$7\r\nmessage\r\n$3\r\nfoo\r\n$1\r\nx\r\n"
+        "*2\r\n$1\r\nc\r\n$1\r\nd\r\n";
+
+    test("Async pub/sub messages reach the callback of their channel: ");
+    ac = async_pipe(&fd);
+    redisAsyncCommand(ac,async_message,&foo,"SUBSCRIBE foo");
+    redisAsyncCommand(ac,async_message,&bar,"SUBSCRIBE bar");
+    assert(write(fd,sub,sizeof(sub)-1) == (ssize_t)sizeof(sub)-1);
+    assert(write(fd,msg,sizeof(msg)-1) == (ssize_t)sizeof(msg)-1);
+    redisAsyncHandleRead(ac);
+    test_cond(foo == 3 && bar == 1);
+
+    test("Async unsubscribe removes the channel: ");
+    assert(write(fd,unsub,sizeof(unsub)-1) == (ssize_t)sizeof(unsub)-1);
+    redisAsyncHandleRead(ac);
+    test_cond(foo == 3 && bar == 1 && ac->sub.lastChannel == NULL &&
+        !(ac->c.flags & REDIS_SUBSCRIBED));
+    redisAsyncFree(ac);
+    close(fd);
+
+    test("Async message callback gets messages decoded in place: ");
+    ac = async_pipe(&fd);
+    memset(&asyncmsg,0,sizeof(asyncmsg));
+    redisAsyncSetMessageCallback(ac,async_record_message);
+    redisAsyncCommand(ac,async_message,&foo,"SUBSCRIBE foo");
+    redisAsyncCommand(ac,async_message,&bar,"PSUBSCRIBE b*");
+    assert(write(fd,psub,sizeof(psub)-1) == (ssize_t)sizeof(psub)-1);
+    redisAsyncHandleRead(ac);
+    assert(write(fd,msgs,sizeof(msgs)-1) == (ssize_t)sizeof(msgs)-1);
+    redisAsyncHandleRead(ac);
+    test_cond(asyncmsg.calls == 3 && asyncmsg.foo == 2 && asyncmsg.pattern == 1 &&
+        strcmp(asyncmsg.last,"bar:hello") == 0 && asyncmsg.privdata == &bar &&
+        foo == 3 && bar == 1);
+
+    test("Async message callback gets messages split across reads: ");
+    assert(write(fd,msgs,10) == 10);
+    redisAsyncHandleRead(ac);
+    assert(write(fd,msgs+10,sizeof(msgs)-11) == (ssize_t)sizeof(msgs)-11);
+    redisAsyncHandleRead(ac);
+    test_cond(asyncmsg.calls == 6 && asyncmsg.foo == 4 && asyncmsg.pattern == 2);
+
+    redisAsyncFree(ac);
+    close(fd);
+
+    test("Async message callback gets push messages while a command waits: ");
+    ac = async_pipe(&fd);
+    redisAsyncSetMessageCallback(ac,async_record_message);
+    redisAsyncCommand(ac,NULL,NULL,"PING");
+    redisAsyncCommand(ac,async_message,&foo,"SUBSCRIBE foo");
+    assert(write(fd,push,sizeof(push)-1) == (ssize_t)sizeof(push)-1);
+    redisAsyncHandleRead(ac);
+    test_cond(asyncmsg.calls == 7 && asyncmsg.foo == 5 &&
+        strcmp(asyncmsg.last,"foo:pushed") == 0 && asyncmsg.privdata == &foo &&
+        ac->replies.count == 1);
+    redisAsyncFree(ac);
+    close(fd);
+
+    /* With RESP3, commands can be sent while subscribed and their replies
+     * are interleaved with push messages. */
+    test("Async commands get their replies while subscribed with RESP3: ");
+    ac = async_pipe(&fd);
+    foo = bar = 0;
+    redisAsyncCommand(ac,async_message,&foo,"SUBSCRIBE foo");
+    redisAsyncCommand(ac,async_count,&bar,"LRANGE l 0 -1");
+    assert(write(fd,resp3sub,sizeof(resp3sub)-1) == (ssize_t)sizeof(resp3sub)-1);
+    redisAsyncHandleRead(ac);
+    assert(bar == 1 && ac->sub.invalid.count == 0);
+    redisAsyncCommand(ac,async_count,&bar,"LRANGE l 0 -1");
+    assert(write(fd,resp3msg,sizeof(resp3msg)-1) == (ssize_t)sizeof(resp3msg)-1);
+    redisAsyncHandleRead(ac);
+    test_cond(foo == 1 && bar == 2 && ac->replies.count == 0 &&
+        ac->sub.invalid.count == 0);
+    redisAsyncFree(ac);
+    close(fd);
+
+    test("Async subscribe to thousands of channels in one command: ");
+    ac = async_pipe(&fd);
+    argv = malloc(sizeof(*argv)*5001);
+    argv[0] = "SUBSCRIBE";
+    for (i = 0; i < 5000; i++) {
+        snprintf(names[i],sizeof(names[i]),"chan:%d",i);
+        argv[i+1] = names[i];
+    }
+    foo = 0;
+    redisAsyncCommandArgv(ac,async_message,&foo,5001,argv,NULL);
+    for (i = 0; i < 5000; i += 7) {
+        len = sprintf(buf,"*3\r\n$7\r\nmessage\r\n$%d\r\n%s\r\n$1\r\nx\r\n",
+            (int)strlen(names[i]),names[i]);
+        assert(write(fd,buf,len) == len);
+        if (i % 700 == 0)
+            redisAsyncHandleRead(ac);
+    }
+    redisAsyncHandleRead(ac);
+    assert(foo == 715);
+    for (i = 0; i < 5000; i++) {
+        len = sprintf(buf,"*3\r\n$11\r\nunsubscribe\r\n$%d\r\n%s\r\n:%d\r\n",
+            (int)strlen(names[i]),names[i],4999-i);
+        assert(write(fd,buf,len) == len);
+        if (i % 700 == 0)
+            redisAsyncHandleRead(ac);
+    }
+    redisAsyncHandleRead(ac);
+    test_cond(foo == 715 && !(ac->c.flags & REDIS_SUBSCRIBED));
+    free(argv);
+    redisAsyncFree(ac);
+    close(fd);
+
+    /* Commands of more than 1MB are queued in a block of their own. */
+    test("Async subscribe to a channel with a 2MB name: ");
+    ac = async_pipe(&fd);
+    big = malloc(2*1024*1024);
+    memset(big,'c',2*1024*1024);
+    test_cond(redisAsyncCommand(ac,async_message,&foo,"SUBSCRIBE %b",
+            big,(size_t)2*1024*1024) == REDIS_OK &&
+        (ac->c.flags & REDIS_SUBSCRIBED) &&
+        redisAsyncCommand(ac,NULL,NULL,"UNSUBSCRIBE %b",
+            big,(size_t)2*1024*1024) == REDIS_OK &&
+        redisPendingBytes(&ac->c) > 4*1024*1024);
+    free(big);
+    redisAsyncFree(ac);
+    close(fd);
+}
+
+/* Callback that records how it was called, for the timeout tests. */
+static struct {
+    int calls, timeouts, replies, disconnects;
+    long long delay; /* Of the last addTimer */
+} asynctimeout;
+
+static void async_timeout_cb(redisAsyncContext *ac, void *reply, void *privdata) {
+    (void)privdata;
+    asynctimeout.calls++;
+    if (reply == NULL && ac->err == REDIS_ERR_TIMEOUT)
+        asynctimeout.timeouts++;
+    else if (reply != NULL)
+        asynctimeout.replies++;
+}
+
+static void async_add_timer(void *privdata, struct timeval tv) {
+    (void)privdata;
+    asynctimeout.delay = tv.tv_sec*1000+tv.tv_usec/1000;
+}
+
+static void async_timeout_disconnect(const redisAsyncContext *ac, int status) {
+    if (status == REDIS_ERR && ac->err == REDIS_ERR_TIMEOUT)
+        asynctimeout.disconnects++;
+}
+
+static void test_async_timeouts(void) {
+    struct timeval tv = {0,10000}, none = {0,0}, longer = {1,0};
+    redisAsyncContext *ac;
+    int fd, i;
+
+    test("Async commands time out when their reply doesn't arrive: ");
+    memset(&asynctimeout,0,sizeof(asynctimeout));
+    ac = async_pipe(&fd);
+    ac->ev.addTimer = async_add_timer;
+    redisAsyncSetTimeout(ac,tv,0);
+    for (i = 0; i < 3; i++)
+        redisAsyncCommand(ac,async_timeout_cb,NULL,"PING");
+    redisAsyncHandleTimeout(ac);
+    assert(asynctimeout.calls == 0);
+    usleep(20000);
+    redisAsyncHandleTimeout(ac);
+    test_cond(asynctimeout.timeouts == 3 && asynctimeout.delay > 0 &&
+        asynctimeout.delay <= 10 && ac->err == 0 && ac->timeout.expired == 3);
+
+    test("Replies of commands that timed out are dropped in order: ");
+    redisAsyncCommand(ac,async_timeout_cb,NULL,"PING");
+    async_pong(ac,fd,4);
+    test_cond(asynctimeout.calls == 4 && asynctimeout.replies == 1 &&
+        ac->timeout.expired == 0 && ac->replies.count == 0);
+
+    test("Every command gets the timeout that was set when it was sent: ");
+    memset(&asynctimeout,0,sizeof(asynctimeout));
+    redisAsyncCommand(ac,async_timeout_cb,NULL,"PING");
+    redisAsyncSetTimeout(ac,none,0);
+    redisAsyncCommand(ac,async_timeout_cb,NULL,"PING");
+    redisAsyncSetTimeout(ac,longer,0);
+    redisAsyncCommand(ac,async_timeout_cb,NULL,"PING");
+    usleep(20000);
+    redisAsyncHandleTimeout(ac);
+    async_pong(ac,fd,3);
+    test_cond(asynctimeout.calls == 3 && asynctimeout.timeouts == 1 &&
+        asynctimeout.replies == 2 && ac->timeout.expired == 0);
+
+    test("Timeouts of more than 64ms expire on time: ");
+    memset(&asynctimeout,0,sizeof(asynctimeout));
+    tv.tv_usec = 150000;
+    redisAsyncSetTimeout(ac,tv,0);
+    redisAsyncCommand(ac,async_timeout_cb,NULL,"PING");
+    usleep(100000);
+    redisAsyncHandleTimeout(ac);
+    assert(asynctimeout.calls == 0);
+    usleep(60000);
+    redisAsyncHandleTimeout(ac);
+    test_cond(asynctimeout.timeouts == 1);
+
+    test("Long timeouts don't wake the event loop every 64ms: ");
+    memset(&asynctimeout,0,sizeof(asynctimeout));
+    redisAsyncSetTimeout(ac,longer,0);
+    redisAsyncCommand(ac,async_timeout_cb,NULL,"PING");
+    test_cond(asynctimeout.delay > 900 && asynctimeout.delay <= 1000);
+    async_pong(ac,fd,2);
+    redisAsyncFree(ac);
+    close(fd);
+
+    test("Too many commands that timed out close the connection: ");
+    memset(&asynctimeout,0,sizeof(asynctimeout));
+    ac = async_pipe(&fd);
+    redisAsyncSetDisconnectCallback(ac,async_timeout_disconnect);
+    tv.tv_usec = 5000;
+    redisAsyncSetTimeout(ac,tv,2);
+    for (i = 0; i < 3; i++)
+        redisAsyncCommand(ac,async_timeout_cb,NULL,"PING");
+    usleep(10000);
+    redisAsyncHandleTimeout(ac);
+    close(fd);
+    test_cond(asynctimeout.timeouts == 3 && asynctimeout.calls == 3 &&
+        asynctimeout.disconnects == 1);
+}
+
 static void test_blocking_connection_errors(void) {
     redisContext *c;
 
@@ -383,6 +2422,18 @@ static void test_blocking_connection(struct config config) {
               strcasecmp(reply->element[1]->str,"pong") == 0);
     freeReplyObject(reply);
 
+    test("Can send prepared commands: ");
+    {
+        redisFormat *fmt = redisPrepareFormat("SET %s:%d %b");
+        assert(redisAppendPrepared(c,fmt,"foo",42,"bar",(size_t)3) == REDIS_OK);
+        assert(redisGetReply(c,(void**)&reply) == REDIS_OK);
+        freeReplyObject(reply);
+        redisFreeFormat(fmt);
+    }
+    reply = redisCommand(c,"GET foo:42");
+    test_cond(reply->type == REDIS_REPLY_STRING && strcmp(reply->str,"bar") == 0);
+    freeReplyObject(reply);
+
     disconnect(c);
 }
 
@@ -461,11 +2512,50 @@ static void test_invalid_timeout_errors(struct config config) {
     redisFree(c);
 }
 
+static redisAsyncContext *async_connect(struct config config) {
+    redisAsyncContext *ac = NULL;
+
+    if (config.type == CONN_TCP) {
+        ac = redisAsyncConnect(config.tcp.host, config.tcp.port);
+    } else if (config.type == CONN_UNIX) {
+        ac = redisAsyncConnectUnix(config.unix.path);
+    } else {
+        assert(NULL);
+    }
+
+    if (ac == NULL) {
+        printf("Connection error: can't allocate redis context\n");
+        exit(1);
+    } else if (ac->err) {
+        printf("Connection error: %s\n", ac->errstr);
+        exit(1);
+    }
+    return ac;
+}
+
+/* Handle the events of an async context until *n reaches num. */
+static void async_wait(redisAsyncContext *ac, int *n, int num) {
+    struct pollfd pfd;
+
+    pfd.fd = ac->c.fd;
+    while (*n < num) {
+        pfd.events = POLLIN;
+        if (redisPendingBytes(&ac->c) > 0 || !(ac->c.flags & REDIS_CONNECTED))
+            pfd.events |= POLLOUT;
+        assert(poll(&pfd,1,10000) == 1);
+        if (pfd.revents & POLLOUT)
+            redisAsyncHandleWrite(ac);
+        if (pfd.revents & POLLIN)
+            redisAsyncHandleRead(ac);
+    }
+}
+
 static void test_throughput(struct config config) {
     redisContext *c = connect(config);
+    redisAsyncContext *ac;
     redisReply **replies;
-    int i, num;
-    long long t1, t2;
+    int i, num, n;
+    long long t1, t2, t3;
 
     test("Throughput:\n");
     for (i = 0; i < 500; i++)
@@ -523,6 +2613,19 @@ static void test_throughput(struct config config) {
     free(replies);
     printf("\t(%dx LRANGE with 500 elements (pipelined): %.3fs)\n", num, (t2-t1)/1000000.0);
 
+    num = 100000;
+    ac = async_connect(config);
+    n = 0;
+    t1 = usec();
+    for (i = 0; i < num; i++)
+        redisAsyncCommand(ac,async_count,&n,"PING");
+    t2 = usec();
+    async_wait(ac,&n,num);
+    t3 = usec();
+    redisAsyncFree(ac);
+    printf("\t(%dx PING (async): %.3fs, %.1f ns/command to submit)\n", num,
+        (t3-t1)/1000000.0, (t2-t1)*1000.0/num);
+
     disconnect(c);
 }
 
@@ -662,7 +2765,28 @@ int main(int argc, char **argv) {
     }
 
     test_format_commands();
+    test_prepared_formats();
+    test_append_iov();
+    test_append_files();
+    test_reply_to_fd();
+    test_output_blocks();
     test_reply_reader();
+    test_reader_events();
+    test_reader_batches();
+    test_resp3();
+    test_lazy_arrays();
+    test_numeric_replies();
+    test_reply_arena();
+    test_borrowed_strings();
+    test_large_bulks();
+    test_reader_segments();
+    test_streamed_bulk();
+    test_huge_lengths();
+    test_async_callbacks();
+    test_async_pubsub();
+    test_async_timeouts();
+    if (throughput) test_reader_throughput();
+    if (throughput) test_format_throughput();
     test_blocking_connection_errors();
 
     printf("\nTesting against TCP connection (%s:%d):\n", cfg.tcp.host, cfg.tcp.port);